@@ -4,6 +4,70 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <charconv>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <cerrno>
+#include <cstddef>
+#include <array>
+#include <memory>
+#include <cctype>
+
+//  POSIX builds map files into memory instead of reading them through streams
+#if defined(__unix__) || defined(__APPLE__)
+#define CITIES_POSIX_IO 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//  Linux builds can serve queries over sockets, see QueryServer
+#if defined(__linux__)
+#define CITIES_SERVER 1
+#include <csignal>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+//  x86 builds with GCC or Clang compile wider kernels next to the scalar ones and pick one at runtime
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CITIES_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+//  Point on the unit sphere for a latitude and longitude in degrees.
+//  The angle between two points is acos of their dot product, so once a city carries its vector
+//  a distance is three multiplies and one acos, and ranking by distance needs no trig at all.
+struct UnitVector {
+    double x = 1.0, y = 0.0, z = 0.0;    //  Latitude 0, longitude 0
+
+    static UnitVector fromDegrees(const double latitude, const double longitude) {
+        const double lat = latitude * M_PI / 180.0;
+        const double lon = longitude * M_PI / 180.0;
+        return {cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat)};
+    }
+
+    double dot(const UnitVector& other) const { return x * other.x + y * other.y + z * other.z; }
+
+    //  Squared straight line distance through the sphere, 2 - 2cos(d), grows with the angle
+    //  so it orders cities the same way the great circle distance does
+    double chordSquared(const UnitVector& other) const { return 2.0 - 2.0 * dot(other); }
+};
 
 class City {
 
@@ -15,20 +79,21 @@ class City {
         std::string name, country, history, mayorName, mayorAddress;
         int population, recordYear;
         double latitude, longitude;
+        UnitVector position;    //  Kept in step with latitude and longitude
 
         //  Constructor and Destructor
         // Default constructor initializes attributes with default values.
         City()
         : name(), country(), history(), mayorName(), mayorAddress(),
-          population(0), recordYear(0), latitude(0.0), longitude(0.0) {}
+          population(0), recordYear(0), latitude(0.0), longitude(0.0), position(UnitVector::fromDegrees(0.0, 0.0)) {}
 
         //  Main constructor
         City (std::string cityName, std::string cityCountry, int pop, int year, double lat, double lon
             , std::string mayor, std::string address, std::string hist)
-            // Parameterized constructor to initialize a City object with given values.
-            : name(cityName), country(cityCountry), population(pop),
-            recordYear(year), latitude(lat), longitude(lon),
-            mayorName(mayor), mayorAddress(address), history(hist) {}
+            // Parameterized constructor to initialize a City object with given values, the strings are moved in.
+            : name(std::move(cityName)), country(std::move(cityCountry)), history(std::move(hist)),
+            mayorName(std::move(mayor)), mayorAddress(std::move(address)), population(pop),
+            recordYear(year), latitude(lat), longitude(lon), position(UnitVector::fromDegrees(lat, lon)) {}
 
         //  Methods
 
@@ -67,7 +132,11 @@ class City {
     void update(const std::string& field, const double value) {
             if (field == "latitude") latitude = value;
             else if (field == "longitude") longitude = value;
-            else std::cerr << "Invalid field name.\n";
+            else {
+                std::cerr << "Invalid field name.\n";
+                return;
+            }
+            position = UnitVector::fromDegrees(latitude, longitude);
         }
 
     // Compares two City objects by name and country.
@@ -78,107 +147,5156 @@ class City {
 
 };
 
-//  Class for distance formula (Haversine formula)
-//  cos d = sin(phi1)*sin(phi2) + cos(phi1)*cos(phi2)*cos(L1 - L2)
-//  (6371*pi*d) / 180 = s (km)
+//  The nine city fields in file order, for code that picks a field at run time.
+//  Names are the ones City::update and the commands already accept.
+enum class CityField { Name, Country, Population, RecordYear, Latitude, Longitude, MayorName, MayorAddress, History };
 
-class DistanceCalculator {
-    public:
+inline constexpr std::string_view CITY_FIELD_NAMES[] = {"name", "country", "population", "recordYear", "latitude",
+                                                        "longitude", "mayorName", "mayorAddress", "history"};
 
-    static constexpr double EARTH_RADIUS_KM = 6371.0;
-    //  Method to calculate the displacement between cities
-    static double calculateDistance(const City& city1, const City& city2) {
+inline std::string_view fieldName(const CityField field) { return CITY_FIELD_NAMES[static_cast<int>(field)]; }
 
-        // Converts latitude and longitude values from degrees to radians.
-        const double lat1 = city1.latitude * M_PI / 180.0;
-        const double lon1 = city1.longitude * M_PI / 180.0;
-        const double lat2 = city2.latitude * M_PI / 180.0;
-        const double lon2 = city2.longitude * M_PI / 180.0;
+//  False if text is not a field name
+inline bool parseCityField(const std::string_view text, CityField& field) {
+    for (int i = 0; i < 9; ++i) {
+        if (CITY_FIELD_NAMES[i] == text) {
+            field = static_cast<CityField>(i);
+            return true;
+        }
+    }
+    return false;
+}
 
-        //  find cos(D) angular distance sin(phi1)*sin(phi2) + cos(phi1)*cos(phi2)*cos(L1 - L2)
-        double cosD = sin(lat1) * sin(lat2) + cos(lat1) * cos(lat2) * cos(lon1 - lon2);
+inline bool isNumericField(const CityField field) {
+    return field == CityField::Population || field == CityField::RecordYear || field == CityField::Latitude ||
+           field == CityField::Longitude;
+}
 
-        //  cosD validation range = [-1, 1]
-        //  Note clamp restrains value to -1 to 1 so that trig works and no domain error.
-        cosD = std::clamp(cosD, -1.0, 1.0);
+//  Column of strings stored back to back in a single character heap.
+//  Each row keeps an offset and a length into the heap, so a column of millions of names is
+//  three allocations instead of one per row. Overwriting a value appends the new bytes and
+//  leaves the old ones unreferenced.
+class StringColumn {
+public:
+    std::string_view operator[](const std::size_t row) const {
+        const std::uint64_t offset = offsets[row];
+        if (offset & EXTERNAL) return {external + (offset & ~EXTERNAL), lengths[row]};
+        return {heap.data() + offset, lengths[row]};
+    }
+
+    //  Values pushed from inside [base, base + size) are referenced in place rather than copied into
+    //  the heap, for columns backed by a mapped file. Whoever calls this keeps that memory alive for
+    //  as long as the column uses it.
+    void referenceExternal(const char* base, const std::size_t size) {
+        external = base;
+        externalSize = size;
+    }
+
+    bool referencesExternal() const { return external != nullptr; }
+
+    std::size_t size() const { return offsets.size(); }
+
+    void reserve(const std::size_t rows, const std::size_t bytes) {
+        offsets.reserve(rows);
+        lengths.reserve(rows);
+        heap.reserve(bytes);
+    }
+
+    void push_back(const std::string_view value) {
+        offsets.push_back(isExternal(value) ? EXTERNAL | std::uint64_t(value.data() - external) : append(value));
+        lengths.push_back(static_cast<std::uint32_t>(value.size()));
+    }
+
+    void set(const std::size_t row, const std::string_view value) {
+        offsets[row] = append(value);
+        lengths[row] = static_cast<std::uint32_t>(value.size());
+    }
+
+    void clear() {
+        heap.clear();
+        offsets.clear();
+        lengths.clear();
+        external = nullptr;
+        externalSize = 0;
+    }
+
+    const std::vector<std::uint32_t>& rowLengths() const { return lengths; }
+
+    //  Replaces the column with raw storage, false if any row points outside the heap
+    bool assign(std::vector<char> bytes, std::vector<std::uint64_t> starts, std::vector<std::uint32_t> sizes) {
+        if (!fits(bytes.size(), starts, sizes)) return false;
+        heap = std::move(bytes);
+        offsets = std::move(starts);
+        lengths = std::move(sizes);
+        return true;
+    }
+
+    //  Same with a heap of size bytes at base that stays where it is, every row is external to it.
+    //  Whoever calls this keeps that memory alive, as for referenceExternal.
+    bool assignExternal(const char* base, const std::size_t size, std::vector<std::uint64_t> starts,
+                        std::vector<std::uint32_t> sizes) {
+        if (!fits(size, starts, sizes)) return false;
+        for (std::uint64_t& start : starts) start |= EXTERNAL;
+        heap.clear();
+        offsets = std::move(starts);
+        lengths = std::move(sizes);
+        external = base;
+        externalSize = size;
+        return true;
+    }
+
+private:
+    static constexpr std::uint64_t EXTERNAL = std::uint64_t{1} << 63;  //  Offset flag, value lives at external
+
+    std::vector<char> heap;
+    std::vector<std::uint64_t> offsets;
+    std::vector<std::uint32_t> lengths;
+    const char* external = nullptr;
+    std::size_t externalSize = 0;
+
+    static bool fits(const std::size_t heapSize, const std::vector<std::uint64_t>& starts,
+                     const std::vector<std::uint32_t>& sizes) {
+        if (starts.size() != sizes.size()) return false;
+        for (std::size_t row = 0; row < starts.size(); ++row) {
+            if (starts[row] > heapSize || sizes[row] > heapSize - starts[row]) return false;
+        }
+        return true;
+    }
+
+    bool isExternal(const std::string_view value) const {
+        return external != nullptr && value.data() >= external && value.data() + value.size() <= external + externalSize;
+    }
+
+    std::uint64_t append(const std::string_view value) {
+        const std::uint64_t offset = heap.size();
+        //  Copy first when the value views our own heap, growing it would invalidate the view
+        if (!value.empty() && value.data() >= heap.data() && value.data() < heap.data() + heap.size()) {
+            const std::string copy(value);
+            heap.insert(heap.end(), copy.begin(), copy.end());
+        } else {
+            heap.insert(heap.end(), value.begin(), value.end());
+        }
+        return offset;
+    }
+};
+
+//  Lowercases a string the same way name searches compare it
+inline std::string foldCase(const std::string_view str) {
+    std::string folded(str);
+    std::transform(folded.begin(), folded.end(), folded.begin(), ::tolower);
+    return folded;
+}
+
+//  Levenshtein distance between two strings ignoring case. Patterns up to 64 characters use Myers'
+//  bit-parallel algorithm (Hyyro's formulation), one pass of a few word operations per character of
+//  text; longer ones fall back to the row by row dynamic programme.
+inline std::size_t editDistance(const std::string_view pattern, const std::string_view text) {
+    const std::size_t m = pattern.size();
+    if (m == 0) return text.size();
+    //  Same as ::tolower in the C locale the program runs in, without a call per character
+    auto fold = [](const char c) {
+        const auto byte = static_cast<unsigned char>(c);
+        return static_cast<unsigned char>(byte >= 'A' && byte <= 'Z' ? byte + ('a' - 'A') : byte);
+    };
+
+    if (m <= 64) {
+        //  Only the entries of characters that occur are cleared, the table is larger than most names
+        std::uint64_t peq[256];
+        for (const char c : text) peq[fold(c)] = 0;
+        for (std::size_t i = 0; i < m; ++i) peq[fold(pattern[i])] = 0;
+        for (std::size_t i = 0; i < m; ++i) peq[fold(pattern[i])] |= std::uint64_t(1) << i;
+        const std::uint64_t last = std::uint64_t(1) << (m - 1);
+        std::uint64_t pv = ~std::uint64_t(0), mv = 0;
+        std::size_t score = m;
+        for (const char c : text) {
+            const std::uint64_t eq = peq[fold(c)];
+            const std::uint64_t xv = eq | mv;
+            const std::uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            std::uint64_t ph = mv | ~(xh | pv);
+            std::uint64_t mh = pv & xh;
+            if (ph & last) ++score;
+            else if (mh & last) --score;
+            ph = ph << 1 | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+        }
+        return score;
+    }
+
+    std::vector<std::size_t> row(m + 1);
+    for (std::size_t i = 0; i <= m; ++i) row[i] = i;
+    for (std::size_t j = 1; j <= text.size(); ++j) {
+        std::size_t diagonal = row[0];
+        row[0] = j;
+        for (std::size_t i = 1; i <= m; ++i) {
+            const std::size_t above = row[i];
+            row[i] = std::min({row[i] + 1, row[i - 1] + 1,
+                               diagonal + (fold(pattern[i - 1]) != fold(text[j - 1]))});
+            diagonal = above;
+        }
+    }
+    return row[m];
+}
+
+//  Runs fn(i) for every i in [0, count) on up to maxThreads threads, all hardware threads by default,
+//  each thread taking the next index from a shared counter so uneven items balance out. The calling
+//  thread works too.
+template <typename Fn>
+void parallelFor(const std::size_t count, Fn&& fn, const std::size_t maxThreads = std::thread::hardware_concurrency()) {
+    std::atomic<std::size_t> next{0};
+    auto worker = [&] {
+        for (std::size_t i = next++; i < count; i = next++) fn(i);
+    };
+    const std::size_t threadCount = std::max<std::size_t>(1, std::min(maxThreads, count));
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < threadCount; ++i) threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads) thread.join();
+}
+
+//  Transparent hash so lookups by string_view don't build a temporary std::string
+struct StringHash {
+    using is_transparent = void;
+    std::size_t operator()(const std::string_view key) const { return std::hash<std::string_view>{}(key); }
+};
+
+//  Row identifier into a CityTable. Rows keep their id for the lifetime of the table,
+//  deleted rows are only marked so ids held by callers stay valid.
+using RowId = std::uint32_t;
+
+//  Hash index from a case folded city name to its rows, with a second composite key of
+//  (folded name, country). Row lists are kept in ascending order so results come back in
+//  table order, the same order a linear scan would produce.
+class NameIndex {
+public:
+    const std::vector<RowId>& byName(const std::string_view foldedName) const {
+        return lookup(names, foldedName);
+    }
+
+    const std::vector<RowId>& byNameAndCountry(const std::string_view foldedName, const std::string_view country) const {
+        return lookup(namesAndCountries, compositeKey(foldedName, country));
+    }
+
+    void insert(const RowId row, const std::string_view cityName, const std::string_view cityCountry) {
+        std::string folded = foldCase(cityName);
+        insertRow(namesAndCountries[compositeKey(folded, cityCountry)], row);
+        insertRow(names[std::move(folded)], row);
+    }
+
+    void erase(const RowId row, const std::string_view cityName, const std::string_view cityCountry) {
+        const std::string folded = foldCase(cityName);
+        eraseRow(names, folded, row);
+        eraseRow(namesAndCountries, compositeKey(folded, cityCountry), row);
+    }
+
+    void reserve(const std::size_t rows) {
+        names.reserve(rows);
+        namesAndCountries.reserve(rows);
+    }
+
+    void clear() {
+        names.clear();
+        namesAndCountries.clear();
+    }
+
+private:
+    using Map = std::unordered_map<std::string, std::vector<RowId>, StringHash, std::equal_to<>>;
+
+    Map names, namesAndCountries;
+
+    static std::string compositeKey(const std::string_view foldedName, const std::string_view country) {
+        std::string key;
+        key.reserve(foldedName.size() + 1 + country.size());
+        key.append(foldedName).push_back('\0');
+        key.append(country);
+        return key;
+    }
+
+    static const std::vector<RowId>& lookup(const Map& map, const std::string_view key) {
+        static const std::vector<RowId> none;
+        const auto it = map.find(key);
+        return it == map.end() ? none : it->second;
+    }
+
+    static void insertRow(std::vector<RowId>& rows, const RowId row) {
+        rows.insert(std::lower_bound(rows.begin(), rows.end(), row), row);
+    }
+
+    static void eraseRow(Map& map, const std::string_view key, const RowId row) {
+        const auto it = map.find(key);
+        if (it == map.end()) return;
+        auto& rows = it->second;
+        const auto pos = std::lower_bound(rows.begin(), rows.end(), row);
+        if (pos != rows.end() && *pos == row) rows.erase(pos);
+        if (rows.empty()) map.erase(it);
+    }
+};
+
+//  k-d tree over the cities' unit vectors for nearest neighbour queries.
+//  Straight line (chord) distance between unit vectors grows with the great circle distance, so the
+//  k closest points in 3D are exactly the k closest cities on the sphere. The tree is implicit: the
+//  node of a range [lo, hi) sits at its midpoint, split on the widest axis of the range.
+//  Rows added or moved after a build wait in a pending list that queries scan directly; the tree is
+//  rebuilt once that list grows past a fraction of the table.
+class SpatialIndex {
+public:
+    struct Neighbour {
+        RowId row;
+        double chordSquared;
+    };
+
+    void insert(const RowId row) {
+        if (state.size() <= row) state.resize(row + 1, ABSENT);
+        state[row] = PENDING;
+        pending.push_back(row);
+    }
+
+    void erase(const RowId row) {
+        if (row < state.size()) state[row] = ABSENT;
+    }
+
+    //  The row's coordinates changed, its tree node is stale
+    void move(const RowId row) {
+        if (row >= state.size() || state[row] != IN_TREE) return;
+        state[row] = PENDING;
+        pending.push_back(row);
+    }
+
+    void clear() {
+        nodes.clear();
+        state.clear();
+        pending.clear();
+    }
+
+    //  Rebuilds the tree when the next query would, queries after that only read the index
+    void settle(const std::vector<double>& xs, const std::vector<double>& ys, const std::vector<double>& zs) const {
+        if (pending.size() > std::max<std::size_t>(REBUILD_MIN, nodes.size() / REBUILD_FRACTION)) {
+            rebuild(xs, ys, zs);
+        }
+    }
+
+    //  The k rows nearest to query, nearest first, ties broken by row id.
+    //  xs, ys, zs are the table's unit vector columns, used to read pending rows and to rebuild.
+    std::vector<Neighbour> nearest(const UnitVector& query, const std::size_t k, const std::vector<double>& xs,
+                                   const std::vector<double>& ys, const std::vector<double>& zs) const {
+        std::vector<Neighbour> heap;
+        if (k == 0) return heap;
+        settle(xs, ys, zs);
+        heap.reserve(k + 1);
+
+        for (const RowId row : pending) {
+            if (state[row] != PENDING) continue;
+            offer(heap, k, row, chordSquared(query, xs[row], ys[row], zs[row]));
+        }
+        if (!nodes.empty()) search(query, k, 0, nodes.size(), heap);
+
+        std::sort_heap(heap.begin(), heap.end(), closer);
+        return heap;
+    }
+
+private:
+    static constexpr std::uint8_t ABSENT = 0, IN_TREE = 1, PENDING = 2;
+    static constexpr std::size_t REBUILD_MIN = 1024;
+    static constexpr std::size_t REBUILD_FRACTION = 16;
+
+    struct Node {
+        double coordinates[3];
+        RowId row;
+        std::uint8_t axis;
+    };
+
+    mutable std::vector<Node> nodes;
+    mutable std::vector<std::uint8_t> state;    //  Per row: ABSENT, IN_TREE or PENDING
+    mutable std::vector<RowId> pending;
+
+    static bool closer(const Neighbour& a, const Neighbour& b) {
+        return a.chordSquared < b.chordSquared || (a.chordSquared == b.chordSquared && a.row < b.row);
+    }
+
+    //  From the vector difference rather than 2 - 2dot, exact zero for the same point
+    static double chordSquared(const UnitVector& query, const double x, const double y, const double z) {
+        const double dx = query.x - x, dy = query.y - y, dz = query.z - z;
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    //  Keeps heap as a max heap of the best k candidates seen so far
+    static void offer(std::vector<Neighbour>& heap, const std::size_t k, const RowId row, const double chord) {
+        const Neighbour candidate{row, chord};
+        if (heap.size() < k) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end(), closer);
+        } else if (closer(candidate, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), closer);
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end(), closer);
+        }
+    }
+
+    void rebuild(const std::vector<double>& xs, const std::vector<double>& ys, const std::vector<double>& zs) const {
+        nodes.clear();
+        for (RowId row = 0; row < state.size(); ++row) {
+            if (state[row] == ABSENT) continue;
+            nodes.push_back({{xs[row], ys[row], zs[row]}, row, 0});
+            state[row] = IN_TREE;
+        }
+        pending.clear();
+        build(0, nodes.size());
+    }
+
+    void build(const std::size_t lo, const std::size_t hi) const {
+        if (hi - lo <= 1) return;
+        double low[3], high[3];
+        for (int a = 0; a < 3; ++a) low[a] = high[a] = nodes[lo].coordinates[a];
+        for (std::size_t i = lo + 1; i < hi; ++i) {
+            for (int a = 0; a < 3; ++a) {
+                low[a] = std::min(low[a], nodes[i].coordinates[a]);
+                high[a] = std::max(high[a], nodes[i].coordinates[a]);
+            }
+        }
+        std::uint8_t axis = 0;
+        for (std::uint8_t a = 1; a < 3; ++a) {
+            if (high[a] - low[a] > high[axis] - low[axis]) axis = a;
+        }
+
+        const std::size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(nodes.begin() + lo, nodes.begin() + mid, nodes.begin() + hi,
+                         [axis](const Node& a, const Node& b) { return a.coordinates[axis] < b.coordinates[axis]; });
+        nodes[mid].axis = axis;
+        build(lo, mid);
+        build(mid + 1, hi);
+    }
+
+    void search(const UnitVector& query, const std::size_t k, const std::size_t lo, const std::size_t hi,
+                std::vector<Neighbour>& heap) const {
+        if (lo >= hi) return;
+        const std::size_t mid = lo + (hi - lo) / 2;
+        const Node& node = nodes[mid];
+        if (state[node.row] == IN_TREE) {
+            offer(heap, k, node.row, chordSquared(query, node.coordinates[0], node.coordinates[1], node.coordinates[2]));
+        }
+        if (hi - lo == 1) return;
+
+        const double q[3] = {query.x, query.y, query.z};
+        const double diff = q[node.axis] - node.coordinates[node.axis];
+        //  Near side first so the far side can usually be pruned by the distance to the split plane
+        if (diff < 0) {
+            search(query, k, lo, mid, heap);
+            if (heap.size() < k || diff * diff <= heap.front().chordSquared) search(query, k, mid + 1, hi, heap);
+        } else {
+            search(query, k, mid + 1, hi, heap);
+            if (heap.size() < k || diff * diff <= heap.front().chordSquared) search(query, k, lo, mid, heap);
+        }
+    }
+};
+
+//  Hierarchical cell index over the sphere for radius queries, in the spirit of S2.
+//  The sphere is projected onto the six faces of a cube and each face is split as a quadtree down to
+//  LEVELS levels (cells of roughly ten metres). A cell id is the face followed by the interleaved
+//  bits of its quadtree path, so every cell at any level covers one contiguous range of leaf ids and
+//  rows sorted by leaf id can be cut into cells with a binary search. The projection is linear on each
+//  face, cell edges are great circles, so a cell lies within the cap around its centre that reaches
+//  its farthest corner. Faces cover the poles and the antimeridian like anywhere else.
+//  Pending rows and rebuilds work the same way as SpatialIndex.
+class CellIndex {
+public:
+    static constexpr int LEVELS = 20;
+
+    void insert(const RowId row) {
+        if (state.size() <= row) state.resize(row + 1, ABSENT);
+        state[row] = PENDING;
+        pending.push_back(row);
+    }
+
+    void erase(const RowId row) {
+        if (row < state.size()) state[row] = ABSENT;
+    }
+
+    void move(const RowId row) {
+        if (row >= state.size() || state[row] != IN_TREE) return;
+        state[row] = PENDING;
+        pending.push_back(row);
+    }
+
+    void clear() {
+        entries.clear();
+        state.clear();
+        pending.clear();
+    }
+
+    //  Rebuilds the entries when the next query would, queries after that only read the index
+    void settle(const std::vector<double>& xs, const std::vector<double>& ys, const std::vector<double>& zs) const {
+        if (pending.size() > std::max<std::size_t>(REBUILD_MIN, entries.size() / REBUILD_FRACTION)) {
+            rebuild(xs, ys, zs);
+        }
+    }
+
+    //  Rows within angle radians of centre, in row order. chordLimit is the squared chord length of the
+    //  same angle, the exact test for rows of cells that straddle the edge of the cap.
+    std::vector<RowId> within(const UnitVector& centre, const double angle, const double chordLimit,
+                              const std::vector<double>& xs, const std::vector<double>& ys,
+                              const std::vector<double>& zs) const {
+        settle(xs, ys, zs);
+        std::vector<RowId> rows;
+        auto test = [&](const RowId row) {
+            const double dx = centre.x - xs[row], dy = centre.y - ys[row], dz = centre.z - zs[row];
+            if (dx * dx + dy * dy + dz * dz <= chordLimit) rows.push_back(row);
+        };
+
+        for (const RowId row : pending) {
+            if (state[row] == PENDING) test(row);
+        }
+        for (int face = 0; face < 6; ++face) visit(centre, angle, face, 0, 0, 0, test, rows);
+
+        std::sort(rows.begin(), rows.end());
+        return rows;
+    }
+
+private:
+    static constexpr std::uint8_t ABSENT = 0, IN_TREE = 1, PENDING = 2;
+    static constexpr std::size_t REBUILD_MIN = 1024;
+    static constexpr std::size_t REBUILD_FRACTION = 16;
+    static constexpr std::size_t SCAN_LIMIT = 32;   //  Boundary cells this small are scanned, not split
+
+    struct Entry {
+        std::uint64_t cell;
+        RowId row;
+    };
+
+    mutable std::vector<Entry> entries;     //  Sorted by leaf cell id
+    mutable std::vector<std::uint8_t> state;
+    mutable std::vector<RowId> pending;
+
+    //  Spreads the low 32 bits of v to the even bit positions
+    static std::uint64_t spread(std::uint64_t v) {
+        v &= 0xFFFFFFFFull;
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    }
+
+    //  First leaf id of the cell (face, i, j) at level
+    static std::uint64_t cellBegin(const int face, const int level, const std::uint32_t i, const std::uint32_t j) {
+        const int shift = LEVELS - level;
+        return (std::uint64_t(face) << (2 * LEVELS)) |
+               (spread(std::uint64_t(i) << shift) << 1) | spread(std::uint64_t(j) << shift);
+    }
+
+    static std::uint64_t cellEnd(const int face, const int level, const std::uint32_t i, const std::uint32_t j) {
+        return cellBegin(face, level, i, j) + (std::uint64_t{1} << (2 * (LEVELS - level)));
+    }
+
+    //  Face and face coordinates u, v in [-1, 1] of a point, the face is its largest component
+    static int faceOf(const double x, const double y, const double z, double& u, double& v) {
+        const double ax = std::abs(x), ay = std::abs(y), az = std::abs(z);
+        if (ax >= ay && ax >= az) {
+            if (x > 0) { u = y / x; v = z / x; return 0; }
+            u = z / x; v = y / x; return 3;
+        }
+        if (ay >= az) {
+            if (y > 0) { u = -x / y; v = z / y; return 1; }
+            u = z / y; v = -x / y; return 4;
+        }
+        if (z > 0) { u = -x / z; v = -y / z; return 2; }
+        u = -y / z; v = -x / z; return 5;
+    }
+
+    //  Inverse of faceOf, normalized back onto the sphere
+    static UnitVector pointOf(const int face, const double u, const double v) {
+        double x, y, z;
+        switch (face) {
+            case 0: x = 1; y = u; z = v; break;
+            case 1: x = -u; y = 1; z = v; break;
+            case 2: x = -u; y = -v; z = 1; break;
+            case 3: x = -1; y = -v; z = -u; break;
+            case 4: x = v; y = -1; z = -u; break;
+            default: x = v; y = u; z = -1; break;
+        }
+        const double norm = sqrt(x * x + y * y + z * z);
+        return {x / norm, y / norm, z / norm};
+    }
+
+    static std::uint64_t leafCell(const double x, const double y, const double z) {
+        double u, v;
+        const int face = faceOf(x, y, z, u, v);
+        constexpr double SIDE = double(1u << LEVELS);
+        const auto i = static_cast<std::uint32_t>(std::clamp((u + 1.0) / 2.0 * SIDE, 0.0, SIDE - 1.0));
+        const auto j = static_cast<std::uint32_t>(std::clamp((v + 1.0) / 2.0 * SIDE, 0.0, SIDE - 1.0));
+        return cellBegin(face, LEVELS, i, j);
+    }
+
+    static double angleBetween(const UnitVector& a, const UnitVector& b) {
+        return acos(std::clamp(a.dot(b), -1.0, 1.0));
+    }
+
+    void rebuild(const std::vector<double>& xs, const std::vector<double>& ys, const std::vector<double>& zs) const {
+        entries.clear();
+        for (RowId row = 0; row < state.size(); ++row) {
+            if (state[row] == ABSENT) continue;
+            entries.push_back({leafCell(xs[row], ys[row], zs[row]), row});
+            state[row] = IN_TREE;
+        }
+        pending.clear();
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry& a, const Entry& b) { return a.cell < b.cell || (a.cell == b.cell && a.row < b.row); });
+    }
+
+    template <typename Test>
+    void visit(const UnitVector& centre, const double angle, const int face, const int level,
+               const std::uint32_t i, const std::uint32_t j, Test& test, std::vector<RowId>& rows) const {
+        const std::uint64_t begin = cellBegin(face, level, i, j), end = cellEnd(face, level, i, j);
+        const auto first = std::lower_bound(entries.begin(), entries.end(), begin,
+                                            [](const Entry& e, const std::uint64_t cell) { return e.cell < cell; });
+        const auto last = std::lower_bound(first, entries.end(), end,
+                                           [](const Entry& e, const std::uint64_t cell) { return e.cell < cell; });
+        if (first == last) return;
+
+        //  Bounding cap of the cell: centre point and the angle to its farthest corner
+        const double side = 2.0 / double(1u << level);
+        const double u0 = -1.0 + i * side, v0 = -1.0 + j * side;
+        const UnitVector cellCentre = pointOf(face, u0 + side / 2, v0 + side / 2);
+        double cellRadius = 0.0;
+        for (const double u : {u0, u0 + side}) {
+            for (const double v : {v0, v0 + side}) {
+                cellRadius = std::max(cellRadius, angleBetween(cellCentre, pointOf(face, u, v)));
+            }
+        }
+        cellRadius += 1e-12;
+
+        const double gap = angleBetween(centre, cellCentre);
+        if (gap - cellRadius > angle) return;   //  Cell entirely outside the cap
+
+        if (gap + cellRadius <= angle) {        //  Cell entirely inside, no distances needed
+            for (auto it = first; it != last; ++it) {
+                if (state[it->row] == IN_TREE) rows.push_back(it->row);
+            }
+            return;
+        }
+
+        if (level == LEVELS || std::size_t(last - first) <= SCAN_LIMIT) {
+            for (auto it = first; it != last; ++it) {
+                if (state[it->row] == IN_TREE) test(it->row);
+            }
+            return;
+        }
+
+        for (std::uint32_t child = 0; child < 4; ++child) {
+            visit(centre, angle, face, level + 1, 2 * i + (child >> 1), 2 * j + (child & 1), test, rows);
+        }
+    }
+};
+
+//  Sorted index of city names for type-ahead: rows ordered by case folded name, so the names with a
+//  given prefix are one range found by binary search. The index keeps its own folded copy of the
+//  names in that order, a renamed row leaves its old key in place until the next merge. A max tree
+//  over the populations of the order gives the most populous matches of any range in O(k log n),
+//  however many names share the prefix. Added and renamed rows collect in a small unsorted pending
+//  list that queries scan directly, and are sorted and merged in once it outgrows PENDING_LIMIT.
+class PrefixIndex {
+public:
+    void insert(const RowId row) {
+        grow(row);
+        state[row] = PENDING;
+        if (!inPending[row]) {
+            inPending[row] = 1;
+            pending.push_back(row);
+        }
+    }
+
+    void erase(const RowId row) {
+        if (row >= state.size()) return;
+        if (state[row] == IN_ORDER) setLeaf(position[row], DEAD);
+        state[row] = ABSENT;
+    }
+
+    void setPopulation(const RowId row, const int population) {
+        if (row < state.size() && state[row] == IN_ORDER) setLeaf(position[row], population);
+    }
+
+    void clear() {
+        order.clear();
+        keys.clear();
+        position.clear();
+        tree.clear();
+        leaves.clear();
+        state.clear();
+        inPending.clear();
+        pending.clear();
+    }
+
+    //  Up to limit live rows whose name starts with prefix ignoring case, in name order, or by
+    //  population (largest first) when byPopulation is set
+    std::vector<RowId> complete(const std::string_view prefix, const std::size_t limit, const bool byPopulation,
+                                const StringColumn& names, const std::vector<int>& populations) const {
+        std::vector<RowId> results;
+        if (limit == 0) return results;
+        settle(names, populations);
+
+        //  Pending rows that match, at most PENDING_LIMIT of them
+        std::vector<RowId> extra;
+        for (const RowId row : pending) {
+            if (state[row] == PENDING && hasPrefix(names[row], prefix)) extra.push_back(row);
+        }
+
+        const auto [first, last] = range(prefix);
+        if (byPopulation) {
+            topByPopulation(first, last, limit, results);
+            results.insert(results.end(), extra.begin(), extra.end());
+            std::stable_sort(results.begin(), results.end(),
+                             [&](const RowId a, const RowId b) { return populations[a] > populations[b]; });
+        } else {
+            for (std::size_t i = first; i < last && results.size() < limit; ++i) {
+                if (leaves[i] != DEAD) results.push_back(order[i]);
+            }
+            results.insert(results.end(), extra.begin(), extra.end());
+            std::stable_sort(results.begin(), results.end(),
+                             [&](const RowId a, const RowId b) { return foldedLess(names[a], names[b]); });
+        }
+        if (results.size() > limit) results.resize(limit);
+        return results;
+    }
+
+    //  Merges the pending rows when the next query would, queries after that only read the index
+    void settle(const StringColumn& names, const std::vector<int>& populations) const {
+        if (pending.size() > PENDING_LIMIT) merge(names, populations);
+    }
+
+private:
+    static constexpr std::uint8_t ABSENT = 0, IN_ORDER = 1, PENDING = 2;
+    static constexpr std::size_t PENDING_LIMIT = 512;
+    //  Leaf value of erased rows. Leaves are wider than populations so that it is below any of them,
+    //  negative ones included.
+    static constexpr std::int64_t DEAD = std::numeric_limits<std::int64_t>::min();
+
+    mutable std::vector<RowId> order;               //  Rows sorted by folded name
+    mutable StringColumn keys;                      //  Folded name of order[i] when it was merged
+    mutable std::vector<std::uint32_t> position;    //  Row -> index in order
+    mutable std::vector<std::int64_t> leaves;       //  Population per index in order, DEAD once erased
+    mutable std::vector<std::uint32_t> tree;        //  Max tree over leaves, tree[1] is the root
+    mutable std::vector<std::uint8_t> state, inPending;
+    mutable std::vector<RowId> pending;
+
+    static unsigned char fold(const char c) { return static_cast<unsigned char>(::tolower(c)); }
+
+    static bool foldedLess(const std::string_view a, const std::string_view b) {
+        const std::size_t n = std::min(a.size(), b.size());
+        for (std::size_t i = 0; i < n; ++i) {
+            if (fold(a[i]) != fold(b[i])) return fold(a[i]) < fold(b[i]);
+        }
+        return a.size() < b.size();
+    }
+
+    static bool hasPrefix(const std::string_view name, const std::string_view prefix) {
+        if (name.size() < prefix.size()) return false;
+        for (std::size_t i = 0; i < prefix.size(); ++i) {
+            if (fold(name[i]) != fold(prefix[i])) return false;
+        }
+        return true;
+    }
+
+    //  First eight bytes of a folded name, big endian, so comparing keys orders most names at once
+    static std::uint64_t leadingBytes(const std::string_view key) {
+        std::uint64_t packed = 0;
+        for (std::size_t i = 0; i < 8; ++i) {
+            packed = packed << 8 | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
+        }
+        return packed;
+    }
+
+    void grow(const RowId row) {
+        if (row < state.size()) return;
+        state.resize(row + 1, ABSENT);
+        inPending.resize(row + 1, 0);
+        position.resize(row + 1, 0);
+    }
+
+    //  [first, last) of order whose keys start with prefix
+    std::pair<std::size_t, std::size_t> range(const std::string_view prefix) const {
+        const std::string folded = foldCase(prefix);
+        std::size_t first = 0, last = order.size();
+        while (first < last) {
+            const std::size_t middle = first + (last - first) / 2;
+            if (keys[middle] < folded) first = middle + 1;
+            else last = middle;
+        }
+        last = order.size();
+        for (std::size_t low = first; low < last;) {
+            const std::size_t middle = low + (last - low) / 2;
+            if (keys[middle].starts_with(folded)) low = middle + 1;
+            else last = middle;
+        }
+        return {first, last};
+    }
+
+    void merge(const StringColumn& names, const std::vector<int>& populations) const {
+        StringColumn addedKeys;
+        std::vector<RowId> addedRows;
+        for (const RowId row : pending) {
+            inPending[row] = 0;
+            if (state[row] != PENDING) continue;
+            addedKeys.push_back(foldCase(names[row]));
+            addedRows.push_back(row);
+        }
+        pending.clear();
+
+        //  Sort the new keys on their leading bytes, full keys and then rows only break ties
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> sorted(addedRows.size());
+        for (std::size_t i = 0; i < addedRows.size(); ++i) {
+            sorted[i] = {leadingBytes(addedKeys[i]), static_cast<std::uint32_t>(i)};
+        }
+        std::sort(sorted.begin(), sorted.end(), [&](const auto& a, const auto& b) {
+            if (a.first != b.first) return a.first < b.first;
+            const int compared = addedKeys[a.second].compare(addedKeys[b.second]);
+            return compared != 0 ? compared < 0 : addedRows[a.second] < addedRows[b.second];
+        });
+
+        //  Merge with the entries of the old order that are still live
+        std::vector<RowId> merged;
+        StringColumn mergedKeys;
+        merged.reserve(order.size() + addedRows.size());
+        std::size_t i = 0, j = 0;
+        while (true) {
+            while (i < order.size() && state[order[i]] != IN_ORDER) ++i;
+            if (i == order.size() && j == sorted.size()) break;
+            bool takeOld = j == sorted.size();
+            if (i < order.size() && !takeOld) {
+                const int compared = keys[i].compare(addedKeys[sorted[j].second]);
+                takeOld = compared < 0 || (compared == 0 && order[i] < addedRows[sorted[j].second]);
+            }
+            if (takeOld) {
+                merged.push_back(order[i]);
+                mergedKeys.push_back(keys[i++]);
+            } else {
+                merged.push_back(addedRows[sorted[j].second]);
+                mergedKeys.push_back(addedKeys[sorted[j++].second]);
+            }
+        }
+        order = std::move(merged);
+        keys = std::move(mergedKeys);
+
+        const std::size_t n = order.size();
+        leaves.resize(n);
+        for (std::size_t k = 0; k < n; ++k) {
+            position[order[k]] = static_cast<std::uint32_t>(k);
+            state[order[k]] = IN_ORDER;
+            leaves[k] = populations[order[k]];
+        }
+        tree.assign(2 * std::max<std::size_t>(1, n), 0);
+        for (std::size_t k = 0; k < n; ++k) tree[n + k] = static_cast<std::uint32_t>(k);
+        for (std::size_t k = n - 1; k >= 1 && n > 1; --k) tree[k] = better(tree[2 * k], tree[2 * k + 1]);
+    }
+
+    std::uint32_t better(const std::uint32_t a, const std::uint32_t b) const {
+        return leaves[b] > leaves[a] ? b : a;
+    }
+
+    void setLeaf(std::size_t i, const std::int64_t value) const {
+        leaves[i] = value;
+        const std::size_t n = order.size();
+        for (i = (i + n) / 2; i >= 1; i /= 2) tree[i] = better(tree[2 * i], tree[2 * i + 1]);
+    }
+
+    //  Index of the largest leaf in [l, r), r > l
+    std::uint32_t best(std::size_t l, std::size_t r) const {
+        const std::size_t n = order.size();
+        std::uint32_t result = static_cast<std::uint32_t>(l);
+        for (l += n, r += n; l < r; l /= 2, r /= 2) {
+            if (l & 1) result = better(result, tree[l++]);
+            if (r & 1) result = better(result, tree[--r]);
+        }
+        return result;
+    }
+
+    //  The limit most populous live rows of order[first, last): take the best of a range, then
+    //  split the range around it, always expanding the range whose best is largest
+    void topByPopulation(const std::size_t first, const std::size_t last, const std::size_t limit,
+                         std::vector<RowId>& results) const {
+        struct Range {
+            std::int64_t population;
+            std::uint32_t at;
+            std::size_t l, r;
+            bool operator<(const Range& other) const { return population < other.population; }
+        };
+        std::vector<Range> heap;
+        auto push = [&](const std::size_t l, const std::size_t r) {
+            if (l >= r) return;
+            const std::uint32_t at = best(l, r);
+            heap.push_back({leaves[at], at, l, r});
+            std::push_heap(heap.begin(), heap.end());
+        };
+        push(first, last);
+        while (!heap.empty() && results.size() < limit) {
+            std::pop_heap(heap.begin(), heap.end());
+            const Range top = heap.back();
+            heap.pop_back();
+            if (top.population == DEAD) break;
+            results.push_back(order[top.at]);
+            push(top.l, top.at);
+            push(top.at + 1, top.r);
+        }
+    }
+};
+
+//  Bigram index over city names, candidate generation for fuzzy search. Each name is folded, padded
+//  with a boundary byte at both ends and split into its length + 1 two byte windows, and every
+//  window is posted with its position under the pair (bigram, name length). A name within k edits of
+//  a query is at most k characters longer or shorter, and of the query's windows at most 2k are
+//  destroyed while the rest reappear in it shifted by at most k positions. So only the lists of
+//  lengths within k are read, postings further than k from the query position are skipped, and only
+//  rows matching at least (query length + 1 - 2k) windows need an edit distance check.
+class BigramIndex {
+public:
+    void insert(const RowId row, const std::string_view name) {
+        const std::vector<std::uint32_t> grams = bigrams(name);
+        for (std::size_t i = 0; i < grams.size(); ++i) {
+            postings[key(grams[i], name.size())].push_back({row, static_cast<std::uint32_t>(i)});
+        }
+    }
+
+    void erase(const RowId row, const std::string_view name) {
+        const std::vector<std::uint32_t> grams = bigrams(name);
+        for (std::size_t i = 0; i < grams.size(); ++i) {
+            const auto found = postings.find(key(grams[i], name.size()));
+            if (found == postings.end()) continue;
+            auto& list = found->second;
+            const auto at = std::find_if(list.begin(), list.end(), [&](const Posting& posting) {
+                return posting.row == row && posting.position == i;
+            });
+            if (at == list.end()) continue;
+            *at = list.back();
+            list.pop_back();
+            if (list.empty()) postings.erase(found);
+        }
+    }
+
+    void clear() { postings.clear(); }
+
+    //  Rows whose name may be within maxEdits of name, rowCount bounds the row ids. Windows are read
+    //  rarest first. Only the first (windows - needed + 1) of them may add rows, since a row missing
+    //  all of those cannot reach the count, and further ones are read while their lists are shorter
+    //  than the rows found so far, each raising the count those rows need. Never more than the rows
+    //  of the lengths in reach: a query too short for the count bound to exclude anything takes every
+    //  one of those, found through the window at position 0 that each name starts with.
+    std::vector<RowId> candidates(const std::string_view name, const std::size_t maxEdits,
+                                  const std::size_t rowCount) const {
+        //  Matched windows per row and the last query window counted for it, kept zeroed, one per
+        //  thread so searches can run concurrently
+        thread_local std::vector<std::uint16_t> counts;
+        thread_local std::vector<std::uint32_t> marks;
+        if (counts.size() < rowCount) {
+            counts.resize(rowCount, 0);
+            marks.resize(rowCount, 0);
+        }
+        const std::size_t shortest = std::min(name.size() > maxEdits ? name.size() - maxEdits : 0, LENGTHS - 1);
+        const std::size_t longest = std::min(name.size() + maxEdits, LENGTHS - 1);
+        const std::vector<std::uint32_t> grams = bigrams(name);
+        std::size_t needed = grams.size() > 2 * maxEdits ? grams.size() - 2 * maxEdits : 0;
+
+        std::vector<RowId> touched, found;
+        auto visit = [&](const std::vector<Posting>& list, const std::size_t position, const bool adds) {
+            for (const Posting& posting : list) {
+                if (posting.position + maxEdits < position || posting.position > position + maxEdits) continue;
+                if (marks[posting.row] == position + 1) continue;
+                if (!adds && counts[posting.row] == 0) continue;
+                marks[posting.row] = static_cast<std::uint32_t>(position + 1);
+                if (counts[posting.row]++ == 0) touched.push_back(posting.row);
+            }
+        };
+        if (needed == 0) {
+            for (std::size_t length = shortest; length <= longest; ++length) {
+                for (std::uint32_t first = 0; first < 256; ++first) {
+                    const auto list = postings.find(key(BOUNDARY << 8 | first, length));
+                    if (list != postings.end()) visit(list->second, 0, true);
+                }
+            }
+        } else {
+            struct Window {
+                std::size_t position, rows = 0;
+                std::vector<const std::vector<Posting>*> lists;
+            };
+            std::vector<Window> windows(grams.size());
+            for (std::size_t i = 0; i < grams.size(); ++i) {
+                windows[i].position = i;
+                for (std::size_t length = shortest; length <= longest; ++length) {
+                    const auto list = postings.find(key(grams[i], length));
+                    if (list == postings.end()) continue;
+                    windows[i].rows += list->second.size();
+                    windows[i].lists.push_back(&list->second);
+                }
+            }
+            std::sort(windows.begin(), windows.end(), [](const Window& a, const Window& b) { return a.rows < b.rows; });
+            const std::size_t adding = grams.size() - needed + 1;
+            std::size_t read = 0;
+            for (const Window& window : windows) {
+                if (read >= adding && window.rows > touched.size()) break;
+                for (const auto* list : window.lists) visit(*list, window.position, read < adding);
+                ++read;
+            }
+            needed -= grams.size() - read;
+        }
+        for (const RowId row : touched) {
+            if (counts[row] >= needed) found.push_back(row);
+            counts[row] = 0;
+            marks[row] = 0;
+        }
+        return found;
+    }
+
+    //  Windows of a folded, boundary padded name in position order, one more than its characters
+    static std::vector<std::uint32_t> bigrams(const std::string_view name) {
+        std::vector<std::uint32_t> grams;
+        grams.reserve(name.size() + 1);
+        auto at = [&](const std::size_t i) -> std::uint32_t {
+            return i == 0 || i > name.size() ? BOUNDARY : static_cast<unsigned char>(::tolower(name[i - 1]));
+        };
+        for (std::size_t i = 0; i <= name.size(); ++i) grams.push_back(at(i) << 8 | at(i + 1));
+        return grams;
+    }
+
+private:
+    static constexpr std::uint32_t BOUNDARY = 1;
+    static constexpr std::size_t LENGTHS = 256;     //  Longer names share the last length
+
+    struct Posting {
+        RowId row;
+        std::uint32_t position;
+    };
+
+    std::unordered_map<std::uint32_t, std::vector<Posting>> postings;
+
+    static std::uint32_t key(const std::uint32_t gram, const std::size_t length) {
+        return gram << 8 | static_cast<std::uint32_t>(std::min(length, LENGTHS - 1));
+    }
+};
+
+//  Inverted index over a text column, used for history. Text is split into words (runs of letters,
+//  digits and non ASCII bytes, folded to lower case) and each word maps to a compressed posting list
+//  of the rows containing it with the word positions in each, so phrases can be matched. A list is
+//  a byte stream of varints: row delta from the previous entry, position count, position deltas.
+//
+//  Lists are appended in row order, which new rows satisfy. A row whose text is rewritten is dropped
+//  from the lists it is in (its entries are skipped) and checked directly against its current text
+//  by every query, until more than PENDING_LIMIT such rows trigger a rebuild.
+//
+//  Queries are words (all must appear), "quoted phrases" (words in sequence) and OR between groups
+//  of those: roman "city walls" OR colony. OR and AND are operators in any case like the words
+//  themselves, quoted they are searched for: roman "or" greek.
+class TextIndex {
+public:
+    //  Indexes a row, rows must be inserted in increasing order
+    void insert(const RowId row, const std::string_view text) {
+        grow(row);
+        state[row] = INDEXED;
+        words.clear();
+        tokenizeInto(text, folded, words);
+        std::sort(words.begin(), words.end());
+        for (std::size_t i = 0; i < words.size();) {
+            std::size_t end = i;
+            while (end < words.size() && words[end].first == words[i].first) ++end;
+            auto list = postings.find(words[i].first);
+            if (list == postings.end()) list = postings.emplace(words[i].first, Postings{}).first;
+            Postings& target = list->second;
+            putVarint(target.bytes, target.entries == 0 ? row : row - target.lastRow);
+            putVarint(target.bytes, static_cast<std::uint32_t>(end - i));
+            std::uint32_t previous = 0;
+            for (std::size_t j = i; j < end; ++j) {
+                putVarint(target.bytes, words[j].second - previous);
+                previous = words[j].second;
+            }
+            target.lastRow = row;
+            ++target.entries;
+            i = end;
+        }
+    }
+
+    void erase(const RowId row) {
+        if (row < state.size()) state[row] = ABSENT;
+    }
+
+    //  The row's text changed, its entries are now stale
+    void rewrite(const RowId row) {
+        grow(row);
+        state[row] = REWRITTEN;
+        pending.push_back(row);
+    }
+
+    //  More rows are rewritten than queries should check one by one
+    bool needsRebuild() const { return pending.size() > PENDING_LIMIT; }
+
+    void clear() {
+        postings.clear();
+        state.clear();
+        pending.clear();
+    }
+
+    //  Rows matching query, in increasing order. text(row) gives the current text of a row.
+    template <typename TextOf>
+    std::vector<RowId> search(const std::string_view query, TextOf&& text) const {
+        std::vector<RowId> rows;
+        for (const auto& group : parse(query)) {
+            std::vector<RowId> matched;
+            for (std::size_t i = 0; i < group.size(); ++i) {
+                std::vector<RowId> phraseRows = phrase(group[i]);
+                if (i == 0) {
+                    matched = std::move(phraseRows);
+                } else {
+                    std::vector<RowId> both;
+                    std::set_intersection(matched.begin(), matched.end(), phraseRows.begin(), phraseRows.end(),
+                                          std::back_inserter(both));
+                    matched = std::move(both);
+                }
+                if (matched.empty()) break;
+            }
+            std::vector<RowId> merged;
+            std::set_union(rows.begin(), rows.end(), matched.begin(), matched.end(), std::back_inserter(merged));
+            rows = std::move(merged);
+        }
+
+        //  Rewritten rows are matched on their text, each one once
+        std::vector<RowId> rewritten;
+        for (const RowId row : pending) {
+            if (state[row] == REWRITTEN) rewritten.push_back(row);
+        }
+        std::sort(rewritten.begin(), rewritten.end());
+        rewritten.erase(std::unique(rewritten.begin(), rewritten.end()), rewritten.end());
+        std::vector<RowId> found;
+        for (const RowId row : rewritten) {
+            if (matches(query, text(row))) found.push_back(row);
+        }
+        if (!found.empty()) {
+            std::vector<RowId> merged;
+            std::set_union(rows.begin(), rows.end(), found.begin(), found.end(), std::back_inserter(merged));
+            rows = std::move(merged);
+        }
+        return rows;
+    }
+
+    //  Whether a single text matches query, the same answer search gives for a row holding it
+    static bool matches(const std::string_view query, const std::string_view text) {
+        const std::vector<std::string> words = tokenize(text);
+        for (const auto& group : parse(query)) {
+            bool all = true;
+            for (const auto& sequence : group) {
+                auto at = std::search(words.begin(), words.end(), sequence.begin(), sequence.end());
+                if (at == words.end()) {
+                    all = false;
+                    break;
+                }
+            }
+            if (all) return true;
+        }
+        return false;
+    }
+
+    //  Words of a text in order, folded
+    static std::vector<std::string> tokenize(const std::string_view text) {
+        std::string folded;
+        std::vector<std::pair<std::string_view, std::uint32_t>> views;
+        tokenizeInto(text, folded, views);
+        std::vector<std::string> words;
+        words.reserve(views.size());
+        for (const auto& [word, position] : views) words.emplace_back(word);
+        return words;
+    }
+
+private:
+    static constexpr std::uint8_t ABSENT = 0, INDEXED = 1, REWRITTEN = 2;
+    static constexpr std::size_t PENDING_LIMIT = 4096;
+
+    struct Postings {
+        std::vector<std::uint8_t> bytes;
+        RowId lastRow = 0;
+        std::uint32_t entries = 0;
+    };
+
+    //  Decoded list: live rows and, when asked for, their positions as ranges of one shared array
+    struct Decoded {
+        std::vector<RowId> rows;
+        std::vector<std::uint32_t> starts;      //  Positions of rows[i] are [starts[i], starts[i + 1])
+        std::vector<std::uint32_t> positions;
+    };
+
+    std::unordered_map<std::string, Postings, StringHash, std::equal_to<>> postings;
+    std::vector<std::uint8_t> state;
+    std::vector<RowId> pending;
+    std::string folded;                                                 //  Scratch for insert
+    std::vector<std::pair<std::string_view, std::uint32_t>> words;
+
+    //  Folds text into folded and appends its words as views into it with their positions
+    static void tokenizeInto(const std::string_view text, std::string& folded,
+                                    std::vector<std::pair<std::string_view, std::uint32_t>>& words) {
+        folded = foldCase(text);
+        std::uint32_t position = 0;
+        for (std::size_t i = 0; i < folded.size();) {
+            if (!isWordByte(folded[i])) {
+                ++i;
+                continue;
+            }
+            std::size_t end = i;
+            while (end < folded.size() && isWordByte(folded[end])) ++end;
+            words.emplace_back(std::string_view(folded).substr(i, end - i), position++);
+            i = end;
+        }
+    }
+
+    static bool isWordByte(const char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || static_cast<unsigned char>(c) >= 0x80;
+    }
+
+    static void putVarint(std::vector<std::uint8_t>& bytes, std::uint32_t value) {
+        while (value >= 0x80) {
+            bytes.push_back(static_cast<std::uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back(static_cast<std::uint8_t>(value));
+    }
+
+    static std::uint32_t getVarint(const std::uint8_t*& at) {
+        std::uint32_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            const std::uint8_t byte = *at++;
+            value |= std::uint32_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+    }
+
+    void grow(const RowId row) {
+        if (row >= state.size()) state.resize(row + 1, ABSENT);
+    }
+
+    //  OR of groups, each group an AND of word sequences (a lone word is a sequence of one)
+    static std::vector<std::vector<std::vector<std::string>>> parse(const std::string_view query) {
+        std::vector<std::vector<std::vector<std::string>>> groups(1);
+        for (std::size_t i = 0; i < query.size();) {
+            if (query[i] == '"') {
+                const std::size_t close = std::min(query.find('"', i + 1), query.size());
+                std::vector<std::string> sequence = tokenize(query.substr(i + 1, close - i - 1));
+                if (!sequence.empty()) groups.back().push_back(std::move(sequence));
+                i = close + 1;
+            } else if (isWordByte(query[i])) {
+                std::size_t end = i;
+                while (end < query.size() && isWordByte(query[end])) ++end;
+                std::string word = foldCase(query.substr(i, end - i));
+                if (word == "or") {
+                    if (!groups.back().empty()) groups.emplace_back();
+                } else if (word != "and") {
+                    groups.back().push_back({std::move(word)});
+                }
+                i = end;
+            } else {
+                ++i;
+            }
+        }
+        if (groups.back().empty()) groups.pop_back();
+        return groups;
+    }
+
+    Decoded decode(const std::string_view word, const bool withPositions) const {
+        Decoded decoded;
+        const auto list = postings.find(word);
+        if (list == postings.end()) return decoded;
+        decoded.rows.reserve(list->second.entries);
+        const std::uint8_t* at = list->second.bytes.data();
+        RowId row = 0;
+        for (std::uint32_t i = 0; i < list->second.entries; ++i) {
+            row += getVarint(at);
+            const std::uint32_t count = getVarint(at);
+            const bool live = state[row] == INDEXED;
+            if (live) {
+                decoded.rows.push_back(row);
+                if (withPositions) decoded.starts.push_back(static_cast<std::uint32_t>(decoded.positions.size()));
+            }
+            std::uint32_t position = 0;
+            for (std::uint32_t j = 0; j < count; ++j) {
+                position += getVarint(at);
+                if (live && withPositions) decoded.positions.push_back(position);
+            }
+        }
+        decoded.starts.push_back(static_cast<std::uint32_t>(decoded.positions.size()));
+        return decoded;
+    }
+
+    //  Indexed rows containing the words in sequence
+    std::vector<RowId> phrase(const std::vector<std::string>& words) const {
+        std::vector<RowId> rows;
+        const bool withPositions = words.size() > 1;
+        std::vector<Decoded> lists;
+        for (const auto& word : words) {
+            lists.push_back(decode(word, withPositions));
+            if (lists.back().rows.empty()) return rows;
+        }
+        if (!withPositions) return std::move(lists[0].rows);
+
+        //  Walk the lists together, then look for a start position p with word w at p + w
+        std::vector<std::size_t> cursor(lists.size(), 0);
+        for (std::size_t i = 0; i < lists[0].rows.size(); ++i) {
+            const RowId row = lists[0].rows[i];
+            bool everyList = true;
+            for (std::size_t w = 1; w < lists.size() && everyList; ++w) {
+                const auto& other = lists[w].rows;
+                while (cursor[w] < other.size() && other[cursor[w]] < row) ++cursor[w];
+                everyList = cursor[w] < other.size() && other[cursor[w]] == row;
+            }
+            if (!everyList) continue;
+            for (std::uint32_t p = lists[0].starts[i]; p < lists[0].starts[i + 1]; ++p) {
+                const std::uint32_t start = lists[0].positions[p];
+                bool inSequence = true;
+                for (std::size_t w = 1; w < lists.size() && inSequence; ++w) {
+                    const auto first = lists[w].positions.begin() + lists[w].starts[cursor[w]];
+                    const auto last = lists[w].positions.begin() + lists[w].starts[cursor[w] + 1];
+                    inSequence = std::binary_search(first, last, start + static_cast<std::uint32_t>(w));
+                }
+                if (inSequence) {
+                    rows.push_back(row);
+                    break;
+                }
+            }
+        }
+        return rows;
+    }
+};
+
+//  Sorted secondary index on one numeric column, for range and top-k queries in O(log n + k).
+//  Entries are (value, row) pairs in value order, each keeping the value it was sorted by, so an
+//  entry whose row changed or was erased is only skipped until the next merge. Added and changed
+//  rows collect in a small unsorted pending list that queries scan directly, and are sorted and
+//  merged in once it outgrows PENDING_LIMIT or skipped entries pile up.
+template <typename T>
+class SortedIndex {
+public:
+    void insert(const RowId row) {
+        grow(row);
+        state[row] = PENDING;
+        if (!inPending[row]) {
+            inPending[row] = 1;
+            pending.push_back(row);
+        }
+    }
+
+    void erase(const RowId row) {
+        if (row >= state.size()) return;
+        if (state[row] == IN_ORDER) ++stale;
+        state[row] = ABSENT;
+    }
+
+    void clear() {
+        order.clear();
+        state.clear();
+        inPending.clear();
+        pending.clear();
+        stale = 0;
+    }
+
+    //  Live rows with a value between low and high, in value order then row order
+    std::vector<RowId> range(const std::vector<T>& column, const double low, const bool lowInclusive,
+                             const double high, const bool highInclusive) const {
+        settle(column);
+        auto inside = [&](const T value) {
+            return (lowInclusive ? value >= low : value > low) && (highInclusive ? value <= high : value < high);
+        };
+        std::vector<RowId> rows;
+        const auto [first, last] = bounds(low, lowInclusive, high, highInclusive);
+        for (std::size_t i = first; i < last; ++i) {
+            if (state[order[i].second] == IN_ORDER) rows.push_back(order[i].second);
+        }
+        const std::size_t indexed = rows.size();
+        for (const RowId row : pending) {
+            if (state[row] == PENDING && inside(column[row])) rows.push_back(row);
+        }
+        auto before = [&](const RowId a, const RowId b) {
+            return column[a] != column[b] ? column[a] < column[b] : a < b;
+        };
+        std::sort(rows.begin() + indexed, rows.end(), before);
+        std::inplace_merge(rows.begin(), rows.begin() + indexed, rows.end(), before);
+        return rows;
+    }
+
+    //  Upper bound on the rows range would return, without collecting them
+    std::size_t count(const std::vector<T>& column, const double low, const bool lowInclusive,
+                      const double high, const bool highInclusive) const {
+        settle(column);
+        const auto [first, last] = bounds(low, lowInclusive, high, highInclusive);
+        return last - first + pending.size();
+    }
+
+    //  The k live rows with the smallest values, or largest when descending, equal values in row order
+    std::vector<RowId> top(const std::vector<T>& column, const std::size_t k, const bool descending) const {
+        std::vector<RowId> rows;
+        if (k == 0) return rows;
+        settle(column);
+        //  Walk from the wanted end, past the k-th row while values tie with it so row order can decide
+        for (std::size_t n = 0; n < order.size(); ++n) {
+            const auto& [value, row] = order[descending ? order.size() - 1 - n : n];
+            if (state[row] != IN_ORDER) continue;
+            if (rows.size() >= k && value != column[rows.back()]) break;
+            rows.push_back(row);
+        }
+        for (const RowId row : pending) {
+            if (state[row] == PENDING) rows.push_back(row);
+        }
+        auto before = [&](const RowId a, const RowId b) {
+            if (column[a] != column[b]) return descending ? column[b] < column[a] : column[a] < column[b];
+            return a < b;
+        };
+        const std::size_t keep = std::min(k, rows.size());
+        std::partial_sort(rows.begin(), rows.begin() + keep, rows.end(), before);
+        rows.resize(keep);
+        return rows;
+    }
+
+    //  Merges the pending rows and drops skipped entries when the next query would, queries after
+    //  that only read the index
+    void settle(const std::vector<T>& column) const {
+        if (pending.size() <= PENDING_LIMIT && stale <= order.size() / 4) return;
+
+        std::vector<std::pair<T, RowId>> added;
+        for (const RowId row : pending) {
+            inPending[row] = 0;
+            if (state[row] == PENDING) added.emplace_back(column[row], row);
+        }
+        pending.clear();
+        std::sort(added.begin(), added.end());
+
+        std::vector<std::pair<T, RowId>> merged;
+        merged.reserve(order.size() - std::min(stale, order.size()) + added.size());
+        auto kept = [&](const auto& entry) { return state[entry.second] == IN_ORDER; };
+        std::size_t i = 0, j = 0;
+        while (true) {
+            while (i < order.size() && !kept(order[i])) ++i;
+            if (i == order.size() && j == added.size()) break;
+            if (j == added.size() || (i < order.size() && order[i] < added[j])) merged.push_back(order[i++]);
+            else merged.push_back(added[j++]);
+        }
+        for (const auto& [value, row] : added) state[row] = IN_ORDER;
+        order = std::move(merged);
+        stale = 0;
+    }
+
+private:
+    static constexpr std::uint8_t ABSENT = 0, IN_ORDER = 1, PENDING = 2;
+    static constexpr std::size_t PENDING_LIMIT = 1024;
+
+    mutable std::vector<std::pair<T, RowId>> order;
+    mutable std::vector<std::uint8_t> state, inPending;
+    mutable std::vector<RowId> pending;
+    mutable std::size_t stale = 0;      //  Entries of order whose row is no longer IN_ORDER
+
+    void grow(const RowId row) {
+        if (row < state.size()) return;
+        state.resize(row + 1, ABSENT);
+        inPending.resize(row + 1, 0);
+    }
+
+    //  [first, last) of order with values inside the bounds
+    std::pair<std::size_t, std::size_t> bounds(const double low, const bool lowInclusive, const double high,
+                                               const bool highInclusive) const {
+        const auto first = std::partition_point(order.begin(), order.end(), [&](const auto& entry) {
+            return lowInclusive ? entry.first < low : entry.first <= low;
+        });
+        const auto last = std::partition_point(first, order.end(), [&](const auto& entry) {
+            return highInclusive ? entry.first <= high : entry.first < high;
+        });
+        return {std::size_t(first - order.begin()), std::size_t(last - order.begin())};
+    }
+};
+
+//  Totals over the live cities of one country, kept current by CityTable on every change. The
+//  centroid sums unit vectors rather than degrees so countries across the antimeridian average right.
+struct CountryStats {
+    std::int64_t cities = 0;
+    std::int64_t population = 0;
+    double weighted[3] = {0.0, 0.0, 0.0};   //  Sum of population * position
+    double plain[3] = {0.0, 0.0, 0.0};      //  Sum of position, for countries with no population
+
+    void add(const int cityPopulation, const UnitVector& position, const int sign) {
+        cities += sign;
+        population += sign * std::int64_t(cityPopulation);
+        const double components[3] = {position.x, position.y, position.z};
+        for (int i = 0; i < 3; ++i) {
+            weighted[i] += sign * double(cityPopulation) * components[i];
+            plain[i] += sign * components[i];
+        }
+    }
+
+    //  Population weighted centre in degrees, the plain centre when the population is 0
+    void centroid(double& latitude, double& longitude) const {
+        const double* sum = population > 0 ? weighted : plain;
+        const double length = std::sqrt(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+        latitude = length > 0.0 ? std::asin(std::clamp(sum[2] / length, -1.0, 1.0)) * 180.0 / M_PI : 0.0;
+        longitude = std::atan2(sum[1], sum[0]) * 180.0 / M_PI;
+    }
+};
+
+class CityTable;
+
+//  Append only write ahead journal of table changes.
+//  A snapshot file x.snapshot is paired with x.snapshot.journal. Every add, update and erase on an
+//  attached CityTable is encoded as a binary record and appended to an in-memory buffer, commit()
+//  then blocks until everything appended so far is on disk. A flusher thread writes and fsyncs the
+//  buffer, so all commits that arrive while one fsync runs are covered by the next one (group commit).
+//  Record format: uint32 payload length, uint32 CRC-32 of the payload, then the payload:
+//  uint64 sequence, uint8 type, uint32 row and the type's fields. Strings are uint32 length + bytes.
+//  Each snapshot stores the last sequence it contains and replay skips anything at or below it, so a
+//  checkpoint that crashes half way never applies a record twice.
+//  checkpoint() moves the journal aside to x.snapshot.journal.1 and starts a fresh one. A background
+//  thread then loads the snapshot file, replays the moved journal into it, writes the result as the
+//  new snapshot and deletes the old journal. The live table is not read, so changes never wait for it.
+class Journal {
+public:
+    enum RecordType : std::uint8_t { ADD = 1, ERASE = 2, UPDATE_TEXT = 3, UPDATE_INT = 4, UPDATE_DOUBLE = 5 };
+
+    //  Journals beyond this size are checkpointed automatically after a commit
+    static constexpr std::uint64_t CHECKPOINT_BYTES = 64ull << 20;
+
+    Journal() = default;
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+    ~Journal() { close(); }
+
+    //  Replays the journal of snapshotName into cities, which must hold that snapshot as loaded,
+    //  and attaches the journal to it. False if the journal file cannot be opened.
+    bool open(const std::string& snapshotName, CityTable& cities);
+
+    //  Flushes, waits for a running checkpoint and detaches from the table
+    void close();
+
+    bool isOpen() const { return file != nullptr; }
+    const std::string& snapshot() const { return snapshotName; }
+
+    //  Called by CityTable after each change
+    void logAdd(RowId row, std::string_view cityName, std::string_view cityCountry, int pop, int year, double lat,
+                double lon, std::string_view mayor, std::string_view address, std::string_view hist);
+    void logErase(RowId row);
+    void logUpdate(RowId row, std::string_view field, std::string_view value);
+    void logUpdate(RowId row, std::string_view field, int value);
+    void logUpdate(RowId row, std::string_view field, double value);
+
+    //  Blocks until every record appended so far is durable. False once a write has failed: the
+    //  journal then takes no more writes, and changes made after that are not durable.
+    bool commit();
+
+    //  Writes a new snapshot in the background and drops the journal it covers.
+    //  Does nothing while another checkpoint is still running.
+    void checkpoint();
+
+private:
+    std::string snapshotName, journalName, rotatedName;
+    std::FILE* file = nullptr;
+    CityTable* table = nullptr;
+
+    std::mutex lock;
+    std::condition_variable flushWanted, flushDone;
+    std::string buffer;                     //  Encoded records not yet written
+    std::uint64_t lastSequence = 0;         //  Sequence of the last appended record
+    std::uint64_t durableSequence = 0;      //  Sequence of the last record known to be on disk
+    std::uint64_t journalBytes = 0;
+    bool stopping = false, flushFailed = false, flushing = false;
+    std::thread flusher, checkpointer;
+    std::atomic<bool> checkpointRunning{false};
+
+    //  Encoding helpers, called with lock held
+    void beginRecord(RecordType type, RowId row, std::size_t& start);
+    void endRecord(std::size_t start);
+    void putBytes(const void* data, std::size_t size) { buffer.append(static_cast<const char*>(data), size); }
+    void putString(std::string_view value);
+
+    void flushLoop();
+    void startCheckpoint(std::unique_lock<std::mutex>& held);
+    static bool rebuild(const std::string& snapshotFile, const std::string& journalFile, std::uint64_t sequence,
+                        CityTable& cities);
+    static bool replay(const std::string& fileName, CityTable& cities, std::uint64_t after, std::uint64_t& last);
+    static std::uint32_t crc32(const char* data, std::size_t size);
+};
+
+//  Columnar (structure of arrays) store for all cities.
+//  Numeric fields live in their own contiguous arrays so scans over coordinates or population
+//  only touch the bytes they need, the text fields are kept apart in StringColumns.
+class CityTable {
+public:
+    std::size_t size() const { return latitudeColumn.size(); }  //  Row slots including deleted rows
+    std::size_t liveCount() const { return live; }              //  Cities currently in the table
+    bool empty() const { return live == 0; }
+    bool alive(const RowId row) const { return !deleted[row]; }
+
+    //  Per row accessors
+    std::string_view name(const RowId row) const { return nameColumn[row]; }
+    std::string_view country(const RowId row) const { return countryColumn[row]; }
+    std::string_view mayorName(const RowId row) const { return mayorNameColumn[row]; }
+    std::string_view mayorAddress(const RowId row) const { return mayorAddressColumn[row]; }
+    std::string_view history(const RowId row) const { return historyColumn[row]; }
+    int population(const RowId row) const { return populationColumn[row]; }
+    int recordYear(const RowId row) const { return recordYearColumn[row]; }
+    double latitude(const RowId row) const { return latitudeColumn[row]; }
+    double longitude(const RowId row) const { return longitudeColumn[row]; }
+    UnitVector position(const RowId row) const { return {xColumn[row], yColumn[row], zColumn[row]}; }
+
+    //  Whole columns for tight loops, indexed by RowId, check alive() for deleted rows
+    const std::vector<double>& latitudes() const { return latitudeColumn; }
+    const std::vector<double>& longitudes() const { return longitudeColumn; }
+    const std::vector<int>& populations() const { return populationColumn; }
+    const std::vector<int>& recordYears() const { return recordYearColumn; }
+    //  Column of a text field, field must not be numeric
+    const StringColumn& texts(const CityField field) const {
+        switch (field) {
+            case CityField::Country: return countryColumn;
+            case CityField::MayorName: return mayorNameColumn;
+            case CityField::MayorAddress: return mayorAddressColumn;
+            case CityField::History: return historyColumn;
+            default: return nameColumn;
+        }
+    }
+    //  Unit vector components, rebuilt whenever a row's latitude or longitude changes
+    const std::vector<double>& xs() const { return xColumn; }
+    const std::vector<double>& ys() const { return yColumn; }
+    const std::vector<double>& zs() const { return zColumn; }
+
+    //  Materializes one row as a City object
+    City city(const RowId row) const {
+        return {std::string(nameColumn[row]), std::string(countryColumn[row]), populationColumn[row],
+                recordYearColumn[row], latitudeColumn[row], longitudeColumn[row], std::string(mayorNameColumn[row]),
+                std::string(mayorAddressColumn[row]), std::string(historyColumn[row])};
+    }
+
+    void reserve(const std::size_t rows) {
+        latitudeColumn.reserve(rows);
+        longitudeColumn.reserve(rows);
+        xColumn.reserve(rows);
+        yColumn.reserve(rows);
+        zColumn.reserve(rows);
+        populationColumn.reserve(rows);
+        recordYearColumn.reserve(rows);
+        deleted.reserve(rows);
+        if (nameIndexBuilt) nameIndex.reserve(rows);
+    }
+
+    void clear() {
+        latitudeColumn.clear();
+        longitudeColumn.clear();
+        xColumn.clear();
+        yColumn.clear();
+        zColumn.clear();
+        populationColumn.clear();
+        recordYearColumn.clear();
+        deleted.clear();
+        nameColumn.clear();
+        countryColumn.clear();
+        mayorNameColumn.clear();
+        mayorAddressColumn.clear();
+        historyColumn.clear();
+        mappedSource.reset();
+        nameIndex.clear();
+        nameIndexBuilt = true;
+        spatialIndex.clear();
+        cellIndex.clear();
+        prefixIndex.clear();
+        bigramIndex.clear();
+        bigramIndexBuilt = false;
+        historyIndex.clear();
+        historyIndexBuilt = false;
+        countries.clear();
+        countriesBuilt = true;
+        populationIndex.clear();
+        recordYearIndex.clear();
+        latitudeIndex.clear();
+        longitudeIndex.clear();
+        valueIndexesBuilt = false;
+        live = 0;
+    }
+
+    //  Appends a row and returns its id
+    RowId add(const std::string_view cityName, const std::string_view cityCountry, const int pop, const int year,
+              const double lat, const double lon, const std::string_view mayor, const std::string_view address,
+              const std::string_view hist) {
+        return add(cityName, cityCountry, pop, year, lat, lon, mayor, address, hist, UnitVector::fromDegrees(lat, lon));
+    }
+
+    //  Same as above with the unit vector already computed, it must be UnitVector::fromDegrees(lat, lon).
+    //  Lets bulk loaders do the trig on their own threads.
+    RowId add(const std::string_view cityName, const std::string_view cityCountry, const int pop, const int year,
+              const double lat, const double lon, const std::string_view mayor, const std::string_view address,
+              const std::string_view hist, const UnitVector& position) {
+        const auto row = static_cast<RowId>(size());
+        nameColumn.push_back(cityName);
+        countryColumn.push_back(cityCountry);
+        mayorNameColumn.push_back(mayor);
+        mayorAddressColumn.push_back(address);
+        historyColumn.push_back(hist);
+        populationColumn.push_back(pop);
+        recordYearColumn.push_back(year);
+        latitudeColumn.push_back(lat);
+        longitudeColumn.push_back(lon);
+        xColumn.push_back(position.x);
+        yColumn.push_back(position.y);
+        zColumn.push_back(position.z);
+        deleted.push_back(0);
+        if (nameIndexBuilt) nameIndex.insert(row, cityName, cityCountry);
+        if (bigramIndexBuilt) bigramIndex.insert(row, cityName);
+        if (historyIndexBuilt) historyIndex.insert(row, hist);
+        if (countriesBuilt) countRow(row, 1);
+        if (valueIndexesBuilt) {
+            populationIndex.insert(row);
+            recordYearIndex.insert(row);
+            latitudeIndex.insert(row);
+            longitudeIndex.insert(row);
+        }
+        spatialIndex.insert(row);
+        cellIndex.insert(row);
+        prefixIndex.insert(row);
+        ++live;
+        if (journal) journal->logAdd(row, cityName, cityCountry, pop, year, lat, lon, mayor, address, hist);
+        return row;
+    }
+
+    RowId add(const City& city) {
+        return add(city.name, city.country, city.population, city.recordYear, city.latitude, city.longitude,
+                   city.mayorName, city.mayorAddress, city.history);
+    }
+
+    //  Marks a row as deleted, its id is never reused
+    void erase(const RowId row) {
+        if (deleted[row]) return;
+        if (nameIndexBuilt) nameIndex.erase(row, nameColumn[row], countryColumn[row]);
+        if (bigramIndexBuilt) bigramIndex.erase(row, nameColumn[row]);
+        if (historyIndexBuilt) historyIndex.erase(row);
+        if (countriesBuilt) countRow(row, -1);
+        if (valueIndexesBuilt) {
+            populationIndex.erase(row);
+            recordYearIndex.erase(row);
+            latitudeIndex.erase(row);
+            longitudeIndex.erase(row);
+        }
+        spatialIndex.erase(row);
+        cellIndex.erase(row);
+        prefixIndex.erase(row);
+        deleted[row] = 1;
+        --live;
+        if (journal) journal->logErase(row);
+    }
+
+    //  Rows whose name matches ignoring case, in table order
+    const std::vector<RowId>& findByName(const std::string_view cityName) const {
+        return names().byName(foldCase(cityName));
+    }
+
+    //  Rows whose name and country match exactly, the same identity City::operator== uses
+    std::vector<RowId> findRows(const std::string_view cityName, const std::string_view cityCountry) const {
+        std::vector<RowId> rows;
+        for (const RowId row : names().byNameAndCountry(foldCase(cityName), cityCountry)) {
+            //  The index key is case folded, keep only exact name matches
+            if (nameColumn[row] == cityName) rows.push_back(row);
+        }
+        return rows;
+    }
+
+    //  The k live rows closest to a point, nearest first, by squared chord length
+    std::vector<SpatialIndex::Neighbour> nearest(const UnitVector& position, const std::size_t k) const {
+        return spatialIndex.nearest(position, k, xColumn, yColumn, zColumn);
+    }
+
+    //  Live rows within angle radians of a point, in row order. chordLimit is the squared chord of the angle.
+    std::vector<RowId> within(const UnitVector& position, const double angle, const double chordLimit) const {
+        return cellIndex.within(position, angle, chordLimit, xColumn, yColumn, zColumn);
+    }
+
+    //  Type-ahead: up to limit live rows whose name starts with prefix ignoring case, in name order or
+    //  largest population first
+    std::vector<RowId> complete(const std::string_view prefix, const std::size_t limit, const bool byPopulation) const {
+        return prefixIndex.complete(prefix, limit, byPopulation, nameColumn, populationColumn);
+    }
+
+    //  Live rows whose name is within a few edits of name ignoring case, closest first and then
+    //  largest population, at most limit of them. Allows one edit up to four characters, two up to
+    //  eight and three beyond.
+    std::vector<std::pair<RowId, std::size_t>> fuzzyFind(const std::string_view name, const std::size_t limit) const {
+        std::vector<std::pair<RowId, std::size_t>> found;
+        if (name.empty() || limit == 0) return found;
+        const std::size_t maxEdits = name.size() <= 4 ? 1 : name.size() <= 8 ? 2 : 3;
+
+        auto check = [&](const RowId row) {
+            const std::string_view candidate = nameColumn[row];
+            const std::size_t gap = candidate.size() > name.size() ? candidate.size() - name.size()
+                                                                   : name.size() - candidate.size();
+            if (gap > maxEdits) return;
+            const std::size_t edits = editDistance(name, candidate);
+            if (edits <= maxEdits) found.emplace_back(row, edits);
+        };
+
+        for (const RowId row : bigrams().candidates(name, maxEdits, size())) check(row);
+
+        std::sort(found.begin(), found.end(), [&](const auto& a, const auto& b) {
+            if (a.second != b.second) return a.second < b.second;
+            if (populationColumn[a.first] != populationColumn[b.first]) {
+                return populationColumn[a.first] > populationColumn[b.first];
+            }
+            return a.first < b.first;
+        });
+        if (found.size() > limit) found.resize(limit);
+        return found;
+    }
+
+    //  Range and top-k over the numeric fields, answered by sorted indexes built on first use.
+    //  Live rows with field between low and high, in value order
+    std::vector<RowId> rowsInRange(const CityField field, const double low, const bool lowInclusive,
+                                   const double high, const bool highInclusive) const {
+        return withValueIndex<std::vector<RowId>>(field, [&](const auto& index, const auto& column) {
+            return index.range(column, low, lowInclusive, high, highInclusive);
+        });
+    }
+
+    //  Upper bound on the size of rowsInRange, in O(log n)
+    std::size_t countInRange(const CityField field, const double low, const bool lowInclusive, const double high,
+                             const bool highInclusive) const {
+        return withValueIndex<std::size_t>(field, [&](const auto& index, const auto& column) {
+            return index.count(column, low, lowInclusive, high, highInclusive);
+        });
+    }
+
+    //  The k live rows with the smallest field values, or largest when descending, ties in row order
+    std::vector<RowId> topRows(const CityField field, const std::size_t k, const bool descending) const {
+        return withValueIndex<std::vector<RowId>>(field, [&](const auto& index, const auto& column) {
+            return index.top(column, k, descending);
+        });
+    }
+
+    //  Totals of one country, null when it has no live cities. Constant time once built.
+    const CountryStats* countryStats(const std::string_view country) const {
+        const auto& all = countryTotals();
+        const auto found = all.find(country);
+        return found == all.end() ? nullptr : &found->second;
+    }
+
+    //  Totals of every country with live cities
+    const std::unordered_map<std::string, CountryStats, StringHash, std::equal_to<>>& countryTotals() const {
+        if (!countriesBuilt) {
+            countries.clear();
+            for (RowId row = 0; row < size(); ++row) {
+                if (!deleted[row]) countRow(row, 1);
+            }
+            countriesBuilt = true;
+        }
+        return countries;
+    }
+
+    //  Live rows whose history matches a TextIndex query, in row order
+    std::vector<RowId> searchHistory(const std::string_view query) const {
+        return histories().search(query, [&](const RowId row) { return historyColumn[row]; });
+    }
+
+    //  Same field names and overloads as City::update, applied to a stored row
+    void update(const RowId row, const std::string& field, const std::string& value) {
+        if (field == "name" || field == "country") {
+            //  Both are part of the name index keys, re-key the row around the change
+            const bool indexed = !deleted[row] && nameIndexBuilt;
+            if (indexed) nameIndex.erase(row, nameColumn[row], countryColumn[row]);
+            const bool bigramsIndexed = field == "name" && !deleted[row] && bigramIndexBuilt;
+            if (bigramsIndexed) bigramIndex.erase(row, nameColumn[row]);
+            const bool counted = field == "country" && !deleted[row] && countriesBuilt;
+            if (counted) countRow(row, -1);
+            if (field == "name") nameColumn.set(row, value);
+            else countryColumn.set(row, value);
+            if (counted) countRow(row, 1);
+            if (bigramsIndexed) bigramIndex.insert(row, nameColumn[row]);
+            if (indexed) nameIndex.insert(row, nameColumn[row], countryColumn[row]);
+            //  A renamed row moves in the prefix order
+            if (field == "name" && !deleted[row]) {
+                prefixIndex.erase(row);
+                prefixIndex.insert(row);
+            }
+        }
+        else if (field == "history") {
+            historyColumn.set(row, value);
+            if (historyIndexBuilt && !deleted[row]) historyIndex.rewrite(row);
+        }
+        else if (field == "mayorName") mayorNameColumn.set(row, value);
+        else if (field == "mayorAddress") mayorAddressColumn.set(row, value);
+        else {
+            std::cerr << "Invalid field name.\n";
+            return;
+        }
+        if (journal) journal->logUpdate(row, field, std::string_view(value));
+    }
+
+    void update(const RowId row, const std::string& field, const int value) {
+        if (field == "population") {
+            const bool counted = !deleted[row] && countriesBuilt;
+            if (counted) countRow(row, -1);
+            populationColumn[row] = value;
+            if (counted) countRow(row, 1);
+            prefixIndex.setPopulation(row, value);
+            if (valueIndexesBuilt && !deleted[row]) {
+                populationIndex.erase(row);
+                populationIndex.insert(row);
+            }
+        }
+        else if (field == "recordYear") {
+            recordYearColumn[row] = value;
+            if (valueIndexesBuilt && !deleted[row]) {
+                recordYearIndex.erase(row);
+                recordYearIndex.insert(row);
+            }
+        }
+        else {
+            std::cerr << "Invalid field name.\n";
+            return;
+        }
+        if (journal) journal->logUpdate(row, field, value);
+    }
+
+    void update(const RowId row, const std::string& field, const double value) {
+        if (field != "latitude" && field != "longitude") {
+            std::cerr << "Invalid field name.\n";
+            return;
+        }
+        const bool counted = !deleted[row] && countriesBuilt;
+        if (counted) countRow(row, -1);
+        if (field == "latitude") latitudeColumn[row] = value;
+        else longitudeColumn[row] = value;
+        if (valueIndexesBuilt && !deleted[row]) {
+            auto& index = field == "latitude" ? latitudeIndex : longitudeIndex;
+            index.erase(row);
+            index.insert(row);
+        }
+        const UnitVector position = UnitVector::fromDegrees(latitudeColumn[row], longitudeColumn[row]);
+        xColumn[row] = position.x;
+        yColumn[row] = position.y;
+        zColumn[row] = position.z;
+        if (counted) countRow(row, 1);
+        spatialIndex.move(row);
+        cellIndex.move(row);
+        if (journal) journal->logUpdate(row, field, value);
+    }
+
+    //  Lazy mode for the cold text fields: mayorName, mayorAddress and history values added from inside
+    //  source are kept as references into it instead of copies. owner keeps source alive.
+    void referenceColdFields(const std::string_view source, std::shared_ptr<const void> owner) {
+        mappedSource = std::move(owner);
+        for (StringColumn* column : {&mayorNameColumn, &mayorAddressColumn, &historyColumn}) {
+            column->referenceExternal(source.data(), source.size());
+        }
+    }
+
+    //  Every later change is recorded in journal, nullptr stops recording
+    void attachJournal(Journal* target) { journal = target; }
+
+    //  Builds every index and runs every merge that const queries would otherwise do on first use.
+    //  Until the next change, queries then only read the table and may run on several threads at once.
+    void settle() const {
+        names();
+        bigrams();
+        histories();
+        countryTotals();
+        buildValueIndexes();
+        populationIndex.settle(populationColumn);
+        recordYearIndex.settle(recordYearColumn);
+        latitudeIndex.settle(latitudeColumn);
+        longitudeIndex.settle(longitudeColumn);
+        spatialIndex.settle(xColumn, yColumn, zColumn);
+        cellIndex.settle(xColumn, yColumn, zColumn);
+        prefixIndex.settle(nameColumn, populationColumn);
+    }
+
+private:
+    friend class FileManager;   //  Reads and writes the columns directly for snapshot files
+
+    const NameIndex& names() const {
+        if (!nameIndexBuilt) {
+            nameIndex.clear();
+            nameIndex.reserve(live);
+            for (RowId row = 0; row < size(); ++row) {
+                if (!deleted[row]) nameIndex.insert(row, nameColumn[row], countryColumn[row]);
+            }
+            nameIndexBuilt = true;
+        }
+        return nameIndex;
+    }
+
+    void buildValueIndexes() const {
+        if (valueIndexesBuilt) return;
+        for (RowId row = 0; row < size(); ++row) {
+            if (deleted[row]) continue;
+            populationIndex.insert(row);
+            recordYearIndex.insert(row);
+            latitudeIndex.insert(row);
+            longitudeIndex.insert(row);
+        }
+        valueIndexesBuilt = true;
+    }
+
+    //  Calls fn(index, column) for a numeric field, building the four value indexes the first time
+    template <typename Result, typename Fn>
+    Result withValueIndex(const CityField field, Fn&& fn) const {
+        buildValueIndexes();
+        switch (field) {
+            case CityField::Population: return fn(populationIndex, populationColumn);
+            case CityField::RecordYear: return fn(recordYearIndex, recordYearColumn);
+            case CityField::Latitude: return fn(latitudeIndex, latitudeColumn);
+            default: return fn(longitudeIndex, longitudeColumn);
+        }
+    }
+
+    //  Adds (sign 1) or removes (sign -1) a row's share of its country's totals
+    void countRow(const RowId row, const int sign) const {
+        auto found = countries.find(countryColumn[row]);
+        if (found == countries.end()) found = countries.emplace(std::string(countryColumn[row]), CountryStats{}).first;
+        found->second.add(populationColumn[row], position(row), sign);
+        if (found->second.cities == 0) countries.erase(found);    //  Also drops rounding left in the sums
+    }
+
+    const TextIndex& histories() const {
+        if (historyIndexBuilt && historyIndex.needsRebuild()) historyIndexBuilt = false;
+        if (!historyIndexBuilt) {
+            historyIndex.clear();
+            for (RowId row = 0; row < size(); ++row) {
+                if (!deleted[row]) historyIndex.insert(row, historyColumn[row]);
+            }
+            historyIndexBuilt = true;
+        }
+        return historyIndex;
+    }
+
+    const BigramIndex& bigrams() const {
+        if (!bigramIndexBuilt) {
+            bigramIndex.clear();
+            for (RowId row = 0; row < size(); ++row) {
+                if (!deleted[row]) bigramIndex.insert(row, nameColumn[row]);
+            }
+            bigramIndexBuilt = true;
+        }
+        return bigramIndex;
+    }
+
+    std::vector<double> latitudeColumn, longitudeColumn;
+    std::vector<double> xColumn, yColumn, zColumn;
+    std::vector<int> populationColumn, recordYearColumn;
+    std::vector<std::uint8_t> deleted;
+    StringColumn nameColumn, countryColumn, mayorNameColumn, mayorAddressColumn, historyColumn;
+    std::shared_ptr<const void> mappedSource;   //  Keeps the file that external string values point into mapped
+    //  Built on first use after a snapshot load, kept current by every change after that
+    mutable NameIndex nameIndex;
+    mutable bool nameIndexBuilt = true;
+    mutable BigramIndex bigramIndex;        //  Built by the first fuzzy search, kept current after that
+    mutable bool bigramIndexBuilt = false;
+    //  Per country totals, dropped by a snapshot load and rebuilt by the first read
+    mutable std::unordered_map<std::string, CountryStats, StringHash, std::equal_to<>> countries;
+    mutable bool countriesBuilt = true;
+    //  Sorted indexes of the numeric fields, built together by the first range or top-k query
+    mutable SortedIndex<int> populationIndex, recordYearIndex;
+    mutable SortedIndex<double> latitudeIndex, longitudeIndex;
+    mutable bool valueIndexesBuilt = false;
+    mutable TextIndex historyIndex;         //  Built by the first history search, kept current after that
+    mutable bool historyIndexBuilt = false;
+    SpatialIndex spatialIndex;
+    CellIndex cellIndex;
+    PrefixIndex prefixIndex;
+    Journal* journal = nullptr;
+    std::size_t live = 0;
+};
+
+//  Class for distance formula (Haversine formula)
+//  cos d = sin(phi1)*sin(phi2) + cos(phi1)*cos(phi2)*cos(L1 - L2)
+//  (6371*pi*d) / 180 = s (km)
+
+class DistanceCalculator {
+    public:
+
+    static constexpr double EARTH_RADIUS_KM = 6371.0;
+    //  Method to calculate the displacement between cities
+    static double calculateDistance(const City& city1, const City& city2) {
+        return calculateDistance(city1.position, city2.position);
+    }
+
+    //  Same calculation for two rows of a CityTable, uses the rows' precomputed unit vectors
+    static double calculateDistance(const CityTable& cities, const RowId row1, const RowId row2) {
+        return calculateDistance(cities.position(row1), cities.position(row2));
+    }
+
+    //  From unit vectors: the dot product is cos(d), only the acos is left
+    static double calculateDistance(const UnitVector& a, const UnitVector& b) {
+        return acos(std::clamp(a.dot(b), -1.0, 1.0)) * EARTH_RADIUS_KM;
+    }
+
+    //  Converts between great circle distance in km and the squared chord length ranking queries
+    //  compare, so a radius can be turned into a chord threshold once instead of an acos per city
+    static double chordSquaredForDistance(const double km) {
+        const double d = std::clamp(km / EARTH_RADIUS_KM, 0.0, M_PI);
+        return 2.0 - 2.0 * cos(d);
+    }
+
+    //  2*asin(c/2) keeps its precision for short distances where acos(1 - c^2/2) would not
+    static double distanceForChordSquared(const double chordSquared) {
+        return 2.0 * asin(std::clamp(sqrt(std::max(chordSquared, 0.0)) / 2.0, 0.0, 1.0)) * EARTH_RADIUS_KM;
+    }
+
+    //  Coordinates in degrees
+    static double calculateDistance(const double latitude1, const double longitude1,
+                                    const double latitude2, const double longitude2) {
+
+        // Converts latitude and longitude values from degrees to radians.
+        const double lat1 = latitude1 * M_PI / 180.0;
+        const double lon1 = longitude1 * M_PI / 180.0;
+        const double lat2 = latitude2 * M_PI / 180.0;
+        const double lon2 = longitude2 * M_PI / 180.0;
+
+        //  find cos(D) angular distance sin(phi1)*sin(phi2) + cos(phi1)*cos(phi2)*cos(L1 - L2)
+        double cosD = sin(lat1) * sin(lat2) + cos(lat1) * cos(lat2) * cos(lon1 - lon2);
+
+        //  cosD validation range = [-1, 1]
+        //  Note clamp restrains value to -1 to 1 so that trig works and no domain error.
+        cosD = std::clamp(cosD, -1.0, 1.0);
+
+        //  Use acos to find d
+        const double d = acos(cosD);
+
+        //  Convert angular distance to linear distance.
+        const double distance = d * EARTH_RADIUS_KM;
+
+        return distance;
+
+    }
+
+    //  Sines and cosines of every city's latitude and longitude, computed once and reused by the
+    //  batch calculations. Indexed by RowId like the table it was built from.
+    struct TrigCache {
+        std::vector<double> sinLat, cosLat, sinLon, cosLon;
+
+        std::size_t size() const { return sinLat.size(); }
+
+        void assign(const double* latitudes, const double* longitudes, const std::size_t count) {
+            sinLat.resize(count);
+            cosLat.resize(count);
+            sinLon.resize(count);
+            cosLon.resize(count);
+            for (std::size_t i = 0; i < count; ++i) {
+                const double lat = latitudes[i] * M_PI / 180.0;
+                const double lon = longitudes[i] * M_PI / 180.0;
+                sinLat[i] = sin(lat);
+                cosLat[i] = cos(lat);
+                sinLon[i] = sin(lon);
+                cosLon[i] = cos(lon);
+            }
+        }
+
+        static TrigCache build(const CityTable& cities) {
+            TrigCache cache;
+            cache.assign(cities.latitudes().data(), cities.longitudes().data(), cities.size());
+            return cache;
+        }
+    };
+
+    //  One to many: distances in km from (latitude, longitude) in degrees to every city in the cache.
+    //  out must hold cache.size() values. Deleted rows get a value too, callers skip them.
+    static void calculateDistances(const double latitude, const double longitude, const TrigCache& cache, double* out) {
+        const double lat = latitude * M_PI / 180.0;
+        const double lon = longitude * M_PI / 180.0;
+        calculateDistances(sin(lat), cos(lat), sin(lon), cos(lon), cache, 0, cache.size(), out);
+    }
+
+    //  One to many from a row of the cache itself
+    static void calculateDistances(const TrigCache& cache, const RowId from, double* out) {
+        calculateDistances(cache.sinLat[from], cache.cosLat[from], cache.sinLon[from], cache.cosLon[from],
+                           cache, 0, cache.size(), out);
+    }
+
+    //  One to many over plain coordinate arrays in degrees, no cache required.
+    //  Trig for the targets is done block by block so the temporaries stay in cache.
+    static void calculateDistances(const double latitude, const double longitude,
+                                   const double* latitudes, const double* longitudes, const std::size_t count,
+                                   double* out) {
+        constexpr std::size_t BLOCK = 1024;
+        TrigCache block;
+        for (std::size_t begin = 0; begin < count; begin += BLOCK) {
+            const std::size_t n = std::min(BLOCK, count - begin);
+            block.assign(latitudes + begin, longitudes + begin, n);
+            calculateDistances(latitude, longitude, block, out + begin);
+        }
+    }
+
+    //  One to many over the table's unit vectors: a dot product and one acos per city.
+    //  out must hold cities.size() values, deleted rows included.
+    static void calculateDistances(const UnitVector& from, const CityTable& cities, double* out) {
+        calculateChordsSquared(from, cities, out);
+        for (std::size_t i = 0; i < cities.size(); ++i) out[i] = distanceForChordSquared(out[i]);
+    }
+
+    //  Squared chord lengths from one point to every row, for ranking and radius tests that never
+    //  need the distance itself. No trig at all, the loop is plain multiply adds.
+    static void calculateChordsSquared(const UnitVector& from, const CityTable& cities, double* out) {
+        const double* xs = cities.xs().data();
+        const double* ys = cities.ys().data();
+        const double* zs = cities.zs().data();
+        const std::size_t n = cities.size();
+        for (std::size_t i = 0; i < n; ++i) {
+            out[i] = 2.0 - 2.0 * (from.x * xs[i] + from.y * ys[i] + from.z * zs[i]);
+        }
+    }
+
+    //  k nearest cities to a point through the table's spatial index, nearest first, distances in km
+    static std::vector<std::pair<RowId, double>> nearest(const CityTable& cities, const UnitVector& from,
+                                                         const std::size_t k) {
+        std::vector<std::pair<RowId, double>> results;
+        for (const auto& neighbour : cities.nearest(from, k)) {
+            results.emplace_back(neighbour.row, distanceForChordSquared(neighbour.chordSquared));
+        }
+        return results;
+    }
+
+    //  Every city within km of a point through the table's cell index, in row order
+    static std::vector<RowId> within(const CityTable& cities, const UnitVector& from, const double km) {
+        if (km < 0) return {};
+        return cities.within(from, std::min(km / EARTH_RADIUS_KM, M_PI), chordSquaredForDistance(km));
+    }
+
+    //  Many to many: row major matrix of from.size() x to.size() distances in km
+    static void calculateDistances(const TrigCache& from, const TrigCache& to, double* out) {
+        for (std::size_t i = 0; i < from.size(); ++i) {
+            calculateDistances(from.sinLat[i], from.cosLat[i], from.sinLon[i], from.cosLon[i],
+                               to, 0, to.size(), out + i * to.size());
+        }
+    }
+
+    //  Core batch step over the targets [begin, end) of a cache, origin given by its sines and cosines.
+    //  cos(L1 - L2) is expanded to cos(L1)cos(L2) + sin(L1)sin(L2), which leaves only multiplies and
+    //  adds in the inner loop, then one acos per pair.
+    static void calculateDistances(const double sinLat, const double cosLat, const double sinLon, const double cosLon,
+                                   const TrigCache& cache, const std::size_t begin, const std::size_t end,
+                                   double* out) {
+        const std::size_t n = end - begin;
+        const double* sLat = cache.sinLat.data() + begin;
+        const double* cLat = cache.cosLat.data() + begin;
+        const double* sLon = cache.sinLon.data() + begin;
+        const double* cLon = cache.cosLon.data() + begin;
+
+        cosineKernel()(sinLat, cosLat, sinLon, cosLon, sLat, cLat, sLon, cLon, n, out);
+
+        for (std::size_t i = 0; i < n; ++i) {
+            out[i] = acos(std::clamp(out[i], -1.0, 1.0)) * EARTH_RADIUS_KM;
+        }
+    }
+
+    //  cos(D) for one origin, given by its sines and cosines, against n targets
+    using CosineKernel = void (*)(double, double, double, double, const double*, const double*, const double*,
+                                  const double*, std::size_t, double*);
+
+    //  Every kernel the running CPU supports, widest first and the scalar one last
+    static std::vector<CosineKernel> cosineKernels() {
+        std::vector<CosineKernel> kernels;
+#ifdef CITIES_X86_DISPATCH
+        if (__builtin_cpu_supports("avx512f")) kernels.push_back(&cosineKernelAvx512);
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) kernels.push_back(&cosineKernelAvx2);
+#endif
+        kernels.push_back(&cosineKernelScalar);
+        return kernels;
+    }
+
+private:
+
+    //  cos(D) for one origin against n targets
+    static void cosineKernelScalar(const double sinLat, const double cosLat, const double sinLon, const double cosLon,
+                                   const double* sLat, const double* cLat, const double* sLon, const double* cLon,
+                                   const std::size_t n, double* out) {
+        for (std::size_t i = 0; i < n; ++i) {
+            out[i] = sinLat * sLat[i] + cosLat * cLat[i] * (cosLon * cLon[i] + sinLon * sLon[i]);
+        }
+    }
+
+#ifdef CITIES_X86_DISPATCH
+    __attribute__((target("avx2,fma")))
+    static void cosineKernelAvx2(const double sinLat, const double cosLat, const double sinLon, const double cosLon,
+                                 const double* sLat, const double* cLat, const double* sLon, const double* cLon,
+                                 const std::size_t n, double* out) {
+        const __m256d vSinLat = _mm256_set1_pd(sinLat), vCosLat = _mm256_set1_pd(cosLat);
+        const __m256d vSinLon = _mm256_set1_pd(sinLon), vCosLon = _mm256_set1_pd(cosLon);
+        std::size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            const __m256d lon = _mm256_fmadd_pd(vCosLon, _mm256_loadu_pd(cLon + i),
+                                                _mm256_mul_pd(vSinLon, _mm256_loadu_pd(sLon + i)));
+            const __m256d lat = _mm256_mul_pd(vCosLat, _mm256_loadu_pd(cLat + i));
+            _mm256_storeu_pd(out + i, _mm256_fmadd_pd(lat, lon, _mm256_mul_pd(vSinLat, _mm256_loadu_pd(sLat + i))));
+        }
+        cosineKernelScalar(sinLat, cosLat, sinLon, cosLon, sLat + i, cLat + i, sLon + i, cLon + i, n - i, out + i);
+    }
+
+    __attribute__((target("avx512f")))
+    static void cosineKernelAvx512(const double sinLat, const double cosLat, const double sinLon, const double cosLon,
+                                   const double* sLat, const double* cLat, const double* sLon, const double* cLon,
+                                   const std::size_t n, double* out) {
+        const __m512d vSinLat = _mm512_set1_pd(sinLat), vCosLat = _mm512_set1_pd(cosLat);
+        const __m512d vSinLon = _mm512_set1_pd(sinLon), vCosLon = _mm512_set1_pd(cosLon);
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            const __m512d lon = _mm512_fmadd_pd(vCosLon, _mm512_loadu_pd(cLon + i),
+                                                _mm512_mul_pd(vSinLon, _mm512_loadu_pd(sLon + i)));
+            const __m512d lat = _mm512_mul_pd(vCosLat, _mm512_loadu_pd(cLat + i));
+            _mm512_storeu_pd(out + i, _mm512_fmadd_pd(lat, lon, _mm512_mul_pd(vSinLat, _mm512_loadu_pd(sLat + i))));
+        }
+        cosineKernelScalar(sinLat, cosLat, sinLon, cosLon, sLat + i, cLat + i, sLon + i, cLon + i, n - i, out + i);
+    }
+#endif
+
+    //  Widest kernel the running CPU supports, chosen once
+    static CosineKernel cosineKernel() {
+        static const CosineKernel kernel = cosineKernels().front();
+        return kernel;
+    }
+};
+
+//  Read only view of a whole file. POSIX builds map it into memory so parsing reads the page cache
+//  in place, other platforms read it into one buffer.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    //  False if the file cannot be opened or read
+    bool open(const std::string& fileName) {
+        close();
+#ifdef CITIES_POSIX_IO
+        const int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info{};
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = static_cast<std::size_t>(info.st_size);
+        if (length > 0) {
+            void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            madvise(address, length, MADV_SEQUENTIAL);
+            mapping = static_cast<const char*>(address);
+        }
+        ::close(fd);
+        return true;
+#else
+        std::ifstream file(fileName, std::ios::binary);
+        if (!file.is_open()) return false;
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        mapping = buffer.data();
+        length = buffer.size();
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef CITIES_POSIX_IO
+        if (mapping != nullptr) munmap(const_cast<char*>(mapping), length);
+#else
+        buffer.clear();
+#endif
+        mapping = nullptr;
+        length = 0;
+    }
+
+    std::string_view text() const { return {mapping, length}; }
+
+    //  Drops the pages read so far from memory, the next access reads them back from the file
+    void release() const {
+#ifdef CITIES_POSIX_IO
+        if (mapping != nullptr) madvise(const_cast<char*>(mapping), length, MADV_DONTNEED);
+#endif
+    }
+
+private:
+    const char* mapping = nullptr;
+    std::size_t length = 0;
+#ifndef CITIES_POSIX_IO
+    std::string buffer;
+#endif
+};
+
+//  Output file written through one large reusable buffer, handed to the OS in a few big writes.
+//  Numbers are formatted with std::to_chars, which is locale independent and, for doubles, gives
+//  the shortest text that reads back to the same value.
+class BufferedWriter {
+public:
+    static constexpr std::size_t BUFFER_BYTES = 1 << 20;
+
+    BufferedWriter() { buffer.reserve(BUFFER_BYTES); }
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+    ~BufferedWriter() { close(); }
+
+    bool open(const std::string& fileName) {
+        close();
+        failed = false;
+        buffer.clear();
+#ifdef CITIES_POSIX_IO
+        fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0;
+#else
+        file = std::fopen(fileName.c_str(), "wb");
+        return file != nullptr;
+#endif
+    }
+
+    void append(const std::string_view text) {
+        if (buffer.size() + text.size() > BUFFER_BYTES) flush();
+        if (text.size() > BUFFER_BYTES) {
+            writeOut(text.data(), text.size());
+            return;
+        }
+        buffer.insert(buffer.end(), text.begin(), text.end());
+    }
+
+    void append(const char c) {
+        if (buffer.size() == BUFFER_BYTES) flush();
+        buffer.push_back(c);
+    }
+
+    template <typename T>
+    void appendNumber(const T value) {
+        char digits[32];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        append(std::string_view(digits, static_cast<std::size_t>(result.ptr - digits)));
+    }
+
+    //  Writes out the buffer, forces the file to disk and closes it. False if anything failed.
+    bool finish() {
+        flush();
+#ifdef CITIES_POSIX_IO
+        if (fd >= 0 && fsync(fd) != 0) failed = true;
+#else
+        if (file != nullptr && std::fflush(file) != 0) failed = true;
+#endif
+        close();
+        return !failed;
+    }
+
+    void close() {
+#ifdef CITIES_POSIX_IO
+        if (fd >= 0 && ::close(fd) != 0) failed = true;
+        fd = -1;
+#else
+        if (file != nullptr && std::fclose(file) != 0) failed = true;
+        file = nullptr;
+#endif
+    }
+
+private:
+    std::vector<char> buffer;
+    bool failed = false;
+#ifdef CITIES_POSIX_IO
+    int fd = -1;
+#else
+    std::FILE* file = nullptr;
+#endif
+
+    void flush() {
+        writeOut(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void writeOut(const char* data, std::size_t size) {
+#ifdef CITIES_POSIX_IO
+        while (size > 0 && !failed) {
+            const ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                failed = true;
+                return;
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+#else
+        if (size > 0 && std::fwrite(data, 1, size, file) != size) failed = true;
+#endif
+    }
+};
+
+//  Class to manage the file cities data is stored in.
+//  File Format :
+//  name,country,population,recordYear,latitude,longitude,mayorName,mayorAddress,history
+class FileManager {
+public:
+    //  One line of the file, text fields view the line they were parsed from
+    struct Record {
+        std::string_view name, country, mayorName, mayorAddress, history;
+        int population = 0, recordYear = 0;
+        double latitude = 0.0, longitude = 0.0;
+        UnitVector position;    //  Only filled by the parallel loader
+
+        std::string_view text(const CityField field) const {
+            switch (field) {
+                case CityField::Name: return name;
+                case CityField::Country: return country;
+                case CityField::MayorName: return mayorName;
+                case CityField::MayorAddress: return mayorAddress;
+                case CityField::History: return history;
+                default: return {};
+            }
+        }
+
+        double number(const CityField field) const {
+            switch (field) {
+                case CityField::Population: return population;
+                case CityField::RecordYear: return recordYear;
+                case CityField::Latitude: return latitude;
+                case CityField::Longitude: return longitude;
+                default: return 0.0;
+            }
+        }
+    };
+
+    //  Files smaller than this are parsed on the calling thread
+    static constexpr std::size_t PARALLEL_MIN_BYTES = 4 << 20;
+
+    //  lazyColdFields keeps mayorName, mayorAddress and history of a text file in the file itself:
+    //  the table references them by offset into the mapping, whose pages are released after the load
+    //  and read back from disk only when one of those fields is displayed or searched. The first
+    //  history search indexes every history and so brings all of it back. Only the bytes of those
+    //  values are saved: their per row offsets and lengths, the hot columns and the indexes stay in
+    //  memory, and name and country stay copied because every lookup and index reads them.
+    static CityTable loadData(const std::string& fileName, const bool lazyColdFields = false) {
+        CityTable cities;   //  Store Loaded cities instances
+        auto mapped = std::make_shared<MappedFile>();
+        MappedFile& file = *mapped;
+
+        //  Validate that the file opened or not
+        if (!file.open(fileName)) {
+            std::cout<< "File doesn't exist: Creating File. . .  "<< fileName<< '\n';
+            return cities;
+        }
+        const std::string_view text = file.text();
+        if (isSnapshot(text)) {
+            if (!loadSnapshot(text, cities, mapped)) std::cerr << "Error: Invalid snapshot file.\n";
+            return cities;
+        }
+
+        // Loads city data from the mapped text straight into the columns of a CityTable,
+        // fields are parsed in place and copied once, into the table's string heaps.
+        cities.reserve(static_cast<std::size_t>(std::count(text.begin(), text.end(), '\n')) + 1);
+        if (lazyColdFields) cities.referenceColdFields(text, mapped);
+        if (text.size() < PARALLEL_MIN_BYTES || std::thread::hardware_concurrency() < 2) {
+            parseRecords(text, cities);
+        } else {
+            parseRecordsParallel(text, cities);
+        }
+        if (lazyColdFields) file.release();
+        return cities;
+    }
+
+    //  Splits text into chunks at line boundaries and parses them on all cores. Each chunk becomes a
+    //  list of records viewing text, with unit vectors computed, then the chunks are added to cities
+    //  in file order, so the table is identical to the one parseRecords builds.
+    static void parseRecordsParallel(const std::string_view text, CityTable& cities) {
+        const std::size_t chunkBytes = std::max(PARALLEL_MIN_BYTES / 4, text.size() / (4 * std::thread::hardware_concurrency()));
+        std::vector<std::string_view> chunks;
+        for (std::size_t begin = 0; begin < text.size();) {
+            std::size_t end = std::min(text.size(), begin + chunkBytes);
+            if (end < text.size()) {
+                end = text.find('\n', end);
+                end = end == std::string_view::npos ? text.size() : end + 1;
+            }
+            chunks.push_back(text.substr(begin, end - begin));
+            begin = end;
+        }
+
+        std::vector<std::vector<Record>> parsed(chunks.size());
+        parallelFor(chunks.size(), [&](const std::size_t chunk) {
+            std::string_view rest = chunks[chunk];
+            auto& records = parsed[chunk];
+            records.reserve(static_cast<std::size_t>(std::count(rest.begin(), rest.end(), '\n')) + 1);
+            Record record;
+            while (!rest.empty()) {
+                const std::size_t end = rest.find('\n');
+                const std::string_view line = rest.substr(0, end);
+                rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+                if (!parseRecord(line, record)) continue;
+                record.position = UnitVector::fromDegrees(record.latitude, record.longitude);
+                records.push_back(record);
+            }
+        });
+
+        for (auto& records : parsed) {
+            for (const Record& record : records) {
+                cities.add(record.name, record.country, record.population, record.recordYear, record.latitude,
+                           record.longitude, record.mayorName, record.mayorAddress, record.history, record.position);
+            }
+            std::vector<Record>().swap(records);
+        }
+    }
+
+    //  Parses every line of text into cities, blank lines are skipped
+    static void parseRecords(std::string_view text, CityTable& cities) {
+        Record record;
+        while (!text.empty()) {
+            const std::size_t end = text.find('\n');
+            const std::string_view line = text.substr(0, end);
+            text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+            if (!parseRecord(line, record)) continue;
+            cities.add(record.name, record.country, record.population, record.recordYear, record.latitude,
+                       record.longitude, record.mayorName, record.mayorAddress, record.history);
+        }
+    }
+
+    //  Splits one line into its fields. history is the rest of the line and may contain commas.
+    //  Numbers that fail to parse read as 0, the same as the stream extraction this replaced.
+    static bool parseRecord(std::string_view line, Record& record) {
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (line.empty()) return false;
+
+        record.name = nextField(line);
+        record.country = nextField(line);
+        record.population = parseNumber<int>(nextField(line));
+        record.recordYear = parseNumber<int>(nextField(line));
+        record.latitude = parseNumber<double>(nextField(line));
+        record.longitude = parseNumber<double>(nextField(line));
+        record.mayorName = nextField(line);
+        record.mayorAddress = nextField(line);
+        record.history = line;
+        return true;
+    }
+
+    //  Text up to the next comma, consumed from line along with the comma
+    static std::string_view nextField(std::string_view& line) {
+        const std::size_t comma = line.find(',');
+        const std::string_view field = line.substr(0, comma);
+        line.remove_prefix(comma == std::string_view::npos ? line.size() : comma + 1);
+        return field;
+    }
+
+    template <typename T>
+    static T parseNumber(std::string_view field) {
+        while (!field.empty() && (field.front() == ' ' || field.front() == '\t')) field.remove_prefix(1);
+        if (!field.empty() && field.front() == '+') field.remove_prefix(1);
+        T value{};
+        if (std::from_chars(field.data(), field.data() + field.size(), value).ec != std::errc()) return T{};
+        return value;
+    }
+    //  Writes the text format, or a binary snapshot when fileName ends in SNAPSHOT_EXTENSION.
+    //  The data goes to fileName.tmp first, is synced and then renamed over fileName, so a crash
+    //  part way leaves the previous file intact. False and reported to std::cerr on failure.
+    static bool saveData(const CityTable& cities, const std::string& fileName) {
+        const std::string temporary = fileName + ".tmp";
+        const bool written = isSnapshotName(fileName)
+            ? saveSnapshot(cities, temporary)
+            : saveText(cities, temporary);
+        if (!written) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        if (!replaceFile(temporary, fileName)) {
+            std::cerr << "Error: Cannot replace " << fileName << ".\n";
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    //  Text format through a BufferedWriter, synced before it returns
+    static bool saveText(const CityTable& cities, const std::string& fileName) {
+        BufferedWriter file;
+
+        if (!file.open(fileName)) {
+            std::cerr << "Error: Cannot open file.\n";
+            return false;
+        }
+
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (!cities.alive(row)) continue;
+            file.append(cities.name(row));
+            file.append(',');
+            file.append(cities.country(row));
+            file.append(',');
+            file.appendNumber(cities.population(row));
+            file.append(',');
+            file.appendNumber(cities.recordYear(row));
+            file.append(',');
+            file.appendNumber(cities.latitude(row));
+            file.append(',');
+            file.appendNumber(cities.longitude(row));
+            file.append(',');
+            file.append(cities.mayorName(row));
+            file.append(',');
+            file.append(cities.mayorAddress(row));
+            file.append(',');
+            file.append(cities.history(row));
+            file.append('\n');
+        }
+        if (!file.finish()) {
+            std::cerr << "Error: Cannot write file.\n";
+            return false;
+        }
+        return true;
+    }
+
+    //  Binary snapshot format. saveData writes it for file names ending in SNAPSHOT_EXTENSION and
+    //  loadData recognises it by its magic whatever the file is called.
+    //  header  SnapshotHeader, then blockCount x SnapshotBlock {offset, size} in the order below.
+    //          Version 1 headers end before journalSequence.
+    //  blocks  latitude, longitude, x, y, z (double), population, recordYear (int32), deleted (uint8),
+    //          then for name, country, mayorName, mayorAddress and history: heap bytes, uint64 row
+    //          offsets, uint32 row lengths
+    //  Every block starts on a 64 byte boundary. Deleted rows are kept so row ids survive a round trip.
+    static constexpr char SNAPSHOT_MAGIC[4] = {'C', 'W', 'S', 'S'};
+    static constexpr std::uint32_t SNAPSHOT_VERSION = 2;
+    static constexpr std::uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+    static constexpr std::uint32_t SNAPSHOT_BLOCKS = 23;
+    static constexpr std::string_view SNAPSHOT_EXTENSION = ".snapshot";
+
+    struct SnapshotHeader {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t byteOrder;    //  SNAPSHOT_BYTE_ORDER as written by the saving machine
+        std::uint32_t blockCount;
+        std::uint64_t rowCount;     //  Row slots, deleted rows included
+        std::uint64_t liveCount;
+        std::uint64_t journalSequence;  //  Last Journal record the snapshot contains, 0 for none
+    };
+
+    static std::size_t snapshotHeaderSize(const std::uint32_t version) {
+        return version == 1 ? offsetof(SnapshotHeader, journalSequence) : sizeof(SnapshotHeader);
+    }
+
+    struct SnapshotBlock {
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    static bool isSnapshot(const std::string_view text) {
+        return text.size() >= sizeof(SNAPSHOT_MAGIC) && std::equal(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC), text.begin());
+    }
+
+    static bool isSnapshotName(const std::string_view fileName) {
+        return fileName.size() >= SNAPSHOT_EXTENSION.size() &&
+               fileName.substr(fileName.size() - SNAPSHOT_EXTENSION.size()) == SNAPSHOT_EXTENSION;
+    }
+
+    //  Written through a BufferedWriter and synced before it returns, callers rename it into place.
+    //  String heaps are written value by value in row order, so space left behind by updates and
+    //  values referenced from a mapped file end up as one compact heap. False and reported to
+    //  std::cerr if the file could not be written.
+    static bool saveSnapshot(const CityTable& cities, const std::string& fileName, const std::uint64_t journalSequence = 0) {
+        BufferedWriter file;
+
+        if (!file.open(fileName)) {
+            std::cerr << "Error: Cannot open file.\n";
+            return false;
+        }
+
+        struct Block {
+            const void* data;
+            std::uint64_t size;
+            const StringColumn* values;     //  Heap block written from the column's values instead
+        };
+        std::vector<Block> blocks;
+        auto column = [&blocks](const auto& values) {
+            blocks.push_back({values.data(), values.size() * sizeof(values[0]), nullptr});
+        };
+        column(cities.latitudeColumn);
+        column(cities.longitudeColumn);
+        column(cities.xColumn);
+        column(cities.yColumn);
+        column(cities.zColumn);
+        column(cities.populationColumn);
+        column(cities.recordYearColumn);
+        column(cities.deleted);
+        std::vector<std::vector<std::uint64_t>> offsets(5);
+        std::size_t next = 0;
+        for (const StringColumn* strings : {&cities.nameColumn, &cities.countryColumn, &cities.mayorNameColumn,
+                                            &cities.mayorAddressColumn, &cities.historyColumn}) {
+            std::vector<std::uint64_t>& starts = offsets[next++];
+            starts.reserve(strings->size());
+            std::uint64_t heapSize = 0;
+            for (const std::uint32_t length : strings->rowLengths()) {
+                starts.push_back(heapSize);
+                heapSize += length;
+            }
+            blocks.push_back({nullptr, heapSize, strings});
+            column(starts);
+            column(strings->rowLengths());
+        }
+
+        SnapshotHeader header{};
+        std::copy(std::begin(SNAPSHOT_MAGIC), std::end(SNAPSHOT_MAGIC), header.magic);
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.blockCount = SNAPSHOT_BLOCKS;
+        header.rowCount = cities.size();
+        header.liveCount = cities.liveCount();
+        header.journalSequence = journalSequence;
+
+        std::vector<SnapshotBlock> table;
+        std::uint64_t offset = alignBlock(sizeof(header) + SNAPSHOT_BLOCKS * sizeof(SnapshotBlock));
+        for (const Block& block : blocks) {
+            table.push_back({offset, block.size});
+            offset = alignBlock(offset + block.size);
+        }
+
+        file.append(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+        file.append(std::string_view(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotBlock)));
+        static constexpr char padding[64] = {};
+        std::uint64_t written = sizeof(header) + table.size() * sizeof(SnapshotBlock);
+        for (std::size_t i = 0; i < blocks.size(); ++i) {
+            file.append(std::string_view(padding, static_cast<std::size_t>(table[i].offset - written)));
+            if (blocks[i].values != nullptr) {
+                for (std::size_t row = 0; row < blocks[i].values->size(); ++row) file.append((*blocks[i].values)[row]);
+            } else {
+                file.append(std::string_view(static_cast<const char*>(blocks[i].data), static_cast<std::size_t>(blocks[i].size)));
+            }
+            written = table[i].offset + table[i].size;
+        }
+        if (!file.finish()) {
+            std::cerr << "Error: Cannot write file.\n";
+            return false;
+        }
+        return true;
+    }
+
+    //  Journal sequence stored in a snapshot file, 0 if it has none or is not a snapshot
+    static std::uint64_t snapshotJournalSequence(const std::string& fileName) {
+        MappedFile file;
+        if (!file.open(fileName)) return 0;
+        const std::string_view text = file.text();
+        SnapshotHeader header{};
+        if (!isSnapshot(text) || text.size() < sizeof(header)) return 0;
+        std::memcpy(&header, text.data(), sizeof(header));
+        return header.version >= 2 ? header.journalSequence : 0;
+    }
+
+    //  Forces a written file to disk, a no-op where fsync is not available
+    static bool syncFile(const std::string& fileName) {
+#ifdef CITIES_POSIX_IO
+        const int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        const bool synced = fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+#else
+        (void)fileName;
+        return true;
+#endif
+    }
+
+    //  Renames source over target and makes the rename itself durable
+    static bool replaceFile(const std::string& source, const std::string& target) {
+        if (std::rename(source.c_str(), target.c_str()) != 0) return false;
+#ifdef CITIES_POSIX_IO
+        const std::size_t slash = target.find_last_of('/');
+        syncFile(slash == std::string::npos ? "." : target.substr(0, slash == 0 ? 1 : slash));
+#endif
+        return true;
+    }
+
+    //  Validates a mapped snapshot and fills the table's columns from its blocks. No record is parsed,
+    //  the only per row work is the bounds check of the string offsets and queuing rows for the spatial
+    //  indexes. The name index is built on first use. With an owner that keeps text alive the string
+    //  heaps are read where they are in the mapping, the bulk of the file. The other blocks are copied,
+    //  they become vectors that adds append to and updates write in place.
+    static bool loadSnapshot(const std::string_view text, CityTable& cities, std::shared_ptr<const void> owner = nullptr) {
+        SnapshotHeader header{};
+        if (text.size() < snapshotHeaderSize(1)) return false;
+        std::memcpy(&header, text.data(), snapshotHeaderSize(1));
+        if (!isSnapshot(text) || header.version < 1 || header.version > SNAPSHOT_VERSION) return false;
+        const std::size_t headerSize = snapshotHeaderSize(header.version);
+        if (text.size() < headerSize + SNAPSHOT_BLOCKS * sizeof(SnapshotBlock)) return false;
+        std::memcpy(&header, text.data(), headerSize);
+        if (header.byteOrder != SNAPSHOT_BYTE_ORDER || header.blockCount != SNAPSHOT_BLOCKS ||
+            header.rowCount > std::numeric_limits<RowId>::max()) {
+            return false;
+        }
+        SnapshotBlock table[SNAPSHOT_BLOCKS];
+        std::memcpy(table, text.data() + headerSize, sizeof(table));
+        for (const SnapshotBlock& block : table) {
+            if (block.offset > text.size() || block.size > text.size() - block.offset) return false;
+        }
+
+        const std::size_t rows = header.rowCount;
+        CityTable loaded;
+        std::size_t next = 0;
+        auto column = [&](auto& values, const bool perRow) {
+            using T = typename std::decay_t<decltype(values)>::value_type;
+            const SnapshotBlock& block = table[next++];
+            if (block.size % sizeof(T) != 0 || (perRow && block.size != rows * sizeof(T))) return false;
+            values.resize(block.size / sizeof(T));
+            if (block.size > 0) std::memcpy(values.data(), text.data() + block.offset, block.size);
+            return true;
+        };
+        if (!column(loaded.latitudeColumn, true) || !column(loaded.longitudeColumn, true) ||
+            !column(loaded.xColumn, true) || !column(loaded.yColumn, true) || !column(loaded.zColumn, true) ||
+            !column(loaded.populationColumn, true) || !column(loaded.recordYearColumn, true) ||
+            !column(loaded.deleted, true)) {
+            return false;
+        }
+        for (StringColumn* strings : {&loaded.nameColumn, &loaded.countryColumn, &loaded.mayorNameColumn,
+                                      &loaded.mayorAddressColumn, &loaded.historyColumn}) {
+            std::vector<char> heap;
+            std::vector<std::uint64_t> offsets;
+            std::vector<std::uint32_t> lengths;
+            if (owner != nullptr) {
+                const SnapshotBlock& block = table[next++];
+                if (!column(offsets, true) || !column(lengths, true) ||
+                    !strings->assignExternal(text.data() + block.offset, block.size, std::move(offsets), std::move(lengths))) {
+                    return false;
+                }
+            } else if (!column(heap, false) || !column(offsets, true) || !column(lengths, true) ||
+                       !strings->assign(std::move(heap), std::move(offsets), std::move(lengths))) {
+                return false;
+            }
+        }
+        loaded.mappedSource = std::move(owner);
+
+        const auto live = static_cast<std::size_t>(std::count(loaded.deleted.begin(), loaded.deleted.end(), 0));
+        if (live != header.liveCount) return false;
+        loaded.live = live;
+        loaded.nameIndexBuilt = false;
+        loaded.countriesBuilt = false;
+        for (RowId row = 0; row < rows; ++row) {
+            if (loaded.deleted[row]) continue;
+            loaded.spatialIndex.insert(row);
+            loaded.cellIndex.insert(row);
+            loaded.prefixIndex.insert(row);
+        }
+        cities = std::move(loaded);
+        return true;
+    }
+
+private:
+    static std::uint64_t alignBlock(const std::uint64_t offset) { return (offset + 63) & ~std::uint64_t{63}; }
+};
+
+//  Journal members that need the complete CityTable and FileManager
+
+inline bool Journal::open(const std::string& snapshotFile, CityTable& cities) {
+    close();
+    snapshotName = snapshotFile;
+    journalName = snapshotFile + ".journal";
+    rotatedName = journalName + ".1";
+
+    //  A journal moved aside by a checkpoint that never finished is replayed first
+    const std::uint64_t covered = FileManager::snapshotJournalSequence(snapshotName);
+    std::uint64_t last = covered;
+    bool recovered = replay(rotatedName, cities, covered, last);
+    recovered = replay(journalName, cities, covered, last) || recovered;
+
+    //  Fold what was replayed into a fresh snapshot so both journals can start over
+    if (recovered) {
+        const std::string temporary = snapshotName + ".tmp";
+        if (FileManager::saveSnapshot(cities, temporary, last) && FileManager::replaceFile(temporary, snapshotName)) {
+            std::remove(rotatedName.c_str());
+            std::remove(journalName.c_str());
+        }
+    }
+
+    file = std::fopen(journalName.c_str(), "ab");
+    if (file == nullptr) {
+        std::cerr << "Error: Cannot open journal " << journalName << ".\n";
+        return false;
+    }
+    journalBytes = static_cast<std::uint64_t>(std::ftell(file));
+    lastSequence = durableSequence = last;
+    stopping = flushFailed = false;
+    table = &cities;
+    cities.attachJournal(this);
+    flusher = std::thread(&Journal::flushLoop, this);
+    return true;
+}
+
+inline void Journal::close() {
+    if (file == nullptr) return;
+    commit();
+    if (checkpointer.joinable()) checkpointer.join();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    flushWanted.notify_all();
+    flusher.join();
+    std::fclose(file);
+    file = nullptr;
+    if (table) table->attachJournal(nullptr);
+    table = nullptr;
+}
+
+inline void Journal::beginRecord(const RecordType type, const RowId row, std::size_t& start) {
+    start = buffer.size();
+    buffer.append(2 * sizeof(std::uint32_t), '\0');   //  Length and checksum, filled in by endRecord
+    ++lastSequence;
+    putBytes(&lastSequence, sizeof(lastSequence));
+    putBytes(&type, sizeof(type));
+    putBytes(&row, sizeof(row));
+}
+
+inline void Journal::endRecord(const std::size_t start) {
+    const std::size_t payload = start + 2 * sizeof(std::uint32_t);
+    const auto length = static_cast<std::uint32_t>(buffer.size() - payload);
+    const std::uint32_t checksum = crc32(buffer.data() + payload, length);
+    std::memcpy(buffer.data() + start, &length, sizeof(length));
+    std::memcpy(buffer.data() + start + sizeof(length), &checksum, sizeof(checksum));
+}
+
+inline void Journal::putString(const std::string_view value) {
+    const auto length = static_cast<std::uint32_t>(value.size());
+    putBytes(&length, sizeof(length));
+    putBytes(value.data(), value.size());
+}
+
+inline void Journal::logAdd(const RowId row, const std::string_view cityName, const std::string_view cityCountry,
+                            const int pop, const int year, const double lat, const double lon,
+                            const std::string_view mayor, const std::string_view address, const std::string_view hist) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t start;
+    beginRecord(ADD, row, start);
+    const std::int32_t population = pop, recordYear = year;
+    putBytes(&population, sizeof(population));
+    putBytes(&recordYear, sizeof(recordYear));
+    putBytes(&lat, sizeof(lat));
+    putBytes(&lon, sizeof(lon));
+    for (const std::string_view text : {cityName, cityCountry, mayor, address, hist}) putString(text);
+    endRecord(start);
+}
+
+inline void Journal::logErase(const RowId row) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t start;
+    beginRecord(ERASE, row, start);
+    endRecord(start);
+}
+
+inline void Journal::logUpdate(const RowId row, const std::string_view field, const std::string_view value) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t start;
+    beginRecord(UPDATE_TEXT, row, start);
+    putString(field);
+    putString(value);
+    endRecord(start);
+}
+
+inline void Journal::logUpdate(const RowId row, const std::string_view field, const int value) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t start;
+    beginRecord(UPDATE_INT, row, start);
+    putString(field);
+    const std::int32_t number = value;
+    putBytes(&number, sizeof(number));
+    endRecord(start);
+}
+
+inline void Journal::logUpdate(const RowId row, const std::string_view field, const double value) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::size_t start;
+    beginRecord(UPDATE_DOUBLE, row, start);
+    putString(field);
+    putBytes(&value, sizeof(value));
+    endRecord(start);
+}
+
+inline bool Journal::commit() {
+    if (file == nullptr) return true;
+    std::unique_lock<std::mutex> held(lock);
+    const std::uint64_t target = lastSequence;
+    if (durableSequence >= target) return true;
+    flushWanted.notify_one();
+    flushDone.wait(held, [&] { return durableSequence >= target || flushFailed; });
+    if (durableSequence < target) {
+        std::cerr << "Error: Cannot write journal " << journalName << ".\n";
+        return false;
+    }
+    if (journalBytes >= CHECKPOINT_BYTES) startCheckpoint(held);
+    return true;
+}
+
+//  Writes whatever has been appended since the last round with a single write and fsync.
+//  Appends that arrive during the fsync wait for the next round and share it. After a failed round
+//  nothing more is written: records past a torn one would never be replayed.
+inline void Journal::flushLoop() {
+    std::unique_lock<std::mutex> held(lock);
+    std::string writing;
+    while (true) {
+        flushWanted.wait(held, [&] { return stopping || (!flushFailed && durableSequence < lastSequence); });
+        if (flushFailed || durableSequence >= lastSequence) {
+            if (stopping) return;
+            continue;
+        }
+        writing.swap(buffer);
+        const std::uint64_t sequence = lastSequence;
+        std::FILE* target = file;
+        flushing = true;
+        held.unlock();
+
+        bool written = std::fwrite(writing.data(), 1, writing.size(), target) == writing.size() &&
+                       std::fflush(target) == 0;
+#ifdef CITIES_POSIX_IO
+        written = written && fsync(fileno(target)) == 0;
+#endif
+
+        held.lock();
+        flushing = false;
+        if (written) {
+            journalBytes += writing.size();
+            durableSequence = sequence;
+        } else {
+            flushFailed = true;
+        }
+        writing.clear();
+        flushDone.notify_all();
+    }
+}
+
+inline void Journal::checkpoint() {
+    if (file == nullptr) return;
+    commit();
+    std::unique_lock<std::mutex> held(lock);
+    startCheckpoint(held);
+}
+
+//  Called with lock held. The journal is rotated while no change can be logged, so the snapshot file
+//  and the rotated journal hold exactly the records up to lastSequence, and the new snapshot is built
+//  from those two files alone.
+inline void Journal::startCheckpoint(std::unique_lock<std::mutex>& held) {
+    if (flushFailed || checkpointRunning.exchange(true)) return;
+    if (checkpointer.joinable()) checkpointer.join();
+    if (std::FILE* probe = std::fopen(rotatedName.c_str(), "rb")) {
+        //  The previous checkpoint left its journal behind, it must be replayed before it is replaced
+        std::fclose(probe);
+        checkpointRunning = false;
+        return;
+    }
+
+    //  The flusher may be writing the current file, and records logged since the last commit must
+    //  land in the journal the old snapshot pairs with
+    flushDone.wait(held, [&] { return !flushing; });
+    if (!flushFailed && !buffer.empty()) {
+        bool written = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size() && std::fflush(file) == 0;
+#ifdef CITIES_POSIX_IO
+        written = written && fsync(fileno(file)) == 0;
+#endif
+        if (written) {
+            buffer.clear();
+            durableSequence = lastSequence;
+        } else {
+            flushFailed = true;
+        }
+        flushDone.notify_all();
+    }
+    if (flushFailed) {
+        checkpointRunning = false;
+        return;
+    }
+
+    //  Records before this point stay in the rotated journal until the snapshot is durable
+    std::fclose(file);
+    if (std::rename(journalName.c_str(), rotatedName.c_str()) != 0) {
+        file = std::fopen(journalName.c_str(), "ab");
+        checkpointRunning = false;
+        return;
+    }
+    file = std::fopen(journalName.c_str(), "ab");
+    if (file == nullptr) {
+        flushFailed = true;
+        checkpointRunning = false;
+        return;
+    }
+    journalBytes = 0;
+
+    const std::uint64_t sequence = lastSequence;
+    checkpointer = std::thread([this, sequence] {
+        const std::string temporary = snapshotName + ".tmp";
+        CityTable rebuilt;
+        if (rebuild(snapshotName, rotatedName, sequence, rebuilt) &&
+            FileManager::saveSnapshot(rebuilt, temporary, sequence) && FileManager::replaceFile(temporary, snapshotName)) {
+            std::remove(rotatedName.c_str());
+        } else {
+            std::cerr << "Error: Checkpoint of " << snapshotName << " failed, the journal is kept.\n";
+        }
+        checkpointRunning = false;
+    });
+}
+
+//  Loads snapshotFile into cities like loadData, empty if there is none, and replays journalFile on
+//  top. False unless the result is valid and contains exactly the records up to sequence.
+inline bool Journal::rebuild(const std::string& snapshotFile, const std::string& journalFile,
+                             const std::uint64_t sequence, CityTable& cities) {
+    {
+        auto mapped = std::make_shared<MappedFile>();
+        if (mapped->open(snapshotFile)) {
+            const std::string_view text = mapped->text();
+            if (!FileManager::isSnapshot(text)) {
+                FileManager::parseRecords(text, cities);
+            } else if (!FileManager::loadSnapshot(text, cities, mapped)) {
+                return false;
+            }
+        }
+    }
+    std::uint64_t last = FileManager::snapshotJournalSequence(snapshotFile);
+    replay(journalFile, cities, last, last);
+    return last == sequence;
+}
+
+//  Applies the records of fileName with a sequence above after, stopping at the first damaged or
+//  inconsistent record, usually the torn tail of a crash. last is raised to the highest sequence seen.
+//  True if any record was applied.
+inline bool Journal::replay(const std::string& fileName, CityTable& cities, const std::uint64_t after,
+                           std::uint64_t& last) {
+    MappedFile mapped;
+    if (!mapped.open(fileName)) return false;
+    std::string_view text = mapped.text();
+    bool applied = false;
+
+    auto take = [&](void* out, const std::size_t size, std::string_view& from) {
+        if (from.size() < size) return false;
+        std::memcpy(out, from.data(), size);
+        from.remove_prefix(size);
+        return true;
+    };
+    auto takeString = [&](std::string_view& out, std::string_view& from) {
+        std::uint32_t length;
+        if (!take(&length, sizeof(length), from) || from.size() < length) return false;
+        out = from.substr(0, length);
+        from.remove_prefix(length);
+        return true;
+    };
+
+    while (!text.empty()) {
+        std::uint32_t length, checksum;
+        std::string_view header = text;
+        if (!take(&length, sizeof(length), header) || !take(&checksum, sizeof(checksum), header) ||
+            header.size() < length || crc32(header.data(), length) != checksum) {
+            break;
+        }
+        std::string_view payload = header.substr(0, length);
+        text = header.substr(length);
+
+        std::uint64_t sequence;
+        RecordType type;
+        RowId row;
+        if (!take(&sequence, sizeof(sequence), payload) || !take(&type, sizeof(type), payload) ||
+            !take(&row, sizeof(row), payload)) {
+            break;
+        }
+        last = std::max(last, sequence);
+        if (sequence <= after) continue;
+
+        bool valid = false;
+        if (type == ADD) {
+            std::int32_t population, recordYear;
+            double latitude, longitude;
+            std::string_view fields[5];
+            valid = row == cities.size() && take(&population, sizeof(population), payload) &&
+                    take(&recordYear, sizeof(recordYear), payload) && take(&latitude, sizeof(latitude), payload) &&
+                    take(&longitude, sizeof(longitude), payload);
+            for (auto& field : fields) valid = valid && takeString(field, payload);
+            if (valid) {
+                cities.add(fields[0], fields[1], population, recordYear, latitude, longitude, fields[2], fields[3],
+                           fields[4]);
+            }
+        } else if (row < cities.size()) {
+            std::string_view field;
+            if (type == ERASE) {
+                valid = true;
+                cities.erase(row);
+            } else if (type == UPDATE_TEXT) {
+                std::string_view value;
+                valid = takeString(field, payload) && takeString(value, payload);
+                if (valid) cities.update(row, std::string(field), std::string(value));
+            } else if (type == UPDATE_INT) {
+                std::int32_t value;
+                valid = takeString(field, payload) && take(&value, sizeof(value), payload);
+                if (valid) cities.update(row, std::string(field), static_cast<int>(value));
+            } else if (type == UPDATE_DOUBLE) {
+                double value;
+                valid = takeString(field, payload) && take(&value, sizeof(value), payload);
+                if (valid) cities.update(row, std::string(field), value);
+            }
+        }
+        if (!valid) {
+            std::cerr << "Error: Journal " << fileName << " has an invalid record, replay stopped.\n";
+            break;
+        }
+        applied = true;
+    }
+    return applied;
+}
+
+inline std::uint32_t Journal::crc32(const char* data, const std::size_t size) {
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> entries{};
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int bit = 0; bit < 8; ++bit) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
+        }
+        return entries;
+    }();
+    std::uint32_t c = 0xFFFFFFFFu;
+    for (std::size_t i = 0; i < size; ++i) c = table[(c ^ static_cast<std::uint8_t>(data[i])) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+//  Writes the full N x N great circle distance matrix of all live cities to a binary file.
+//  File Format (native byte order, every block starts on a 64 byte boundary so the file can be mapped):
+//  header   char magic[4] "CWDM", uint32 version, uint32 element size (4 or 8), uint32 reserved,
+//           uint64 city count N, uint64 offset of the row id block, uint64 offset of the matrix
+//  row ids  N x uint32, the CityTable row of each matrix index
+//  matrix   N x N float32 or float64 distances in km, row major
+//  Only the upper triangle is computed, in square tiles shared out over all cores, and each tile is
+//  written to both of its mirrored positions as soon as it is done, so memory use stays at one tile
+//  per thread however large N gets. Like FileManager::saveData the matrix goes to fileName.tmp, is
+//  synced and then renamed over fileName, so a crash never leaves a partly written matrix behind.
+class DistanceMatrix {
+public:
+    enum class Precision { Float32, Float64 };
+
+    static constexpr char MAGIC[4] = {'C', 'W', 'D', 'M'};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::size_t TILE = 128;    //  128 x 128 doubles is 128 KB, sized for L2
+
+    struct Header {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t elementSize;
+        std::uint32_t reserved;
+        std::uint64_t count;
+        std::uint64_t rowIdOffset;
+        std::uint64_t matrixOffset;
+    };
+
+    //  Returns false and reports to std::cerr when the file cannot be written
+    static bool write(const CityTable& cities, const std::string& fileName, const Precision precision) {
+        return precision == Precision::Float32 ? write<float>(cities, fileName)
+                                               : write<double>(cities, fileName);
+    }
+
+private:
+    static std::uint64_t align(const std::uint64_t offset) { return (offset + 63) & ~std::uint64_t{63}; }
+
+    template <typename T>
+    static bool write(const CityTable& cities, const std::string& fileName) {
+        //  Gather the live rows' unit vectors into dense arrays so matrix indices have no gaps
+        std::vector<RowId> rows;
+        rows.reserve(cities.liveCount());
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (cities.alive(row)) rows.push_back(row);
+        }
+        const std::size_t n = rows.size();
+        std::vector<double> xs(n), ys(n), zs(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            xs[i] = cities.xs()[rows[i]];
+            ys[i] = cities.ys()[rows[i]];
+            zs[i] = cities.zs()[rows[i]];
+        }
+
+        Header header{};
+        std::copy(std::begin(MAGIC), std::end(MAGIC), header.magic);
+        header.version = VERSION;
+        header.elementSize = sizeof(T);
+        header.count = n;
+        header.rowIdOffset = align(sizeof(Header));
+        header.matrixOffset = align(header.rowIdOffset + n * sizeof(RowId));
+        const std::uint64_t fileSize = header.matrixOffset + std::uint64_t{n} * n * sizeof(T);
+
+        const std::string temporary = fileName + ".tmp";
+        {
+            //  Create the file at its final size, workers then fill it in place
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                std::cerr << "Error: Cannot open file.\n";
+                return false;
+            }
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.seekp(static_cast<std::streamoff>(header.rowIdOffset));
+            file.write(reinterpret_cast<const char*>(rows.data()), static_cast<std::streamsize>(n * sizeof(RowId)));
+            if (fileSize > header.rowIdOffset + n * sizeof(RowId)) {
+                file.seekp(static_cast<std::streamoff>(fileSize - 1));
+                file.put('\0');
+            }
+            file.close();
+            if (!file) {
+                std::cerr << "Error: Cannot write file.\n";
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+
+        const std::size_t tilesPerSide = (n + TILE - 1) / TILE;
+        const std::size_t tileCount = tilesPerSide * (tilesPerSide + 1) / 2;
+        std::atomic<std::size_t> nextTile{0};
+        std::atomic<bool> failed{false};
+
+        auto worker = [&] {
+            std::fstream file(temporary, std::ios::binary | std::ios::in | std::ios::out);
+            if (!file.is_open()) {
+                failed = true;
+                return;
+            }
+            std::vector<T> tile(TILE * TILE), mirrored(TILE * TILE);
+            for (std::size_t t = nextTile++; t < tileCount && !failed; t = nextTile++) {
+                //  Tile number t -> (ti, tj) with ti <= tj, walking the upper triangle row by row
+                std::size_t ti = 0, rowTiles = tilesPerSide;
+                std::size_t rest = t;
+                while (rest >= rowTiles) {
+                    rest -= rowTiles--;
+                    ++ti;
+                }
+                const std::size_t tj = ti + rest;
+                const std::size_t i0 = ti * TILE, i1 = std::min(n, i0 + TILE);
+                const std::size_t j0 = tj * TILE, j1 = std::min(n, j0 + TILE);
+                const std::size_t width = j1 - j0, height = i1 - i0;
+
+                for (std::size_t i = i0; i < i1; ++i) {
+                    T* out = tile.data() + (i - i0) * width;
+                    for (std::size_t j = j0; j < j1; ++j) {
+                        //  Chord from the vector difference, exact zero on the diagonal
+                        const double dx = xs[i] - xs[j], dy = ys[i] - ys[j], dz = zs[i] - zs[j];
+                        out[j - j0] = static_cast<T>(
+                            DistanceCalculator::distanceForChordSquared(dx * dx + dy * dy + dz * dz));
+                    }
+                }
+                writeTile(file, header.matrixOffset, n, i0, j0, height, width, tile.data());
+
+                if (ti != tj) {
+                    for (std::size_t r = 0; r < height; ++r) {
+                        for (std::size_t c = 0; c < width; ++c) mirrored[c * height + r] = tile[r * width + c];
+                    }
+                    writeTile(file, header.matrixOffset, n, j0, i0, width, height, mirrored.data());
+                }
+                if (!file) failed = true;
+            }
+            file.close();
+            if (!file) failed = true;
+        };
+
+        const std::size_t threadCount =
+            std::max<std::size_t>(1, std::min<std::size_t>(std::thread::hardware_concurrency(), tileCount));
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < threadCount; ++i) threads.emplace_back(worker);
+        worker();
+        for (auto& thread : threads) thread.join();
+
+        if (failed || !FileManager::syncFile(temporary)) {
+            std::cerr << "Error: Cannot write file.\n";
+            std::remove(temporary.c_str());
+            return false;
+        }
+        if (!FileManager::replaceFile(temporary, fileName)) {
+            std::cerr << "Error: Cannot replace " << fileName << ".\n";
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    //  One seek and write per tile row, rows of a tile are contiguous runs of the file
+    template <typename T>
+    static void writeTile(std::fstream& file, const std::uint64_t matrixOffset, const std::size_t n,
+                          const std::size_t row0, const std::size_t col0, const std::size_t height,
+                          const std::size_t width, const T* values) {
+        for (std::size_t r = 0; r < height; ++r) {
+            file.seekp(static_cast<std::streamoff>(matrixOffset + ((row0 + r) * n + col0) * sizeof(T)));
+            file.write(reinterpret_cast<const char*>(values + r * width),
+                       static_cast<std::streamsize>(width * sizeof(T)));
+        }
+    }
+};
+
+//  Aggregate functions over the numeric fields, shared by StreamQuery and GroupBy
+enum class AggregateKind { Count, Sum, Min, Max, Avg };
+
+inline constexpr std::string_view AGGREGATE_NAMES[] = {"count", "sum", "min", "max", "avg"};
+
+struct Aggregate {
+    AggregateKind kind;
+    CityField field;    //  Unused by Count
+};
+
+//  Running totals of one group, one slot per aggregate
+struct AggregateTotals {
+    std::uint64_t count = 0;
+    std::vector<double> values;
+
+    explicit AggregateTotals(const std::vector<Aggregate>& aggregates = {}) {
+        for (const Aggregate& aggregate : aggregates) {
+            values.push_back(aggregate.kind == AggregateKind::Min ? std::numeric_limits<double>::infinity()
+                           : aggregate.kind == AggregateKind::Max ? -std::numeric_limits<double>::infinity()
+                           : 0.0);
+        }
+    }
+
+    //  Adds one row, value(field) reads its numeric fields
+    template <typename ValueOf>
+    void add(const std::vector<Aggregate>& aggregates, ValueOf&& value) {
+        ++count;
+        for (std::size_t i = 0; i < aggregates.size(); ++i) {
+            switch (aggregates[i].kind) {
+                case AggregateKind::Sum:
+                case AggregateKind::Avg: values[i] += value(aggregates[i].field); break;
+                case AggregateKind::Min: values[i] = std::min(values[i], double(value(aggregates[i].field))); break;
+                case AggregateKind::Max: values[i] = std::max(values[i], double(value(aggregates[i].field))); break;
+                default: break;
+            }
+        }
+    }
+
+    void merge(const std::vector<Aggregate>& aggregates, const AggregateTotals& other) {
+        count += other.count;
+        for (std::size_t i = 0; i < aggregates.size(); ++i) {
+            switch (aggregates[i].kind) {
+                case AggregateKind::Min: values[i] = std::min(values[i], other.values[i]); break;
+                case AggregateKind::Max: values[i] = std::max(values[i], other.values[i]); break;
+                default: values[i] += other.values[i]; break;
+            }
+        }
+    }
+
+    //  Appends the column names, count,sum(population),...
+    static void appendHeader(std::string& out, const std::vector<Aggregate>& aggregates) {
+        for (std::size_t i = 0; i < aggregates.size(); ++i) {
+            if (i > 0) out.push_back(',');
+            out.append(AGGREGATE_NAMES[static_cast<int>(aggregates[i].kind)]);
+            if (aggregates[i].kind != AggregateKind::Count) {
+                out.append("(").append(fieldName(aggregates[i].field)).append(")");
+            }
+        }
+    }
+
+    //  Appends the values comma separated, an empty group leaves everything but its count blank
+    void appendValues(std::string& out, const std::vector<Aggregate>& aggregates) const {
+        for (std::size_t i = 0; i < aggregates.size(); ++i) {
+            if (i > 0) out.push_back(',');
+            if (aggregates[i].kind == AggregateKind::Count) {
+                appendNumber(out, count);
+            } else if (count == 0) {
+                continue;
+            } else if (aggregates[i].kind == AggregateKind::Avg) {
+                appendNumber(out, values[i] / double(count));
+            } else {
+                appendNumber(out, values[i]);
+            }
+        }
+    }
+
+    //  Parses count, or sum, min, max or avg of a numeric field written as sum(population)
+    static bool parse(const std::string_view text, Aggregate& aggregate) {
+        if (text == "count") {
+            aggregate = {AggregateKind::Count, CityField::Population};
+            return true;
+        }
+        const std::size_t open = text.find('(');
+        if (open == std::string_view::npos || text.back() != ')') return false;
+        const std::string_view name = text.substr(0, open);
+        for (int kind = 1; kind < 5; ++kind) {
+            if (AGGREGATE_NAMES[kind] != name) continue;
+            aggregate.kind = static_cast<AggregateKind>(kind);
+            return parseCityField(text.substr(open + 1, text.size() - open - 2), aggregate.field) &&
+                   isNumericField(aggregate.field);
+        }
+        return false;
+    }
+
+    template <typename T>
+    static void appendNumber(std::string& out, const T value) {
+        char digits[32];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        out.append(digits, static_cast<std::size_t>(result.ptr - digits));
+    }
+};
+
+//  Streaming queries over a city text file, run straight from the command line:
+//      cities_world --stream FILE [--where CONDITION]... [--count] [--sum|--min|--max|--avg FIELD]... [--by FIELD]
+//  FILE may be - for standard input. A CONDITION is FIELD OP VALUE with OP one of = != < <= > >=,
+//  for example "recordYear<1950", and all of them must hold. Without aggregates the matching lines are
+//  printed unchanged, with them one CSV row is printed per --by group (or one row overall).
+//  The file is read through a fixed size buffer and each line is tokenized in place, no City or table
+//  row is ever built, so memory stays constant apart from one accumulator per group.
+class StreamQuery {
+public:
+    static int run(const std::vector<std::string_view>& args) {
+        StreamQuery query;
+        if (!query.parse(args)) {
+            std::cerr << "Usage: cities_world --stream FILE [--where CONDITION]... [--count] "
+                         "[--sum|--min|--max|--avg FIELD]... [--by FIELD]\n";
+            return 2;
+        }
+        return query.execute() ? 0 : 1;
+    }
+
+private:
+    enum class Op { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+    struct Condition {
+        CityField field;
+        Op op;
+        double number = 0.0;
+        std::string text;
+
+        bool matches(const FileManager::Record& record) const {
+            if (isNumericField(field)) return compare(record.number(field), number);
+            return compare(record.text(field), std::string_view(text));
+        }
+
+        template <typename T>
+        bool compare(const T& left, const T& right) const {
+            switch (op) {
+                case Op::Equal: return left == right;
+                case Op::NotEqual: return left != right;
+                case Op::Less: return left < right;
+                case Op::LessEqual: return left <= right;
+                case Op::Greater: return left > right;
+                default: return left >= right;
+            }
+        }
+    };
+
+    static constexpr std::size_t CHUNK_BYTES = 1 << 20;
+
+    std::string fileName;
+    std::vector<Condition> conditions;
+    std::vector<Aggregate> aggregates;
+    bool grouped = false;
+    CityField groupField = CityField::Country;
+
+    std::unordered_map<std::string, AggregateTotals, StringHash, std::equal_to<>> groups;
+    std::string output;
+
+    bool parse(const std::vector<std::string_view>& args) {
+        if (args.empty()) return false;
+        fileName = args[0];
+        for (std::size_t i = 1; i < args.size(); ++i) {
+            const std::string_view option = args[i];
+            if (option == "--count") {
+                aggregates.push_back({AggregateKind::Count, CityField::Population});
+                continue;
+            }
+            if (i + 1 == args.size()) return false;
+            const std::string_view value = args[++i];
+            CityField field;
+            if (option == "--where") {
+                Condition condition;
+                if (!parseCondition(value, condition)) {
+                    std::cerr << "Invalid condition '" << value << "'.\n";
+                    return false;
+                }
+                conditions.push_back(std::move(condition));
+            } else if (option == "--by") {
+                if (!parseCityField(value, groupField)) return false;
+                grouped = true;
+            } else if (option == "--sum" || option == "--min" || option == "--max" || option == "--avg") {
+                if (!parseCityField(value, field) || !isNumericField(field)) {
+                    std::cerr << "'" << value << "' is not a numeric field.\n";
+                    return false;
+                }
+                const AggregateKind kind = option == "--sum" ? AggregateKind::Sum
+                                         : option == "--min" ? AggregateKind::Min
+                                         : option == "--max" ? AggregateKind::Max : AggregateKind::Avg;
+                aggregates.push_back({kind, field});
+            } else {
+                return false;
+            }
+        }
+        return !grouped || !aggregates.empty();
+    }
+
+    static bool parseCondition(std::string_view text, Condition& condition) {
+        const std::size_t at = text.find_first_of("=!<>");
+        if (at == std::string_view::npos) return false;
+        std::size_t after = at + 1;
+        if (after < text.size() && text[after] == '=') ++after;
+        const std::string_view op = text.substr(at, after - at);
+        if (op == "=" || op == "==") condition.op = Op::Equal;
+        else if (op == "!=") condition.op = Op::NotEqual;
+        else if (op == "<") condition.op = Op::Less;
+        else if (op == "<=") condition.op = Op::LessEqual;
+        else if (op == ">") condition.op = Op::Greater;
+        else if (op == ">=") condition.op = Op::GreaterEqual;
+        else return false;
+
+        if (!parseCityField(trim(text.substr(0, at)), condition.field)) return false;
+        std::string_view value = trim(text.substr(after));
+        if (isNumericField(condition.field)) {
+            const auto result = std::from_chars(value.data(), value.data() + value.size(), condition.number);
+            return result.ec == std::errc() && result.ptr == value.data() + value.size();
+        }
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') value = value.substr(1, value.size() - 2);
+        condition.text = value;
+        return true;
+    }
+
+    static std::string_view trim(std::string_view text) {
+        while (!text.empty() && text.front() == ' ') text.remove_prefix(1);
+        while (!text.empty() && text.back() == ' ') text.remove_suffix(1);
+        return text;
+    }
+
+    bool execute() {
+        std::FILE* in = fileName == "-" ? stdin : std::fopen(fileName.c_str(), "rb");
+        if (in == nullptr) {
+            std::cerr << "Error: Cannot open file " << fileName << ".\n";
+            return false;
+        }
+
+        //  Complete lines are consumed from the buffer, a partial last line moves to the front
+        std::vector<char> buffer(CHUNK_BYTES);
+        std::size_t filled = 0;
+        while (true) {
+            const std::size_t read = std::fread(buffer.data() + filled, 1, buffer.size() - filled, in);
+            filled += read;
+            const std::string_view text(buffer.data(), filled);
+            std::size_t consumed = 0;
+            for (std::size_t end; (end = text.find('\n', consumed)) != std::string_view::npos; consumed = end + 1) {
+                process(text.substr(consumed, end - consumed));
+            }
+            if (read == 0) {
+                if (consumed < filled) process(text.substr(consumed));
+                break;
+            }
+            std::memmove(buffer.data(), buffer.data() + consumed, filled - consumed);
+            filled -= consumed;
+            if (filled == buffer.size()) buffer.resize(buffer.size() * 2);    //  A line longer than the buffer
+        }
+        const bool failed = std::ferror(in) != 0;
+        if (in != stdin) std::fclose(in);
+        if (failed) {
+            std::cerr << "Error: Cannot read file " << fileName << ".\n";
+            return false;
+        }
+
+        if (!aggregates.empty()) printGroups();
+        std::fwrite(output.data(), 1, output.size(), stdout);
+        std::fflush(stdout);
+        return true;
+    }
+
+    void process(std::string_view line) {
+        FileManager::Record record;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (!FileManager::parseRecord(line, record)) return;
+        for (const Condition& condition : conditions) {
+            if (!condition.matches(record)) return;
+        }
+
+        if (aggregates.empty()) {
+            output.append(line).push_back('\n');
+            if (output.size() >= CHUNK_BYTES) {
+                std::fwrite(output.data(), 1, output.size(), stdout);
+                output.clear();
+            }
+            return;
+        }
+
+        std::string_view key;
+        char digits[32];
+        if (grouped && isNumericField(groupField)) {
+            const auto result = std::to_chars(digits, digits + sizeof(digits), record.number(groupField));
+            key = std::string_view(digits, static_cast<std::size_t>(result.ptr - digits));
+        } else if (grouped) {
+            key = record.text(groupField);
+        }
+        auto it = groups.find(key);
+        if (it == groups.end()) it = groups.emplace(std::string(key), AggregateTotals(aggregates)).first;
+        it->second.add(aggregates, [&](const CityField field) { return record.number(field); });
+    }
+
+    void printGroups() {
+        if (grouped) output.append(fieldName(groupField)).push_back(',');
+        AggregateTotals::appendHeader(output, aggregates);
+        output.push_back('\n');
+
+        //  An ungrouped query over no rows still reports its count of 0
+        if (!grouped && groups.empty()) groups.emplace("", AggregateTotals(aggregates));
+
+        std::vector<const std::pair<const std::string, AggregateTotals>*> sorted;
+        for (const auto& entry : groups) sorted.push_back(&entry);
+        std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+        for (const auto* entry : sorted) {
+            if (grouped) output.append(entry->first).push_back(',');
+            entry->second.appendValues(output, aggregates);
+            output.push_back('\n');
+        }
+    }
+};
+
+//  Hash group-by over the loaded table. The rows are split into chunks aggregated on all hardware
+//  threads, each chunk into its own hash tables, one per partition of the key hash. The partitions
+//  are then merged in parallel, partition p of every chunk into one table, so no table is shared
+//  between threads and no key is merged twice.
+class GroupBy {
+public:
+    //  One output row, keys of numeric fields are printed numbers
+    struct Group {
+        std::string key;
+        AggregateTotals totals;
+    };
+
+    //  Groups of the live rows by field, ordered by key, computed on up to threads threads
+    static std::vector<Group> run(const CityTable& cities, const CityField by, const std::vector<Aggregate>& aggregates,
+                                  const std::size_t threads = std::thread::hardware_concurrency()) {
+        switch (by) {
+            case CityField::Population: return aggregate(cities, cities.populations(), aggregates, threads);
+            case CityField::RecordYear: return aggregate(cities, cities.recordYears(), aggregates, threads);
+            case CityField::Latitude: return aggregate(cities, cities.latitudes(), aggregates, threads);
+            case CityField::Longitude: return aggregate(cities, cities.longitudes(), aggregates, threads);
+            default: return aggregate(cities, cities.texts(by), aggregates, threads);
+        }
+    }
+
+    //  Header line and one comma separated line per group
+    static void print(const CityField by, const std::vector<Aggregate>& aggregates, const std::vector<Group>& groups) {
+        std::string output;
+        write(by, aggregates, groups, output);
+        std::cout << output;
+    }
+
+    //  Same lines as print, appended to out
+    static void write(const CityField by, const std::vector<Aggregate>& aggregates, const std::vector<Group>& groups,
+                      std::string& out) {
+        out.append(fieldName(by)).push_back(',');
+        AggregateTotals::appendHeader(out, aggregates);
+        out.push_back('\n');
+        for (const Group& group : groups) {
+            out.append(group.key).push_back(',');
+            group.totals.appendValues(out, aggregates);
+            out.push_back('\n');
+        }
+    }
+
+private:
+    static constexpr std::size_t PARTITIONS = 16;
+    static constexpr std::size_t CHUNK_ROWS = 1 << 16;
+
+    template <typename Column>
+    static std::vector<Group> aggregate(const CityTable& cities, const Column& keys,
+                                        const std::vector<Aggregate>& aggregates, const std::size_t threads) {
+        using Key = std::decay_t<decltype(keys[0])>;
+        using Table = std::unordered_map<Key, AggregateTotals>;
+
+        auto value = [&](const RowId row) {
+            return [&cities, row](const CityField field) -> double {
+                switch (field) {
+                    case CityField::Population: return cities.population(row);
+                    case CityField::RecordYear: return cities.recordYear(row);
+                    case CityField::Latitude: return cities.latitude(row);
+                    default: return cities.longitude(row);
+                }
+            };
+        };
+        auto partition = [](const Key& key) {
+            return (std::hash<Key>{}(key) * 0x9E3779B97F4A7C15ull) >> 60;   //  Top bits, PARTITIONS is 16
+        };
+
+        //  Chunks aggregate their rows into PARTITIONS tables each
+        const std::size_t rows = cities.size();
+        const std::size_t chunks = std::max<std::size_t>(1, (rows + CHUNK_ROWS - 1) / CHUNK_ROWS);
+        std::vector<std::array<Table, PARTITIONS>> local(chunks);
+        parallelFor(chunks, [&](const std::size_t chunk) {
+            auto& tables = local[chunk];
+            const std::size_t end = std::min(rows, (chunk + 1) * CHUNK_ROWS);
+            for (RowId row = static_cast<RowId>(chunk * CHUNK_ROWS); row < end; ++row) {
+                if (!cities.alive(row)) continue;
+                const Key key = keys[row];
+                Table& table = tables[partition(key)];
+                auto it = table.find(key);
+                if (it == table.end()) it = table.emplace(key, AggregateTotals(aggregates)).first;
+                it->second.add(aggregates, value(row));
+            }
+        }, threads);
+
+        //  Each partition is merged across chunks by one thread
+        std::array<Table, PARTITIONS> merged;
+        parallelFor(PARTITIONS, [&](const std::size_t p) {
+            Table& table = merged[p];
+            for (auto& tables : local) {
+                for (auto& [key, totals] : tables[p]) {
+                    const auto it = table.find(key);
+                    if (it == table.end()) table.emplace(key, std::move(totals));
+                    else it->second.merge(aggregates, totals);
+                }
+                Table().swap(tables[p]);
+            }
+        }, threads);
+
+        std::vector<std::pair<Key, AggregateTotals>> sorted;
+        for (auto& table : merged) {
+            for (auto& entry : table) sorted.emplace_back(entry.first, std::move(entry.second));
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        std::vector<Group> groups;
+        groups.reserve(sorted.size());
+        for (auto& [key, totals] : sorted) {
+            std::string text;
+            if constexpr (std::is_same_v<Key, std::string_view>) text = key;
+            else AggregateTotals::appendNumber(text, key);
+            groups.push_back({std::move(text), std::move(totals)});
+        }
+        return groups;
+    }
+};
+
+//  Query over the loaded table for the display command:
+//      [FIELD,...|*] [where CONDITION {and|or CONDITION}...] [order by FIELD [asc|desc]] [limit N]
+//  for example: name,population where country = "France" and population > 1000000 order by population desc limit 20
+//  A CONDITION is FIELD OP VALUE with OP one of = != < <= > >=, text values may be quoted, and and
+//  binds tighter than or. Keywords are case insensitive. The text is parsed once into typed conditions,
+//  then each condition runs as one loop over its column narrowing a list of rows, so nothing is
+//  evaluated per row by field name. A selective range on a numeric field starts from the table's
+//  sorted index instead of every row, and an unfiltered order by a numeric field with a limit reads
+//  its top rows from the index.
+class DisplayQuery {
+public:
+    //  False with a message on std::cerr if text is not a valid query
+    bool parse(const std::string_view text) {
+        std::vector<std::string> tokens;
+        if (!tokenize(text, tokens)) {
+            std::cerr << "Unterminated quote in query.\n";
+            return false;
+        }
+
+        std::size_t i = 0;
+        auto keyword = [&](const std::string_view word) {
+            if (i < tokens.size() && foldCase(tokens[i]) == word) {
+                ++i;
+                return true;
+            }
+            return false;
+        };
+        auto field = [&](CityField& parsed) {
+            if (i < tokens.size() && parseCityField(tokens[i], parsed)) {
+                ++i;
+                return true;
+            }
+            std::cerr << "Expected a field name" << (i < tokens.size() ? " at '" + tokens[i] + "'" : "") << ".\n";
+            return false;
+        };
+
+        //  Projection, every field when it is missing or *
+        if (i < tokens.size() && tokens[i] == "*") {
+            ++i;
+        } else if (i < tokens.size() && foldCase(tokens[i]) != "where" && foldCase(tokens[i]) != "order" &&
+                   foldCase(tokens[i]) != "limit") {
+            do {
+                CityField column;
+                if (!field(column)) return false;
+                columns.push_back(column);
+            } while (i < tokens.size() && tokens[i] == "," && ++i);
+        }
+        if (columns.empty()) {
+            for (int f = 0; f < 9; ++f) columns.push_back(static_cast<CityField>(f));
+        }
+
+        if (keyword("where")) {
+            do {
+                groups.emplace_back();
+                do {
+                    Condition condition;
+                    if (!field(condition.field)) return false;
+                    if (i == tokens.size() || !parseOp(tokens[i], condition.op)) {
+                        std::cerr << "Expected a comparison after " << fieldName(condition.field) << ".\n";
+                        return false;
+                    }
+                    if (++i == tokens.size()) {
+                        std::cerr << "Expected a value after the comparison.\n";
+                        return false;
+                    }
+                    const std::string& value = tokens[i++];
+                    if (isNumericField(condition.field)) {
+                        const auto result = std::from_chars(value.data(), value.data() + value.size(), condition.number);
+                        if (result.ec != std::errc() || result.ptr != value.data() + value.size()) {
+                            std::cerr << "'" << value << "' is not a number.\n";
+                            return false;
+                        }
+                    } else {
+                        condition.text = unquote(value);
+                    }
+                    groups.back().push_back(std::move(condition));
+                } while (keyword("and"));
+            } while (keyword("or"));
+        }
+
+        if (keyword("order")) {
+            if (!keyword("by")) {
+                std::cerr << "Expected 'by' after 'order'.\n";
+                return false;
+            }
+            if (!field(orderField)) return false;
+            ordered = true;
+            if (keyword("desc")) descending = true;
+            else keyword("asc");
+        }
+
+        if (keyword("limit")) {
+            const std::string_view value = i < tokens.size() ? std::string_view(tokens[i++]) : std::string_view();
+            const auto result = std::from_chars(value.data(), value.data() + value.size(), limit);
+            if (value.empty() || result.ec != std::errc() || result.ptr != value.data() + value.size()) {
+                std::cerr << "The limit must be a non negative number.\n";
+                return false;
+            }
+        }
+
+        if (i != tokens.size()) {
+            std::cerr << "Unexpected '" << tokens[i] << "' in query.\n";
+            return false;
+        }
+        return true;
+    }
+
+    //  Live rows selected by the query in output order
+    std::vector<RowId> run(const CityTable& cities) const {
+        //  Nothing filtered and ordered by a numeric field: the top rows come straight from its index
+        if (groups.empty() && ordered && isNumericField(orderField) && limit < cities.liveCount()) {
+            return cities.topRows(orderField, limit, descending);
+        }
+
+        std::vector<RowId> all;
+        auto allRows = [&]() -> const std::vector<RowId>& {
+            if (all.empty()) {
+                all.reserve(cities.liveCount());
+                for (RowId row = 0; row < cities.size(); ++row) {
+                    if (cities.alive(row)) all.push_back(row);
+                }
+            }
+            return all;
+        };
+
+        std::vector<RowId> rows;
+        if (groups.empty()) {
+            rows = allRows();
+        } else {
+            for (const auto& group : groups) {
+                //  The range each numeric field is held to, then start from the most selective one when
+                //  it is small enough to beat a scan
+                std::vector<Range> ranges;
+                for (const Condition& condition : group) {
+                    if (!indexable(condition)) continue;
+                    auto range = std::find_if(ranges.begin(), ranges.end(),
+                                              [&](const Range& r) { return r.field == condition.field; });
+                    if (range == ranges.end()) range = ranges.insert(ranges.end(), Range{condition.field});
+                    range->narrow(condition);
+                }
+                const Range* start = nullptr;
+                std::size_t smallest = cities.liveCount() / 4;
+                for (const Range& range : ranges) {
+                    const std::size_t count = cities.countInRange(range.field, range.low, range.lowInclusive,
+                                                                  range.high, range.highInclusive);
+                    if (count <= smallest) {
+                        smallest = count;
+                        start = &range;
+                    }
+                }
+                std::vector<RowId> matched;
+                if (start != nullptr) {
+                    matched = cities.rowsInRange(start->field, start->low, start->lowInclusive, start->high,
+                                                 start->highInclusive);
+                    std::sort(matched.begin(), matched.end());
+                } else {
+                    matched = allRows();
+                }
+                for (const Condition& condition : group) {
+                    if (start == nullptr || condition.field != start->field || !indexable(condition)) {
+                        filter(cities, condition, matched);
+                    }
+                }
+                std::vector<RowId> merged;
+                std::set_union(rows.begin(), rows.end(), matched.begin(), matched.end(), std::back_inserter(merged));
+                rows = std::move(merged);
+            }
+        }
+
+        if (ordered) {
+            const std::size_t keep = std::min(limit, rows.size());
+            switch (orderField) {
+                case CityField::Population: sortBy(rows, keep, cities.populations()); break;
+                case CityField::RecordYear: sortBy(rows, keep, cities.recordYears()); break;
+                case CityField::Latitude: sortBy(rows, keep, cities.latitudes()); break;
+                case CityField::Longitude: sortBy(rows, keep, cities.longitudes()); break;
+                default: sortBy(rows, keep, cities.texts(orderField)); break;
+            }
+        }
+        if (rows.size() > limit) rows.resize(limit);
+        return rows;
+    }
+
+    //  A header line of field names, then one comma separated line per row
+    void print(const CityTable& cities, const std::vector<RowId>& rows) const {
+        std::string output;
+        write(cities, rows, output);
+        std::cout << output;
+    }
+
+    //  Same lines as print, appended to out
+    void write(const CityTable& cities, const std::vector<RowId>& rows, std::string& out) const {
+        for (std::size_t c = 0; c < columns.size(); ++c) {
+            if (c > 0) out += ',';
+            out += fieldName(columns[c]);
+        }
+        out += '\n';
+        for (const RowId row : rows) {
+            for (std::size_t c = 0; c < columns.size(); ++c) {
+                if (c > 0) out += ',';
+                switch (columns[c]) {
+                    case CityField::Population: out += std::to_string(cities.population(row)); break;
+                    case CityField::RecordYear: out += std::to_string(cities.recordYear(row)); break;
+                    case CityField::Latitude: appendNumber(out, cities.latitude(row)); break;
+                    case CityField::Longitude: appendNumber(out, cities.longitude(row)); break;
+                    default: out += cities.texts(columns[c])[row]; break;
+                }
+            }
+            out += '\n';
+        }
+    }
+
+private:
+    enum class Op { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+    struct Condition {
+        CityField field = CityField::Name;
+        Op op = Op::Equal;
+        double number = 0.0;
+        std::string text;
+    };
+
+    std::vector<CityField> columns;
+    std::vector<std::vector<Condition>> groups;     //  Or of groups, each an and of conditions
+    bool ordered = false;
+    bool descending = false;
+    CityField orderField = CityField::Name;
+    std::size_t limit = std::numeric_limits<std::size_t>::max();
+
+    //  Words, quoted strings and the punctuation , = != < <= > >=
+    static bool tokenize(const std::string_view text, std::vector<std::string>& tokens) {
+        for (std::size_t i = 0; i < text.size();) {
+            const char c = text[i];
+            if (c == ' ' || c == '\t') {
+                ++i;
+            } else if (c == '"') {
+                const std::size_t close = text.find('"', i + 1);
+                if (close == std::string_view::npos) return false;
+                tokens.emplace_back(text.substr(i, close - i + 1));
+                i = close + 1;
+            } else if (c == ',' || c == '*') {
+                tokens.emplace_back(1, c);
+                ++i;
+            } else if (c == '=' || c == '!' || c == '<' || c == '>') {
+                const std::size_t length = i + 1 < text.size() && text[i + 1] == '=' ? 2 : 1;
+                tokens.emplace_back(text.substr(i, length));
+                i += length;
+            } else {
+                std::size_t end = i;
+                while (end < text.size() && std::string_view(" \t\",=!<>").find(text[end]) == std::string_view::npos) {
+                    ++end;
+                }
+                tokens.emplace_back(text.substr(i, end - i));
+                i = end;
+            }
+        }
+        return true;
+    }
+
+    //  Conditions a sorted index can answer, ranges on numeric fields
+    static bool indexable(const Condition& condition) {
+        return isNumericField(condition.field) && condition.op != Op::NotEqual;
+    }
+
+    //  Values of one numeric field allowed by every indexable condition on it
+    struct Range {
+        CityField field;
+        double low = -std::numeric_limits<double>::infinity();
+        double high = std::numeric_limits<double>::infinity();
+        bool lowInclusive = true, highInclusive = true;
+
+        void narrow(const Condition& condition) {
+            const double value = condition.number;
+            const bool fromBelow = condition.op != Op::Less && condition.op != Op::LessEqual;
+            const bool fromAbove = condition.op != Op::Greater && condition.op != Op::GreaterEqual;
+            const bool inclusive = condition.op == Op::Equal || condition.op == Op::LessEqual ||
+                                   condition.op == Op::GreaterEqual;
+            if (fromBelow && (value > low || (value == low && !inclusive))) {
+                low = value;
+                lowInclusive = inclusive;
+            }
+            if (fromAbove && (value < high || (value == high && !inclusive))) {
+                high = value;
+                highInclusive = inclusive;
+            }
+        }
+    };
+
+    static bool parseOp(const std::string_view text, Op& op) {
+        if (text == "=" || text == "==") op = Op::Equal;
+        else if (text == "!=") op = Op::NotEqual;
+        else if (text == "<") op = Op::Less;
+        else if (text == "<=") op = Op::LessEqual;
+        else if (text == ">") op = Op::Greater;
+        else if (text == ">=") op = Op::GreaterEqual;
+        else return false;
+        return true;
+    }
+
+    static std::string unquote(const std::string& value) {
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') return value.substr(1, value.size() - 2);
+        return value;
+    }
+
+    static void appendNumber(std::string& line, const double value) {
+        char digits[32];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        line.append(digits, static_cast<std::size_t>(result.ptr - digits));
+    }
+
+    //  Keeps the rows whose value passes the condition, one loop per operator with the comparison inlined
+    template <typename Column, typename Value>
+    static void filterColumn(std::vector<RowId>& rows, const Column& column, const Value& value, const Op op) {
+        auto keep = [&](auto&& pass) {
+            std::size_t kept = 0;
+            for (const RowId row : rows) {
+                if (pass(column[row])) rows[kept++] = row;
+            }
+            rows.resize(kept);
+        };
+        switch (op) {
+            case Op::Equal: keep([&](const auto& v) { return v == value; }); break;
+            case Op::NotEqual: keep([&](const auto& v) { return v != value; }); break;
+            case Op::Less: keep([&](const auto& v) { return v < value; }); break;
+            case Op::LessEqual: keep([&](const auto& v) { return v <= value; }); break;
+            case Op::Greater: keep([&](const auto& v) { return v > value; }); break;
+            case Op::GreaterEqual: keep([&](const auto& v) { return v >= value; }); break;
+        }
+    }
+
+    static void filter(const CityTable& cities, const Condition& condition, std::vector<RowId>& rows) {
+        switch (condition.field) {
+            case CityField::Population: filterColumn(rows, cities.populations(), condition.number, condition.op); break;
+            case CityField::RecordYear: filterColumn(rows, cities.recordYears(), condition.number, condition.op); break;
+            case CityField::Latitude: filterColumn(rows, cities.latitudes(), condition.number, condition.op); break;
+            case CityField::Longitude: filterColumn(rows, cities.longitudes(), condition.number, condition.op); break;
+            default:
+                filterColumn(rows, cities.texts(condition.field), std::string_view(condition.text), condition.op);
+                break;
+        }
+    }
+
+    //  Orders rows by a column, ties in row order, only the first keep rows need to be in place
+    template <typename Column>
+    void sortBy(std::vector<RowId>& rows, const std::size_t keep, const Column& column) const {
+        auto before = [&](const RowId a, const RowId b) {
+            const auto left = column[a], right = column[b];
+            if (left != right) return descending ? right < left : left < right;
+            return a < b;
+        };
+        if (keep < rows.size()) std::partial_sort(rows.begin(), rows.begin() + keep, rows.end(), before);
+        else std::sort(rows.begin(), rows.end(), before);
+    }
+};
+
+//  Non-interactive commands for scripts, one per line with every argument inline.
+//  Each command answers "OK N" and N tab separated lines, or "ERR message" on one line.
+//  Arguments are separated by spaces, "double quotes" keep spaces inside one argument.
+//  A city is NAME, or NAME,COUNTRY when several countries share the name.
+class BatchCommands {
+public:
+    //  Changes are recorded in log once a snapshot with a journal is loaded. Commands that run in
+    //  parallel use up to threadCount threads.
+    BatchCommands(CityTable& table, Journal& log, const std::size_t threadCount = std::thread::hardware_concurrency())
+        : cities(table), journal(log), threads(threadCount) {}
+
+    //  The first word of a command line
+    static std::string_view commandOf(const std::string_view line) {
+        const std::string_view text = trim(line);
+        return text.substr(0, text.find(' '));
+    }
+
+    //  Runs one command line and appends its response to out. Blank lines and # comments answer nothing.
+    //  False if the command failed.
+    bool execute(const std::string_view line, std::string& out) {
+        const std::string_view text = trim(line);
+        if (text.empty() || text.front() == '#') return true;
+
+        const std::size_t space = text.find(' ');
+        const std::string_view command = text.substr(0, space);
+        const std::string_view rest = space == std::string_view::npos ? std::string_view() : trim(text.substr(space));
+
+        rows.clear();
+        lines = 0;
+        error.clear();
+        bool done;
+        if (command == "history") done = searchHistory(rest);
+        else if (command == "display") done = displayQuery(rest);
+        else if (command == "groupby") done = groupBy(rest);
+        else if (command == "stats") done = countryStats(rest);
+        else if (!tokenize(rest)) done = fail("unterminated quote");
+        else if (command == "search") done = arity(1, 1) && search();
+        else if (command == "add") done = arity(9, 9) && add();
+        else if (command == "delete") done = arity(1, 1) && erase();
+        else if (command == "update") done = arity(3, 3) && update();
+        else if (command == "distance") done = arity(2, 2) && distance();
+        else if (command == "nearest") done = arity(1, 2) && nearest();
+        else if (command == "within") done = arity(2, 2) && within();
+        else if (command == "complete") done = arity(1, 3) && complete();
+        else if (command == "fuzzy") done = arity(1, 2) && fuzzy();
+        else if (command == "load") done = arity(1, 1) && load();
+        else if (command == "save") done = arity(1, 1) && save();
+        else done = fail("unknown command '" + std::string(command) + "'");
+
+        if (!done) {
+            out.append("ERR ").append(error).push_back('\n');
+            return false;
+        }
+        out.append("OK ").append(std::to_string(lines)).push_back('\n');
+        out += rows;
+        return true;
+    }
+
+    //  cities_world --script [FILE] runs FILE, or standard input when FILE is missing or "-".
+    //  Responses are buffered and written in large blocks, not after each command.
+    static int runScript(const std::vector<std::string_view>& args) {
+        if (args.size() > 1) {
+            std::cerr << "Usage: cities_world --script [FILE]\n";
+            return 2;
+        }
+        std::ifstream file;
+        const bool fromFile = !args.empty() && args[0] != "-";
+        if (fromFile) {
+            file.open(std::string(args[0]));
+            if (!file) {
+                std::cerr << "Error: Cannot open " << args[0] << "\n";
+                return 2;
+            }
+        } else {
+            std::ios::sync_with_stdio(false);
+        }
+        std::istream& input = fromFile ? static_cast<std::istream&>(file) : std::cin;
+
+        CityTable cities;
+        Journal journal;
+        BatchCommands commands(cities, journal);
+        std::string line, out;
+        out.reserve(OUTPUT_BYTES + (OUTPUT_BYTES >> 2));
+        bool allDone = true;
+        while (std::getline(input, line)) {
+            allDone &= commands.execute(line, out);
+            if (out.size() >= OUTPUT_BYTES) {
+                std::fwrite(out.data(), 1, out.size(), stdout);
+                out.clear();
+            }
+        }
+        allDone &= journal.commit();
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        std::fflush(stdout);
+        return allDone ? 0 : 1;
+    }
+
+private:
+    //  Responses are written once this much is buffered
+    static constexpr std::size_t OUTPUT_BYTES = 1 << 20;
+
+    CityTable& cities;
+    Journal& journal;
+    std::size_t threads;
+    std::vector<std::string_view> args;     //  Arguments of the current command, into its line
+    std::string rows;                       //  Response lines of the current command
+    std::size_t lines = 0;
+    std::string error;
+
+    static std::string_view trim(std::string_view text) {
+        while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) text.remove_prefix(1);
+        while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) text.remove_suffix(1);
+        return text;
+    }
+
+    //  Splits on spaces into args, false on an unterminated quote
+    bool tokenize(const std::string_view text) {
+        args.clear();
+        std::size_t i = 0;
+        while (i < text.size()) {
+            if (std::isspace(static_cast<unsigned char>(text[i]))) {
+                ++i;
+            } else if (text[i] == '"') {
+                const std::size_t close = text.find('"', i + 1);
+                if (close == std::string_view::npos) return false;
+                args.push_back(text.substr(i + 1, close - i - 1));
+                i = close + 1;
+            } else {
+                std::size_t end = i;
+                while (end < text.size() && !std::isspace(static_cast<unsigned char>(text[end]))) ++end;
+                args.push_back(text.substr(i, end - i));
+                i = end;
+            }
+        }
+        return true;
+    }
+
+    bool fail(std::string message) {
+        error = std::move(message);
+        return false;
+    }
+
+    bool arity(const std::size_t least, const std::size_t most) {
+        if (args.size() >= least && args.size() <= most) return true;
+        return fail("expected " + (least == most ? std::to_string(least) : std::to_string(least) + " to " +
+                                   std::to_string(most)) + " arguments, got " + std::to_string(args.size()));
+    }
+
+    template <typename T>
+    static bool parseNumber(const std::string_view text, T& value) {
+        const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size();
+    }
+
+    //  Same limits as the interactive prompts
+    bool checkNumber(const CityField field, const std::string_view text, double& value) {
+        switch (field) {
+            case CityField::Population: {
+                int number;
+                if (!parseNumber(text, number) || number < 0) return fail("population must be a positive number");
+                value = number;
+                return true;
+            }
+            case CityField::RecordYear: {
+                int number;
+                if (!parseNumber(text, number) || number < 1900 || number > 2024) {
+                    return fail("record year must be between 1900 and 2024");
+                }
+                value = number;
+                return true;
+            }
+            case CityField::Latitude:
+                if (!parseNumber(text, value) || value < -90 || value > 90) {
+                    return fail("latitude must be between -90 and 90");
+                }
+                return true;
+            default:
+                if (!parseNumber(text, value) || value < -180 || value > 180) {
+                    return fail("longitude must be between -180 and 180");
+                }
+                return true;
+        }
+    }
+
+    //  A positive count, or fallback when the argument is missing
+    bool parseCount(const std::size_t arg, std::size_t& count, const std::size_t fallback) {
+        count = fallback;
+        if (arg >= args.size()) return true;
+        long long parsed;
+        if (!parseNumber(args[arg], parsed) || parsed < 1) return fail("count must be a positive number");
+        count = static_cast<std::size_t>(parsed);
+        return true;
+    }
+
+    bool sameCity(const RowId a, const RowId b) const {
+        return cities.name(a) == cities.name(b) && cities.country(a) == cities.country(b);
+    }
+
+    //  NAME matches ignoring case, NAME,COUNTRY matches the country exactly. Rows sharing name and
+    //  country are one city, as with City::operator==, any other choice between rows is ambiguous.
+    bool resolveCity(const std::string_view text, RowId& city) {
+        const std::vector<RowId>* matches = &cities.findByName(text);
+        std::vector<RowId> inCountry;
+        const std::size_t comma = text.rfind(',');
+        if (matches->empty() && comma != std::string_view::npos) {
+            const std::string_view country = trim(text.substr(comma + 1));
+            for (const RowId row : cities.findByName(trim(text.substr(0, comma)))) {
+                if (cities.country(row) == country) inCountry.push_back(row);
+            }
+            matches = &inCountry;
+        }
+        if (matches->empty()) return fail("city '" + std::string(text) + "' not found");
+        for (const RowId row : *matches) {
+            if (!sameCity(row, matches->front())) {
+                return fail("city '" + std::string(text) + "' is ambiguous, use NAME,COUNTRY");
+            }
+        }
+        city = matches->front();
+        return true;
+    }
+
+    //  A city, or latitude,longitude in degrees
+    bool resolveOrigin(const std::string_view text, UnitVector& position, RowId& city, bool& byCity) {
+        const std::size_t comma = text.find(',');
+        double latitude, longitude;
+        if (comma != std::string_view::npos && parseNumber(trim(text.substr(0, comma)), latitude) &&
+            parseNumber(trim(text.substr(comma + 1)), longitude)) {
+            if (latitude < -90 || latitude > 90 || longitude < -180 || longitude > 180) {
+                return fail("coordinates out of range");
+            }
+            position = UnitVector::fromDegrees(latitude, longitude);
+            byCity = false;
+            return true;
+        }
+        if (!resolveCity(text, city)) return false;
+        position = cities.position(city);
+        byCity = true;
+        return true;
+    }
+
+    void appendNumber(const double value) {
+        char digits[32];
+        const auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        rows.append(digits, static_cast<std::size_t>(result.ptr - digits));
+    }
+
+    //  Starts a response line with the city's name and country
+    void beginLine(const RowId row) {
+        rows.append(cities.name(row)).push_back('\t');
+        rows.append(cities.country(row));
+        ++lines;
+    }
+
+    //  Appends rows of a print style function and counts its lines
+    template <typename Write>
+    void appendLines(Write&& write) {
+        const std::size_t start = rows.size();
+        write(rows);
+        lines += static_cast<std::size_t>(std::count(rows.begin() + static_cast<std::ptrdiff_t>(start), rows.end(), '\n'));
+    }
+
+    //  Every field of each city with the name, in field order
+    bool search() {
+        for (const RowId row : cities.findByName(args[0])) {
+            for (int i = 0; i < 9; ++i) {
+                const CityField field = static_cast<CityField>(i);
+                if (i > 0) rows.push_back('\t');
+                switch (field) {
+                    case CityField::Population: rows += std::to_string(cities.population(row)); break;
+                    case CityField::RecordYear: rows += std::to_string(cities.recordYear(row)); break;
+                    case CityField::Latitude: appendNumber(cities.latitude(row)); break;
+                    case CityField::Longitude: appendNumber(cities.longitude(row)); break;
+                    default: rows += cities.texts(field)[row]; break;
+                }
+            }
+            rows.push_back('\n');
+            ++lines;
+        }
+        return true;
+    }
+
+    //  add NAME COUNTRY POPULATION YEAR LATITUDE LONGITUDE MAYOR ADDRESS HISTORY
+    bool add() {
+        for (const int i : {0, 1, 6, 7, 8}) {
+            if (args[i].empty()) return fail(std::string(CITY_FIELD_NAMES[i]) + " cannot be empty");
+        }
+        double population, year, latitude, longitude;
+        if (!checkNumber(CityField::Population, args[2], population) ||
+            !checkNumber(CityField::RecordYear, args[3], year) ||
+            !checkNumber(CityField::Latitude, args[4], latitude) ||
+            !checkNumber(CityField::Longitude, args[5], longitude)) {
+            return false;
+        }
+        cities.add(args[0], args[1], static_cast<int>(population), static_cast<int>(year), latitude, longitude,
+                   args[6], args[7], args[8]);
+        return true;
+    }
+
+    //  Deletes every row of the city, like the interactive delete
+    bool erase() {
+        RowId city;
+        if (!resolveCity(args[0], city)) return false;
+        for (const RowId row : cities.findRows(cities.name(city), cities.country(city))) cities.erase(row);
+        return true;
+    }
+
+    //  update CITY FIELD VALUE
+    bool update() {
+        RowId city;
+        if (!resolveCity(args[0], city)) return false;
+        CityField field;
+        if (!parseCityField(args[1], field)) return fail("invalid field name '" + std::string(args[1]) + "'");
+        const std::string fieldText(args[1]);
+        if (!isNumericField(field)) {
+            if (args[2].empty()) return fail(fieldText + " cannot be empty");
+            cities.update(city, fieldText, std::string(args[2]));
+            return true;
+        }
+        double value;
+        if (!checkNumber(field, args[2], value)) return false;
+        if (field == CityField::Population || field == CityField::RecordYear) {
+            cities.update(city, fieldText, static_cast<int>(value));
+        } else {
+            cities.update(city, fieldText, value);
+        }
+        return true;
+    }
+
+    //  Kilometers between two cities
+    bool distance() {
+        RowId a, b;
+        if (!resolveCity(args[0], a) || !resolveCity(args[1], b)) return false;
+        appendNumber(DistanceCalculator::calculateDistance(cities, a, b));
+        rows.push_back('\n');
+        ++lines;
+        return true;
+    }
+
+    //  nearest ORIGIN [K], name, country and kilometers, nearest first
+    bool nearest() {
+        UnitVector position;
+        RowId city = 0;
+        bool byCity = false;
+        std::size_t count;
+        if (!resolveOrigin(args[0], position, city, byCity) || !parseCount(1, count, 10)) return false;
+
+        //  One extra result when the origin is itself a city, it is its own nearest neighbour
+        auto neighbours = DistanceCalculator::nearest(cities, position, byCity ? count + 1 : count);
+        if (byCity) {
+            std::erase_if(neighbours, [&](const auto& neighbour) {
+                return sameCity(neighbour.first, city);
+            });
+            if (neighbours.size() > count) neighbours.resize(count);
+        }
+        for (const auto& [row, km] : neighbours) {
+            beginLine(row);
+            rows.push_back('\t');
+            appendNumber(km);
+            rows.push_back('\n');
+        }
+        return true;
+    }
+
+    //  within ORIGIN KM, name, country and kilometers, nearest first
+    bool within() {
+        UnitVector position;
+        RowId city = 0;
+        bool byCity = false;
+        if (!resolveOrigin(args[0], position, city, byCity)) return false;
+        double radius;
+        if (!parseNumber(args[1], radius) || radius < 0) return fail("radius must be a positive number");
+
+        std::vector<std::pair<RowId, double>> found;
+        for (const RowId row : DistanceCalculator::within(cities, position, radius)) {
+            if (byCity && sameCity(row, city)) continue;
+            found.emplace_back(row, DistanceCalculator::calculateDistance(position, cities.position(row)));
+        }
+        std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+        for (const auto& [row, km] : found) {
+            beginLine(row);
+            rows.push_back('\t');
+            appendNumber(km);
+            rows.push_back('\n');
+        }
+        return true;
+    }
+
+    //  complete PREFIX [K] [population], name, country and population
+    bool complete() {
+        std::size_t count;
+        if (!parseCount(1, count, 10)) return false;
+        if (args.size() == 3 && args[2] != "population") return fail("order must be population");
+        for (const RowId row : cities.complete(args[0], count, args.size() == 3)) {
+            beginLine(row);
+            rows.push_back('\t');
+            rows += std::to_string(cities.population(row));
+            rows.push_back('\n');
+        }
+        return true;
+    }
+
+    //  fuzzy NAME [K], name, country and edit distance, closest first
+    bool fuzzy() {
+        std::size_t count;
+        if (!parseCount(1, count, 10)) return false;
+        for (const auto& [row, edits] : cities.fuzzyFind(args[0], count)) {
+            beginLine(row);
+            rows.push_back('\t');
+            rows += std::to_string(edits);
+            rows.push_back('\n');
+        }
+        return true;
+    }
+
+    //  history QUERY, the rest of the line is the query, name and country of each match
+    bool searchHistory(const std::string_view query) {
+        for (const RowId row : cities.searchHistory(query)) {
+            beginLine(row);
+            rows.push_back('\n');
+        }
+        return true;
+    }
+
+    //  display QUERY, the comma separated lines of DisplayQuery with their header
+    bool displayQuery(const std::string_view text) {
+        DisplayQuery query;
+        if (!query.parse(text)) return fail("invalid query");
+        const std::vector<RowId> found = query.run(cities);
+        appendLines([&](std::string& out) { query.write(cities, found, out); });
+        return true;
+    }
+
+    //  groupby FIELD AGGREGATE..., the comma separated lines of GroupBy with their header
+    bool groupBy(const std::string_view spec) {
+        if (!tokenize(spec)) return fail("unterminated quote");
+        CityField by;
+        if (args.empty() || !parseCityField(args[0], by)) return fail("invalid field name");
+        std::vector<Aggregate> aggregates;
+        for (std::size_t i = 1; i < args.size(); ++i) {
+            Aggregate aggregate;
+            if (!AggregateTotals::parse(args[i], aggregate)) {
+                return fail("invalid aggregate '" + std::string(args[i]) + "'");
+            }
+            aggregates.push_back(aggregate);
+        }
+        if (aggregates.empty()) aggregates.push_back({AggregateKind::Count, CityField::Population});
+        const auto groups = GroupBy::run(cities, by, aggregates, threads);
+        appendLines([&](std::string& out) { GroupBy::write(by, aggregates, groups, out); });
+        return true;
+    }
+
+    //  stats country [COUNTRY], country, cities, population, centre latitude and longitude
+    bool countryStats(const std::string_view spec) {
+        if (spec.substr(0, 7) != "country" || (spec.size() > 7 && spec[7] != ' ')) {
+            return fail("usage: stats country [COUNTRY]");
+        }
+        std::string_view country = trim(spec.substr(7));
+        if (country.size() >= 2 && country.front() == '"' && country.back() == '"') {
+            country = country.substr(1, country.size() - 2);
+        }
+
+        auto append = [&](const std::string_view name, const CountryStats& stats) {
+            double latitude, longitude;
+            stats.centroid(latitude, longitude);
+            rows.append(name).push_back('\t');
+            rows.append(std::to_string(stats.cities)).push_back('\t');
+            rows.append(std::to_string(stats.population)).push_back('\t');
+            appendNumber(latitude);
+            rows.push_back('\t');
+            appendNumber(longitude);
+            rows.push_back('\n');
+            ++lines;
+        };
+        if (!country.empty()) {
+            const CountryStats* stats = cities.countryStats(country);
+            if (stats != nullptr) append(country, *stats);
+            return true;
+        }
+        const auto& all = cities.countryTotals();
+        std::vector<const std::pair<const std::string, CountryStats>*> sorted;
+        for (const auto& entry : all) sorted.push_back(&entry);
+        std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+        for (const auto* entry : sorted) append(entry->first, entry->second);
+        return true;
+    }
+
+    //  Replaces the table with a file, a snapshot gets its journal replayed and attached
+    bool load() {
+        const std::string fileName(args[0]);
+        if (!std::ifstream(fileName)) return fail("cannot open " + fileName);
+        journal.close();
+        cities = FileManager::loadData(fileName);
+        if (FileManager::isSnapshotName(fileName)) journal.open(fileName, cities);
+        return true;
+    }
+
+    //  Saving over the journaled snapshot is a checkpoint, like the interactive save
+    bool save() {
+        const std::string fileName(args[0]);
+        if (journal.isOpen() && fileName == journal.snapshot()) {
+            journal.checkpoint();
+            return true;
+        }
+        if (!FileManager::saveData(cities, fileName)) return fail("cannot save " + fileName);
+        return true;
+    }
+};
+
+//  Two copies of a table so that queries never wait for changes, the left-right scheme. Readers take
+//  the published copy without a lock: a reader announces the copy it is reading in its own slot and
+//  checks that the copy is still published. A writer changes the copy nobody reads, publishes it with
+//  one atomic store, waits until every reader has left the old copy and then repeats the change on
+//  it, so both are current again for the next writer. Writers are serialized and every change must
+//  act the same on both copies. A copy is settled before it is published, so readers only read.
+class TableVersions {
+public:
+    //  readers is the number of reader slots, one per thread that reads
+    explicit TableVersions(const std::size_t readers) : slots(readers) {}
+
+    TableVersions(const TableVersions&) = delete;
+    TableVersions& operator=(const TableVersions&) = delete;
+
+    //  Copy 0 or 1, for binding commands to it. Only read a copy between enter and leave, and only
+    //  change it from inside write.
+    CityTable& copy(const std::size_t side) { return tables[side]; }
+
+    //  The copy to read from until leave(slot), never waits
+    std::size_t enter(const std::size_t slot) {
+        std::size_t side;
+        do {
+            side = published.load();
+            slots[slot].side.store(side);
+        } while (published.load() != side);
+        return side;
+    }
+
+    void leave(const std::size_t slot) { slots[slot].side.store(IDLE); }
+
+    //  Makes copy 1 the same as copy 0 and settles both, after filling copy 0 and before any reader
+    //  starts. A journal attached to copy 0 stays with it, changes are logged once from there.
+    void mirror() {
+        tables[1] = tables[0];
+        tables[1].attachJournal(nullptr);
+        tables[0].settle();
+        tables[1].settle();
+    }
+
+    //  Calls change(side, first) for the unpublished copy with first set, publishes that copy, and
+    //  once no reader is left on the other copy calls change(side, false) for it
+    template <typename Change>
+    void write(Change&& change) {
+        std::lock_guard<std::mutex> guard(writer);
+        const std::size_t old = published.load(), next = 1 - old;
+        change(next, true);
+        tables[next].settle();
+        published.store(next);
+        for (const Slot& slot : slots) {
+            while (slot.side.load() == old) std::this_thread::yield();
+        }
+        change(old, false);
+        tables[old].settle();
+    }
+
+private:
+    static constexpr std::size_t IDLE = 2;
+
+    //  A cache line per reader, so readers do not slow each other down
+    struct alignas(64) Slot {
+        std::atomic<std::size_t> side{IDLE};
+    };
+
+    CityTable tables[2];
+    std::atomic<std::size_t> published{0};
+    std::vector<Slot> slots;
+    std::mutex writer;
+};
+
+#ifdef CITIES_SERVER
+//  Query server for running the table as a shared lookup service. Clients connect to a Unix domain
+//  socket, or to a TCP port on 127.0.0.1, and send batch commands one per line. Every command is
+//  answered in order with the same OK or ERR response as in script mode, so clients may pipeline.
+//  Clients get the queries and update only, see allowed. The socket file is only open to the user
+//  running the server, the TCP port to anyone on the machine.
+//  Each worker thread runs its own epoll loop over the connections it accepted, and all of them wait
+//  on the listening socket. The table is kept as TableVersions, so queries read it without locking
+//  and never wait for a change. Updates are only taken when FILE is a snapshot, whose journal makes
+//  them durable before they are answered. Served from a text file or no file they would be lost on
+//  exit, so they are refused.
+class QueryServer {
+public:
+    //  cities_world --serve ADDRESS [FILE] [--threads N], ADDRESS is a socket path or a port number
+    static int run(const std::vector<std::string_view>& args) {
+        std::string address, fileName;
+        std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--threads" && i + 1 < args.size()) {
+                const std::string_view count = args[++i];
+                const auto result = std::from_chars(count.data(), count.data() + count.size(), threads);
+                if (result.ec != std::errc() || result.ptr != count.data() + count.size() || threads == 0) {
+                    address.clear();
+                    break;
+                }
+            } else if (address.empty()) {
+                address = args[i];
+            } else if (fileName.empty()) {
+                fileName = args[i];
+            } else {
+                address.clear();
+                break;
+            }
+        }
+        if (address.empty()) {
+            std::cerr << "Usage: cities_world --serve SOCKET_PATH|PORT [FILE] [--threads N]\n";
+            return 2;
+        }
+
+        QueryServer server(threads);
+        if (!fileName.empty()) {
+            if (!std::ifstream(fileName)) {
+                std::cerr << "Error: Cannot open " << fileName << "\n";
+                return 1;
+            }
+            //  Loaded and journaled once into the published copy, the other copy starts as a copy of it
+            CityTable& table = server.versions.copy(0);
+            table = FileManager::loadData(fileName);
+            server.journaled = FileManager::isSnapshotName(fileName) && server.journal.open(fileName, table);
+        }
+        //  Also without a file, queries must not build the lazy indexes of a copy concurrently
+        server.versions.mirror();
+        if (!server.listen(address)) return 1;
+
+        //  SIGINT and SIGTERM stop the workers through the wake event, a closed client is only an error
+        wakeFd = server.wake;
+        std::signal(SIGINT, stop);
+        std::signal(SIGTERM, stop);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::cerr << "Serving " << server.versions.copy(0).liveCount() << " cities on " << address << " with " << threads
+                  << (threads == 1 ? " thread\n" : " threads\n");
+        std::vector<std::thread> workers;
+        for (std::size_t i = 0; i < threads; ++i) workers.emplace_back(&QueryServer::work, &server, i);
+        for (std::thread& worker : workers) worker.join();
+        return 0;
+    }
+
+    explicit QueryServer(const std::size_t threads) : versions(threads) {}
+
+    ~QueryServer() {
+        if (listener >= 0) ::close(listener);
+        if (wake >= 0) ::close(wake);
+        if (!socketPath.empty()) ::unlink(socketPath.c_str());
+    }
+
+private:
+    static constexpr std::size_t READ_BYTES = 64 << 10;
+    static constexpr std::size_t LINE_LIMIT = 1 << 20;     //  Longer lines close the connection
+    static constexpr int EVENTS = 64;
 
-        //  Use acos to find d
-        const double d = acos(cosD);
+    struct Connection {
+        std::string in, out;
+        std::size_t sent = 0;
+        bool writing = false;   //  Waiting for the socket to take more output, input is left unread
+        bool closing = false;   //  The client sent everything, close once the output is sent
+    };
 
-        //  Convert angular distance to linear distance.
-        const double distance = d * EARTH_RADIUS_KM;
+    //  State of one worker thread
+    struct Worker {
+        std::size_t slot;               //  Reader slot in versions
+        BatchCommands commands[2];      //  Bound to each copy of the table
+        std::string discarded;          //  Responses of changes repeated on the second copy
+    };
 
-        return distance;
+    static inline int wakeFd = -1;
+
+    Journal journal;
+    bool journaled = false;                     //  The journal is open, updates are taken
+    std::atomic<bool> journalFailed{false};     //  Set once a commit failed, updates are refused after it
+    TableVersions versions;
+    int listener = -1;
+    int wake = -1;              //  eventfd that wakes every worker to stop
+    std::string socketPath;
 
+    static void stop(int) {
+        const std::uint64_t one = 1;
+        [[maybe_unused]] const ssize_t written = ::write(wakeFd, &one, sizeof(one));
     }
-};
 
-//  Class to manage the file cities data is stored in.
-//  File Format :
-//  name,country,population,recordYear,latitude,longitude,mayorName,mayorAddress,history
-class FileManager {
-public:
-    static std::vector<City> loadData(const std::string& fileName) {
-        std::vector<City> cities;   //  Store Loaded cities instances
-        std::ifstream file(fileName);
+    bool listen(const std::string& address) {
+        wake = ::eventfd(0, EFD_NONBLOCK);
+        const bool tcp = !address.empty() && std::all_of(address.begin(), address.end(), [](const char c) {
+            return std::isdigit(static_cast<unsigned char>(c));
+        });
+        if (tcp) {
+            unsigned port = 0;
+            std::from_chars(address.data(), address.data() + address.size(), port);
+            if (port == 0 || port > 65535) {
+                std::cerr << "Error: Invalid port " << address << "\n";
+                return false;
+            }
+            sockaddr_in socketAddress{};
+            socketAddress.sin_family = AF_INET;
+            socketAddress.sin_port = htons(static_cast<std::uint16_t>(port));
+            socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            listener = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            const int on = 1;
+            if (listener >= 0) ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&socketAddress), sizeof(socketAddress)) != 0) {
+                std::cerr << "Error: Cannot listen on port " << address << ": " << std::strerror(errno) << "\n";
+                return false;
+            }
+        } else {
+            sockaddr_un socketAddress{};
+            if (address.size() >= sizeof(socketAddress.sun_path)) {
+                std::cerr << "Error: Socket path too long: " << address << "\n";
+                return false;
+            }
+            //  A socket left behind by a server that did not shut down is replaced, any other file is not
+            struct stat existing;
+            if (::stat(address.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) ::unlink(address.c_str());
+            socketAddress.sun_family = AF_UNIX;
+            std::memcpy(socketAddress.sun_path, address.c_str(), address.size() + 1);
+            listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            //  Created 0600 rather than chmod after bind, so there is no moment others could connect
+            const mode_t previous = ::umask(0177);
+            const bool bound = listener >= 0 &&
+                               ::bind(listener, reinterpret_cast<sockaddr*>(&socketAddress), sizeof(socketAddress)) == 0;
+            ::umask(previous);
+            if (!bound) {
+                std::cerr << "Error: Cannot listen on " << address << ": " << std::strerror(errno) << "\n";
+                return false;
+            }
+            socketPath = address;
+        }
+        if (::listen(listener, SOMAXCONN) != 0) {
+            std::cerr << "Error: Cannot listen on " << address << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        return true;
+    }
 
-        //  Validate that the file opened or not
-        if (!file.is_open()) {
-            std::cout<< "File doesn't exist: Creating File. . .  "<< fileName<< '\n';
-            return cities;
+    //  One worker: accepts connections and serves them until the wake event fires
+    void work(const std::size_t slot) {
+        const int poll = ::epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event{};
+        //  EPOLLEXCLUSIVE wakes one waiting worker per new connection instead of all of them
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.fd = listener;
+        ::epoll_ctl(poll, EPOLL_CTL_ADD, listener, &event);
+        event.events = EPOLLIN;
+        event.data.fd = wake;
+        ::epoll_ctl(poll, EPOLL_CTL_ADD, wake, &event);
+
+        std::unordered_map<int, Connection> connections;
+        //  Every worker already has a thread of its own, commands do not start more
+        Worker worker{slot, {{versions.copy(0), journal, 1}, {versions.copy(1), journal, 1}}, {}};
+        epoll_event ready[EVENTS];
+        bool running = true;
+        while (running) {
+            const int count = ::epoll_wait(poll, ready, EVENTS, -1);
+            for (int i = 0; i < count; ++i) {
+                const int fd = ready[i].data.fd;
+                if (fd == wake) {
+                    running = false;
+                } else if (fd == listener) {
+                    accept(poll, connections);
+                } else if (!serve(poll, fd, ready[i].events, connections.at(fd), worker)) {
+                    ::epoll_ctl(poll, EPOLL_CTL_DEL, fd, nullptr);
+                    ::close(fd);
+                    connections.erase(fd);
+                }
+            }
         }
-        // Loads city data from a text file into a vector of City objects.
-        std::string line;
-        while (std::getline(file, line)) {
-            std::istringstream stream(line);
+        for (const auto& [fd, connection] : connections) ::close(fd);
+        ::close(poll);
+    }
 
-            std::string name, country, history, mayorName, mayorAddress;
-            int population, recordYear;
-            double latitude, longitude;
+    void accept(const int poll, std::unordered_map<int, Connection>& connections) {
+        while (true) {
+            const int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;     //  EAGAIN once another worker or this one took every pending connection
+            if (socketPath.empty()) {
+                const int on = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.fd = fd;
+            ::epoll_ctl(poll, EPOLL_CTL_ADD, fd, &event);
+            connections.emplace(fd, Connection{});
+        }
+    }
 
-            std::getline(stream, name, ',');
-            std::getline(stream, country, ',');
-            stream >> population;
-            stream.ignore(); // Skip comma
-            stream >> recordYear;
-            stream.ignore(); // Skip comma
-            stream >> latitude;
-            stream.ignore(); // Skip comma
-            stream >> longitude;
-            stream.ignore(); // Skip comma
-            std::getline(stream, mayorName, ',');
-            std::getline(stream, mayorAddress, ',');
-            std::getline(stream, history);
+    //  Handles the events of one connection, false once it should be closed
+    bool serve(const int poll, const int fd, const std::uint32_t events, Connection& connection, Worker& worker) {
+        if (events & EPOLLERR) return false;
+        if (!connection.writing) {
+            //  At most about LINE_LIMIT per event, the rest waits so other connections get their turn
+            char chunk[READ_BYTES];
+            while (connection.in.size() < LINE_LIMIT) {
+                const ssize_t got = ::recv(fd, chunk, sizeof(chunk), 0);
+                if (got > 0) {
+                    connection.in.append(chunk, static_cast<std::size_t>(got));
+                } else if (got == 0) {
+                    connection.closing = true;
+                    break;
+                } else if (errno != EINTR) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+                    break;
+                }
+            }
+            //  A last command without a newline still runs, as in script mode
+            if (connection.closing && !connection.in.empty() && connection.in.back() != '\n') connection.in.push_back('\n');
+            execute(connection, worker);
+            if (connection.in.size() > LINE_LIMIT) {
+                connection.out += "ERR line too long\n";
+                connection.closing = true;
+            }
+        }
+        if (!flush(fd, connection)) return false;
 
-            cities.emplace_back(name, country, population, recordYear, latitude, longitude, mayorName, mayorAddress, history);
+        //  Stop reading while output is backed up, so a client that does not read cannot grow it
+        const bool writing = connection.sent < connection.out.size();
+        if (!writing && connection.closing) return false;
+        if (writing != connection.writing) {
+            connection.writing = writing;
+            epoll_event event{};
+            event.events = writing ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+            event.data.fd = fd;
+            ::epoll_ctl(poll, EPOLL_CTL_MOD, fd, &event);
         }
+        return true;
+    }
 
-        file.close();
-        return cities;
+    //  Commands clients may send. load, save, add and delete are refused, a client could otherwise read
+    //  or replace any file the server can open.
+    static bool allowed(const std::string_view command) {
+        return command == "search" || command == "distance" || command == "nearest" || command == "within" ||
+               command == "complete" || command == "fuzzy" || command == "history" || command == "display" ||
+               command == "groupby" || command == "stats" || command == "update";
     }
-    static void saveData(const std::vector<City>& cities, const std::string& fileName) {
-        std::ofstream file(fileName);
 
-        if (!file.is_open()) {
-            std::cerr << "Error: Cannot open file.\n";
-            return;
-        }
+    //  Runs every complete line of input. Each query reads the published copy of the table, consecutive
+    //  updates are written to both copies together and committed to the journal once.
+    void execute(Connection& connection, Worker& worker) {
+        const std::string_view input = connection.in;
+        std::size_t start = 0;
+        while (true) {
+            std::size_t end = input.find('\n', start);
+            if (end == std::string_view::npos) break;
+            const std::string_view line = input.substr(start, end - start);
+            start = end + 1;
+            const std::string_view command = BatchCommands::commandOf(line);
+            if (command.empty() || command.front() == '#') continue;
+            if (!allowed(command)) {
+                connection.out.append("ERR command '").append(command).append("' is not available on the server\n");
+                continue;
+            }
+            if (command == "update" && !journaled) {
+                connection.out += "ERR updates need the server to run on a snapshot file\n";
+                continue;
+            }
+            if (command == "update" && journalFailed.load()) {
+                connection.out += "ERR cannot write journal\n";
+                continue;
+            }
+            if (command != "update") {
+                const std::size_t side = versions.enter(worker.slot);
+                worker.commands[side].execute(line, connection.out);
+                versions.leave(worker.slot);
+                continue;
+            }
 
-        for (const auto& city : cities) {
-            file << city.name << ","
-            << city.country << ","
-            << city.population << ","
-            << city.recordYear << ","
-            << city.latitude << ","
-            << city.longitude << ","
-            << city.mayorName << ","
-            << city.mayorAddress << ","
-            << city.history << "\n";
+            std::vector<std::string_view> changes{line};
+            while ((end = input.find('\n', start)) != std::string_view::npos &&
+                   BatchCommands::commandOf(input.substr(start, end - start)) == "update") {
+                changes.push_back(input.substr(start, end - start));
+                start = end + 1;
+            }
+            versions.write([&](const std::size_t side, const bool first) {
+                for (const std::string_view change : changes) {
+                    worker.commands[side].execute(change, first ? connection.out : worker.discarded);
+                }
+                worker.discarded.clear();
+                //  Queries already see these changes, so they are answered as made even if the journal
+                //  failed. From then on the server refuses updates instead of losing them on exit.
+                if (!first && !journal.commit() && !journalFailed.exchange(true)) {
+                    std::cerr << "Error: Cannot write journal, updates are refused from now on.\n";
+                }
+            });
+        }
+        connection.in.erase(0, start);
+    }
 
+    //  Sends as much output as the socket takes, false if the connection failed
+    static bool flush(const int fd, Connection& connection) {
+        while (connection.sent < connection.out.size()) {
+            const ssize_t put = ::send(fd, connection.out.data() + connection.sent,
+                                       connection.out.size() - connection.sent, MSG_NOSIGNAL);
+            if (put < 0) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            connection.sent += static_cast<std::size_t>(put);
         }
-        file.close();
+        connection.out.clear();
+        connection.sent = 0;
+        return true;
     }
 };
+#endif
 
 /*  Class for User Interface, this includes user input, output and command processing,
     name,country,population,recordYear,latitude,longitude,mayorName,mayorAddress,history
@@ -187,8 +5305,11 @@ public:
     delete: Remove a city by name.
     search: Search for a city by name and display its details.
     update: Update specific details of a city.
-    display: Show all cities or a specific field.
+    display: Show all cities, a specific field or the result of a query.
     distance: Calculate the distance between two cities.
+    matrix: Write the distance matrix of all cities to a binary file.
+    nearest: List the cities closest to a city or a coordinate.
+    within: List the cities within a radius of a city or a coordinate.
     save: Save the current cities to a file.
     exit: Exit the program.
 */
@@ -196,32 +5317,34 @@ public:
 class UserInterface {
 public:
 
-    static std::vector<City> findCitiesByName(const std::vector<City>& cities, const std::string& cityName) {
-        std::vector<City> results;
-
-        // Convert search query to lowercase
-        std::string queryLower = toLower(cityName);
+    //  Case insensitive lookup through the table's name index, rows stay valid until they are erased
+    static const std::vector<RowId>& findCitiesByName(const CityTable& cities, const std::string& cityName) {
+        return cities.findByName(cityName);
+    }
 
-        for (const auto& city : cities) {
-            // Convert city name to lowercase for comparison
-            if (toLower(city.name) == queryLower) {
-                results.push_back(city);
-            }
-        }
-        return results;
+    //  Same output as City::display, read straight from the table
+    static void displayCity(const CityTable& cities, const RowId row) {
+        std::cout << "City Name: " << cities.name(row) << "\n"
+                  << "Country: " << cities.country(row) << "\n"
+                  << "History: " << cities.history(row) << "\n"
+                  << "Population: " << cities.population(row) << "\n"
+                  << "Population Recorded in: " << cities.recordYear(row) << "\n"
+                  << "Mayor Name: " << cities.mayorName(row) << "\n"
+                  << "Mayor Address: " << cities.mayorAddress(row) << "\n"
+                  << "Coordinates: (" << cities.latitude(row) << ", " << cities.longitude(row) << ")\n";
     }
 
     // Helper function to convert a string to lowercase
-    static std::string toLower(const std::string& str) {
-        std::string lowerStr = str;
-        std::transform(lowerStr.begin(), lowerStr.end(), lowerStr.begin(), ::tolower);
-        return lowerStr;
+    static std::string toLower(const std::string_view str) {
+        return foldCase(str);
     }
 
     // Main interface for user commands to manage cities.
-    static void start(std::vector<City>& cities) {
+    //  lazyColdFields loads text files with their cold fields left in the file, see FileManager::loadData
+    static void start(CityTable& cities, const bool lazyColdFields = false) {
         std::string fileName ;
         std::string command;
+        Journal journal;    //  Records every change when working on a snapshot file
 
         std::cout << "Welcome to the Cities of the World Program!\n";
 
@@ -231,10 +5354,13 @@ public:
         if (fileName.empty()) {
             std::cout << "Starting without a file . . ." << std::endl;
         } else {
-            cities = FileManager::loadData(fileName);
+            cities = FileManager::loadData(fileName, lazyColdFields);
+            if (FileManager::isSnapshotName(fileName) && journal.open(fileName, cities)) {
+                std::cout << "Changes are journaled to " << fileName << ".journal\n";
+            }
         }
 
-        std::cout << "Available commands: add, delete, search, update, display, distance, save, help, exit\n";
+        std::cout << "Available commands: add, delete, search, update, display, distance, matrix, nearest, within, complete, fuzzy, history, groupby, stats, save, help, exit\n";
         while (true) {
             std::cout << "\nEnter a command: ";
             std::getline(std::cin, command);
@@ -250,17 +5376,44 @@ public:
                 updateCity(cities);
             } else if (command == "display") {
                 displayCities(cities);
+            } else if (command.rfind("display ", 0) == 0) {
+                displayQuery(cities, std::string_view(command).substr(8));
             } else if (command =="distance") {
                 distance(cities);
+            } else if (command == "matrix") {
+                distanceMatrix(cities);
+            } else if (command == "nearest") {
+                nearestCities(cities);
+            } else if (command == "within") {
+                citiesWithin(cities);
+            } else if (command == "complete") {
+                completeName(cities);
+            } else if (command == "fuzzy") {
+                fuzzySearch(cities);
+            } else if (command == "history") {
+                searchHistory(cities);
+            } else if (command == "groupby" || command.rfind("groupby ", 0) == 0) {
+                groupBy(cities, std::string_view(command).substr(7));
+            } else if (command == "stats" || command.rfind("stats ", 0) == 0) {
+                countryStats(cities, std::string_view(command).substr(5));
             } else if (command == "save") {
-                saveToFile(cities);
+                saveToFile(cities, journal);
             } else if (command == "help") {
                 std::cout<< "add: add a city\n";
                 std::cout << "delete: delete a city\n";
                 std::cout << "search: search a city by name (Case Insensitive)\n";
                 std::cout << "update: update a cities fields\n";
                 std::cout << "display: display all cities by field\n";
-                std::cout << "distance: calculate distance between two cities\n";
+                std::cout << "display QUERY: [FIELD,...|*] [where FIELD OP VALUE {and|or} ...] [order by FIELD [asc|desc]] [limit N]\n";
+                std::cout << "distance: calculate distance between two cities, or from one city to all others\n";
+                std::cout << "matrix: write the distance matrix of all cities to a binary file\n";
+                std::cout << "nearest: list the cities closest to a city or to latitude,longitude\n";
+                std::cout << "within: list the cities within a radius in km of a city or of latitude,longitude\n";
+                std::cout << "complete: list the cities whose name starts with a prefix (Case Insensitive)\n";
+                std::cout << "fuzzy: list the cities whose name is close to a possibly misspelled name\n";
+                std::cout << "history: list the cities whose history matches words, \"phrases\" and OR (any case, quote \"or\" to search for it)\n";
+                std::cout << "groupby FIELD AGGREGATE...: count, sum(FIELD), min(FIELD), max(FIELD) or avg(FIELD) per value of a field\n";
+                std::cout << "stats country [COUNTRY]: city count, population and population weighted centre per country\n";
                 std::cout << "save: save city data to file\n";
                 std::cout << "exit\n";
             } else if (command == "exit") {
@@ -269,13 +5422,14 @@ public:
             } else {
                 std::cout << "Invalid command. Please try again.\n";
             }
+            journal.commit();   //  The command's changes are durable before the next prompt
         }
     }
 
 private:
 
     // Add a new city
-    static void addCity(std::vector<City>& cities) {
+    static void addCity(CityTable& cities) {
     std::string name, country, history, mayorName, mayorAddress;
     int population, recordYear;
     double latitude, longitude;
@@ -373,31 +5527,39 @@ private:
     } while (history.empty());
 
     // Add city to the list
-    cities.emplace_back(name, country, population, recordYear, latitude, longitude, mayorName, mayorAddress, history);
+    cities.add(name, country, population, recordYear, latitude, longitude, mayorName, mayorAddress, history);
     std::cout << "City '" << name << "' added successfully.\n";
 }
 
     //  Search for a particular city, could have been built in to display
-    static void searchCity(const std::vector<City>& cities) {
+    static void searchCity(const CityTable& cities) {
         std::cout << "Enter the name of the city to search for: ";
         std::string cityName;
         std::getline(std::cin, cityName);
 
-        const auto matches = findCitiesByName(cities, cityName);
+        const auto& matches = findCitiesByName(cities, cityName);
 
         if (matches.empty()) {
             std::cout << "City '" << cityName << "' not found.\n";
+            const auto suggestions = cities.fuzzyFind(cityName, 5);
+            if (!suggestions.empty()) {
+                std::cout << "Did you mean:";
+                for (const auto& [row, edits] : suggestions) {
+                    std::cout << " " << cities.name(row) << " (" << cities.country(row) << ")";
+                }
+                std::cout << "\n";
+            }
             return;
         }
 
         if (matches.size() == 1) {
             // Single match, display directly
-            matches[0].display();
+            displayCity(cities, matches[0]);
         } else {
             // Multiple matches, differentiate by country
             std::cout << "Multiple cities found with the name '" << cityName << "' in different countries:\n";
             for (size_t i = 0; i < matches.size(); ++i) {
-                std::cout << i + 1 << ". " << matches[i].name << " (" << matches[i].country << ")\n";
+                std::cout << i + 1 << ". " << cities.name(matches[i]) << " (" << cities.country(matches[i]) << ")\n";
             }
 
             std::cout << "Enter the number corresponding to the correct city: ";
@@ -406,7 +5568,7 @@ private:
             std::cin.ignore(); // Clear input buffer
 
             if (choice > 0 && choice <= matches.size()) {
-                matches[choice - 1].display();
+                displayCity(cities, matches[choice - 1]);
             } else {
                 std::cout << "Invalid choice.\n";
             }
@@ -415,12 +5577,13 @@ private:
 
 
     // Delete a city
-    static void deleteCity(std::vector<City>& cities) {
+    static void deleteCity(CityTable& cities) {
         std::cout << "Enter the name of the city to delete: ";
         std::string cityName;
         std::getline(std::cin, cityName);
 
-        auto matches = findCitiesByName(cities, cityName);
+        //  Copied, erasing rows changes the index list the lookup returns
+        const std::vector<RowId> matches = findCitiesByName(cities, cityName);
 
         if (matches.empty()) {
             std::cout << "City '" << cityName << "' not found.\n";
@@ -428,14 +5591,14 @@ private:
         }
 
         if (matches.size() == 1) {
-            // Single match, delete directly, std::remove equality operator defined in City compares name and country
-            cities.erase(std::remove(cities.begin(), cities.end(), matches[0]), cities.end());
+            // Single match, delete directly
+            cities.erase(matches[0]);
             std::cout << "City '" << cityName << "' deleted successfully.\n";
         } else {
             // Multiple matches, differentiate by country
             std::cout << "Multiple cities found with the name '" << cityName << "' in different countries:\n";
             for (size_t i = 0; i < matches.size(); ++i) {
-                std::cout << i + 1 << ". " << matches[i].name << " (" << matches[i].country << ")\n";
+                std::cout << i + 1 << ". " << cities.name(matches[i]) << " (" << cities.country(matches[i]) << ")\n";
             }
 
             std::cout << "Enter the number corresponding to the city to delete: ";
@@ -444,7 +5607,11 @@ private:
             std::cin.ignore(); // Clear input buffer
 
             if (choice > 0 && choice <= matches.size()) {
-                cities.erase(std::remove(cities.begin(), cities.end(), matches[choice - 1]), cities.end());
+                //  Rows are matched on name and country like City::operator==
+                const RowId chosen = matches[choice - 1];
+                for (const RowId row : cities.findRows(cities.name(chosen), cities.country(chosen))) {
+                    cities.erase(row);
+                }
                 std::cout << "City deleted successfully.\n";
             } else {
                 std::cout << "Invalid choice.\n";
@@ -454,27 +5621,25 @@ private:
 
 
     // Update a city's details
-  static void updateCity(std::vector<City>& cities) {
+  static void updateCity(CityTable& cities) {
     std::cout << "Enter the name of the city to update: ";
     std::string cityName;
     std::getline(std::cin, cityName);
 
-    auto matches = findCitiesByName(cities, cityName);
+    //  Copied, renaming the row changes the index list the lookup returns
+    const std::vector<RowId> matches = findCitiesByName(cities, cityName);
 
     if (matches.empty()) {
         std::cout << "Error: City '" << cityName << "' not found.\n";
         return;
     }
 
-    City* cityToUpdate = nullptr;
+    RowId rowToUpdate = matches[0];
 
-    if (matches.size() == 1) {
-        auto it = std::find(cities.begin(), cities.end(), matches[0]);
-        cityToUpdate = &(*it);
-    } else {
+    if (matches.size() > 1) {
         std::cout << "Multiple cities found for '" << cityName << "':\n";
         for (size_t i = 0; i < matches.size(); ++i) {
-            std::cout << i + 1 << ". " << matches[i].name << " (" << matches[i].country << ")\n";
+            std::cout << i + 1 << ". " << cities.name(matches[i]) << " (" << cities.country(matches[i]) << ")\n";
         }
 
         std::cout << "Enter the number corresponding to the city to update: ";
@@ -483,99 +5648,96 @@ private:
         std::cin.ignore();
 
         if (choice > 0 && choice <= matches.size()) {
-            auto it = std::find(cities.begin(), cities.end(), matches[choice - 1]);
-            cityToUpdate = &(*it);
+            rowToUpdate = matches[choice - 1];
         } else {
             std::cout << "Invalid choice.\n";
             return;
         }
     }
 
-    if (cityToUpdate) {
-        std::string field;
-        std::cout << "Enter the field to update (name, country, population, recordYear, latitude, longitude, mayorName, mayorAddress, history): ";
-        std::getline(std::cin, field);
-
-        if (field == "name" || field == "country" || field == "mayorName" || field == "mayorAddress" || field == "history") {
-            std::string value;
-            do {
-                std::cout << "Enter the new value for " << field << ": ";
-                std::getline(std::cin, value);
-                if (value.empty()) {
-                    std::cerr << field << " cannot be empty. Please try again.\n";
-                }
-            } while (value.empty());
-            cityToUpdate->update(field, value);
+    std::string field;
+    std::cout << "Enter the field to update (name, country, population, recordYear, latitude, longitude, mayorName, mayorAddress, history): ";
+    std::getline(std::cin, field);
 
-        } else if (field == "population") {
-            int value;
-            do {
-                std::cout << "Enter the new value for population (>= 0): ";
-                std::cin >> value;
-                if (std::cin.fail() || value < 0) {
-                    std::cin.clear();
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                    std::cerr << "Population must be a positive number. Please try again.\n";
-                } else {
-                    break;
-                }
-            } while (true);
-            cityToUpdate->update(field, value);
+    if (field == "name" || field == "country" || field == "mayorName" || field == "mayorAddress" || field == "history") {
+        std::string value;
+        do {
+            std::cout << "Enter the new value for " << field << ": ";
+            std::getline(std::cin, value);
+            if (value.empty()) {
+                std::cerr << field << " cannot be empty. Please try again.\n";
+            }
+        } while (value.empty());
+        cities.update(rowToUpdate, field, value);
 
-        } else if (field == "recordYear") {
-            int value;
-            do {
-                std::cout << "Enter the new value for record year (1900-2024): ";
-                std::cin >> value;
-                if (std::cin.fail() || value < 1900 || value > 2024) {
-                    std::cin.clear();
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                    std::cerr << "Record year must be between 1900 and 2024. Please try again.\n";
-                } else {
-                    break;
-                }
-            } while (true);
-            cityToUpdate->update(field, value);
+    } else if (field == "population") {
+        int value;
+        do {
+            std::cout << "Enter the new value for population (>= 0): ";
+            std::cin >> value;
+            if (std::cin.fail() || value < 0) {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::cerr << "Population must be a positive number. Please try again.\n";
+            } else {
+                break;
+            }
+        } while (true);
+        cities.update(rowToUpdate, field, value);
 
-        } else if (field == "latitude") {
-            double value;
-            do {
-                std::cout << "Enter the new value for latitude (-90 to 90): ";
-                std::cin >> value;
-                if (std::cin.fail() || value < -90 || value > 90) {
-                    std::cin.clear();
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                    std::cerr << "Latitude must be between -90 and 90. Please try again.\n";
-                } else {
-                    break;
-                }
-            } while (true);
-            cityToUpdate->update(field, value);
+    } else if (field == "recordYear") {
+        int value;
+        do {
+            std::cout << "Enter the new value for record year (1900-2024): ";
+            std::cin >> value;
+            if (std::cin.fail() || value < 1900 || value > 2024) {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::cerr << "Record year must be between 1900 and 2024. Please try again.\n";
+            } else {
+                break;
+            }
+        } while (true);
+        cities.update(rowToUpdate, field, value);
 
-        } else if (field == "longitude") {
-            double value;
-            do {
-                std::cout << "Enter the new value for longitude (-180 to 180): ";
-                std::cin >> value;
-                if (std::cin.fail() || value < -180 || value > 180) {
-                    std::cin.clear();
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                    std::cerr << "Longitude must be between -180 and 180. Please try again.\n";
-                } else {
-                    break;
-                }
-            } while (true);
-            cityToUpdate->update(field, value);
+    } else if (field == "latitude") {
+        double value;
+        do {
+            std::cout << "Enter the new value for latitude (-90 to 90): ";
+            std::cin >> value;
+            if (std::cin.fail() || value < -90 || value > 90) {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::cerr << "Latitude must be between -90 and 90. Please try again.\n";
+            } else {
+                break;
+            }
+        } while (true);
+        cities.update(rowToUpdate, field, value);
 
-        } else {
-            std::cout << "Invalid field name.\n";
-        }
+    } else if (field == "longitude") {
+        double value;
+        do {
+            std::cout << "Enter the new value for longitude (-180 to 180): ";
+            std::cin >> value;
+            if (std::cin.fail() || value < -180 || value > 180) {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::cerr << "Longitude must be between -180 and 180. Please try again.\n";
+            } else {
+                break;
+            }
+        } while (true);
+        cities.update(rowToUpdate, field, value);
 
-        std::cout << "City details updated successfully.\n";
+    } else {
+        std::cout << "Invalid field name.\n";
     }
+
+    std::cout << "City details updated successfully.\n";
 }
     // Display all cities or a specific field
-    static void displayCities(const std::vector<City>& cities) {
+    static void displayCities(const CityTable& cities) {
         if (cities.empty()) {
             std::cout << "No cities to display.\n";
             return;
@@ -585,42 +5747,116 @@ private:
         std::string field;
         std::getline(std::cin, field);
 
+        CityField single;
+        if (!field.empty() && !parseCityField(field, single)) {
+            //  Anything but a field name is a query
+            displayQuery(cities, field);
+            return;
+        }
+
         if (field.empty()) {
             // Display all details if no field is specified
-            for (const auto& city : cities) {
-                city.display();
+            for (RowId row = 0; row < cities.size(); ++row) {
+                if (!cities.alive(row)) continue;
+                displayCity(cities, row);
                 std::cout << "\n";
             }
         } else {
-            // Display specific field for all cities
-            for (const auto& city : cities) {
-                if (field == "name") {
-                    std::cout << "City Name: " << city.name << "\n";
-                } else if (field == "country") {
-                    std::cout << "Country: " << city.country << "\n";
-                } else if (field == "population") {
-                    std::cout << "Population: " << city.population << "\n";
-                } else if (field == "recordYear") {
-                    std::cout << "Record Year: " << city.recordYear << "\n";
-                } else if (field == "latitude") {
-                    std::cout << "Latitude: " << city.latitude << "\n";
-                } else if (field == "longitude") {
-                    std::cout << "Longitude: " << city.longitude << "\n";
-                } else if (field == "mayorName") {
-                    std::cout << "Mayor Name: " << city.mayorName << "\n";
-                } else if (field == "mayorAddress") {
-                    std::cout << "Mayor Address: " << city.mayorAddress << "\n";
-                } else if (field == "history") {
-                    std::cout << "History: " << city.history << "\n";
-                } else {
-                    std::cout << "Invalid field name. Please try again.\n";
-                    return; // Exit early if the field is invalid
+            // Display specific field for all cities, the field is resolved once rather than per row
+            static constexpr std::string_view LABELS[] = {"City Name", "Country", "Population", "Record Year",
+                                                          "Latitude", "Longitude", "Mayor Name", "Mayor Address",
+                                                          "History"};
+            const std::string_view label = LABELS[static_cast<int>(single)];
+            auto print = [&](auto&& value) {
+                for (RowId row = 0; row < cities.size(); ++row) {
+                    if (cities.alive(row)) std::cout << label << ": " << value(row) << "\n";
                 }
+            };
+            switch (single) {
+                case CityField::Population: print([&](const RowId row) { return cities.population(row); }); break;
+                case CityField::RecordYear: print([&](const RowId row) { return cities.recordYear(row); }); break;
+                case CityField::Latitude: print([&](const RowId row) { return cities.latitude(row); }); break;
+                case CityField::Longitude: print([&](const RowId row) { return cities.longitude(row); }); break;
+                default: {
+                    const StringColumn& column = cities.texts(single);
+                    print([&](const RowId row) { return column[row]; });
+                    break;
+                }
+            }
+        }
+    }
+
+    //  Aggregates per value of a field, FIELD AGGREGATE... on the command line or asked for
+    static void groupBy(const CityTable& cities, std::string_view spec) {
+        std::string entered;
+        if (spec.find_first_not_of(' ') == std::string_view::npos) {
+            std::cout << "Enter the field to group by and the aggregates, e.g. country count sum(population): ";
+            std::getline(std::cin, entered);
+            spec = entered;
+        }
+
+        std::istringstream words{std::string(spec)};
+        std::string word;
+        CityField by;
+        if (!(words >> word) || !parseCityField(word, by)) {
+            std::cout << "Invalid field name.\n";
+            return;
+        }
+        std::vector<Aggregate> aggregates;
+        while (words >> word) {
+            Aggregate aggregate;
+            if (!AggregateTotals::parse(word, aggregate)) {
+                std::cout << "Invalid aggregate '" << word << "', use count or sum, min, max, avg of a numeric field.\n";
+                return;
             }
+            aggregates.push_back(aggregate);
+        }
+        if (aggregates.empty()) aggregates.push_back({AggregateKind::Count, CityField::Population});
+        GroupBy::print(by, aggregates, GroupBy::run(cities, by, aggregates));
+    }
+
+    //  Materialized per country totals, "country" then an optional country name, all countries when blank
+    static void countryStats(const CityTable& cities, std::string_view spec) {
+        auto trim = [](std::string_view text) {
+            while (!text.empty() && text.front() == ' ') text.remove_prefix(1);
+            while (!text.empty() && text.back() == ' ') text.remove_suffix(1);
+            return text;
+        };
+        spec = trim(spec);
+        if (spec.substr(0, 7) != "country" || (spec.size() > 7 && spec[7] != ' ')) {
+            std::cout << "Usage: stats country [COUNTRY]\n";
+            return;
+        }
+        const std::string_view country = trim(spec.substr(7));
+
+        auto print = [](const std::string_view name, const CountryStats& stats) {
+            double latitude, longitude;
+            stats.centroid(latitude, longitude);
+            std::cout << name << ": " << stats.cities << (stats.cities == 1 ? " city" : " cities") << ", population "
+                      << stats.population << ", centre (" << latitude << ", " << longitude << ")\n";
+        };
+        if (!country.empty()) {
+            const CountryStats* stats = cities.countryStats(country);
+            if (stats == nullptr) std::cout << "No cities in '" << country << "'.\n";
+            else print(country, *stats);
+            return;
         }
+
+        const auto& all = cities.countryTotals();
+        std::vector<const std::pair<const std::string, CountryStats>*> sorted;
+        for (const auto& entry : all) sorted.push_back(&entry);
+        std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+        for (const auto* entry : sorted) print(entry->first, entry->second);
     }
 
-    static void distance(const std::vector<City>& cities) {
+    //  Runs a DisplayQuery and prints its rows
+    static void displayQuery(const CityTable& cities, const std::string_view text) {
+        DisplayQuery query;
+        if (!query.parse(text)) return;
+        query.print(cities, query.run(cities));
+    }
+
+    static void distance(const CityTable& cities) {
     if (cities.empty()) {
         std::cout << "No cities to calculate the distance between.\n";
         return;
@@ -632,86 +5868,364 @@ private:
     std::getline(std::cin, cityA);
 
     // Find all matches for the first city
-    auto matchesA = findCitiesByName(cities, cityA);
+    const auto& matchesA = findCitiesByName(cities, cityA);
     if (matchesA.empty()) {
         std::cout << "City '" << cityA << "' not found.\n";
         return;
     }
 
-    City city1;
-    if (matchesA.size() == 1) {
-        city1 = matchesA[0];
-    } else {
-        // Multiple matches, let the user select
-        std::cout << "Multiple cities found for '" << cityA << "':\n";
-        for (size_t i = 0; i < matchesA.size(); ++i) {
-            std::cout << i + 1 << ". " << matchesA[i].name << " (" << matchesA[i].country << ")\n";
-        }
-        std::cout << "Select the correct city by number: ";
-        size_t choice;
-        std::cin >> choice;
-        std::cin.ignore(); // Clear input buffer
-
-        if (choice < 1 || choice > matchesA.size()) {
-            std::cout << "Invalid choice.\n";
-            return;
-        }
-        city1 = matchesA[choice - 1];
-    }
+    RowId city1;
+    if (!selectCity(cities, matchesA, cityA, city1)) return;
 
     // Get the second city
-    std::cout << "Enter the name of the second city: ";
+    std::cout << "Enter the name of the second city [Leave Blank For ALL]: ";
     std::string cityB;
     std::getline(std::cin, cityB);
 
+    if (cityB.empty()) {
+        distanceToAll(cities, city1);
+        return;
+    }
+
     // Find all matches for the second city
-    auto matchesB = findCitiesByName(cities, cityB);
+    const auto& matchesB = findCitiesByName(cities, cityB);
     if (matchesB.empty()) {
         std::cout << "City '" << cityB << "' not found.\n";
         return;
     }
 
-    City city2;
-    if (matchesB.size() == 1) {
-        city2 = matchesB[0];
-    } else {
-        // Multiple matches, let the user select
-        std::cout << "Multiple cities found for '" << cityB << "':\n";
-        for (size_t i = 0; i < matchesB.size(); ++i) {
-            std::cout << i + 1 << ". " << matchesB[i].name << " (" << matchesB[i].country << ")\n";
+    RowId city2;
+    if (!selectCity(cities, matchesB, cityB, city2)) return;
+
+    // Calculate the distance
+    double distance = DistanceCalculator::calculateDistance(cities, city1, city2);
+    std::cout << "The distance between " << cities.name(city1) << " and " << cities.name(city2)
+              << " is " << distance << " kilometers.\n";
+}
+
+
+    //  Distances from one city to every other city, nearest first.
+    //  Rows are ranked by chord length, the acos only runs for the lines that get printed.
+    static void distanceToAll(const CityTable& cities, const RowId origin) {
+        std::vector<double> chords(cities.size());
+        DistanceCalculator::calculateChordsSquared(cities.position(origin), cities, chords.data());
+
+        std::vector<RowId> rows;
+        rows.reserve(cities.liveCount());
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (cities.alive(row) && !sameCity(cities, row, origin)) rows.push_back(row);
+        }
+        std::sort(rows.begin(), rows.end(), [&](const RowId a, const RowId b) { return chords[a] < chords[b]; });
+
+        std::cout << "Distances from " << cities.name(origin) << " (" << cities.country(origin) << "):\n";
+        for (const RowId row : rows) {
+            std::cout << cities.name(row) << " (" << cities.country(row) << "): "
+                      << DistanceCalculator::distanceForChordSquared(chords[row]) << " kilometers\n";
+        }
+    }
+
+    //  All pairs distance matrix, streamed to a binary file
+    static void distanceMatrix(const CityTable& cities) {
+        if (cities.empty()) {
+            std::cout << "No cities to calculate the distance between.\n";
+            return;
+        }
+
+        std::cout << "Enter the file name to write the matrix to: ";
+        std::string fileName;
+        std::getline(std::cin, fileName);
+        if (fileName.empty()) {
+            std::cout << "File name cannot be empty.\n";
+            return;
+        }
+
+        std::cout << "Enter the precision (float32, float64) [Leave Blank For float64]: ";
+        std::string precision;
+        std::getline(std::cin, precision);
+        if (!precision.empty() && precision != "float32" && precision != "float64") {
+            std::cout << "Invalid precision.\n";
+            return;
+        }
+
+        const auto format = precision == "float32" ? DistanceMatrix::Precision::Float32
+                                                   : DistanceMatrix::Precision::Float64;
+        if (DistanceMatrix::write(cities, fileName, format)) {
+            std::cout << "Distance matrix of " << cities.liveCount() << " cities written to " << fileName << ".\n";
+        }
+    }
+
+    //  "name (country)" of a row
+    static std::string cityLabel(const CityTable& cities, const RowId row) {
+        return std::string(cities.name(row)) + " (" + std::string(cities.country(row)) + ")";
+    }
+
+    //  Rows are the same city when name and country match, like City::operator==
+    static bool sameCity(const CityTable& cities, const RowId a, const RowId b) {
+        return cities.name(a) == cities.name(b) && cities.country(a) == cities.country(b);
+    }
+
+    //  Lets the user pick one of several cities sharing a name, false if the choice is invalid
+    static bool selectCity(const CityTable& cities, const std::vector<RowId>& matches, const std::string& cityName,
+                           RowId& selected) {
+        if (matches.size() == 1) {
+            selected = matches[0];
+            return true;
+        }
+        std::cout << "Multiple cities found for '" << cityName << "':\n";
+        for (size_t i = 0; i < matches.size(); ++i) {
+            std::cout << i + 1 << ". " << cities.name(matches[i]) << " (" << cities.country(matches[i]) << ")\n";
         }
         std::cout << "Select the correct city by number: ";
         size_t choice;
         std::cin >> choice;
         std::cin.ignore(); // Clear input buffer
 
-        if (choice < 1 || choice > matchesB.size()) {
+        if (std::cin.fail() || choice < 1 || choice > matches.size()) {
+            std::cin.clear();
             std::cout << "Invalid choice.\n";
+            return false;
+        }
+        selected = matches[choice - 1];
+        return true;
+    }
+
+    //  Parses "latitude,longitude" in degrees, false if the text is not a valid coordinate
+    static bool parseCoordinates(const std::string& text, double& latitude, double& longitude) {
+        std::istringstream stream(text);
+        char comma = 0;
+        if (!(stream >> latitude >> comma >> longitude) || comma != ',') return false;
+        stream >> std::ws;
+        return stream.eof() && latitude >= -90 && latitude <= 90 && longitude >= -180 && longitude <= 180;
+    }
+
+    //  Resolves a city name or "latitude,longitude" to a position, byCity tells which one it was
+    static bool resolveOrigin(const CityTable& cities, const std::string& origin, UnitVector& position, RowId& city,
+                              bool& byCity) {
+        double latitude, longitude;
+        if (parseCoordinates(origin, latitude, longitude)) {
+            position = UnitVector::fromDegrees(latitude, longitude);
+            byCity = false;
+            return true;
+        }
+        const auto& matches = findCitiesByName(cities, origin);
+        if (matches.empty()) {
+            std::cout << "City '" << origin << "' not found.\n";
+            return false;
+        }
+        if (!selectCity(cities, matches, origin, city)) return false;
+        position = cities.position(city);
+        byCity = true;
+        return true;
+    }
+
+    //  k nearest cities to a named city or a coordinate, answered by the spatial index
+    static void nearestCities(const CityTable& cities) {
+        if (cities.empty()) {
+            std::cout << "No cities to search.\n";
             return;
         }
-        city2 = matchesB[choice - 1];
+
+        std::cout << "Enter a city name or coordinates as latitude,longitude: ";
+        std::string origin;
+        std::getline(std::cin, origin);
+
+        UnitVector position;
+        RowId city = 0;
+        bool byCity = false;
+        if (!resolveOrigin(cities, origin, position, city, byCity)) return;
+
+        std::cout << "Enter the number of cities [Leave Blank For 10]: ";
+        std::string countText;
+        std::getline(std::cin, countText);
+        std::size_t count = 10;
+        if (!countText.empty()) {
+            std::istringstream stream(countText);
+            long long parsed;
+            if (!(stream >> parsed) || parsed < 1) {
+                std::cout << "The number of cities must be a positive number.\n";
+                return;
+            }
+            count = static_cast<std::size_t>(parsed);
+        }
+
+        //  One extra result when the origin is itself a city, it is its own nearest neighbour
+        auto neighbours = DistanceCalculator::nearest(cities, position, byCity ? count + 1 : count);
+        if (byCity) {
+            std::erase_if(neighbours, [&](const auto& neighbour) {
+                return sameCity(cities, neighbour.first, city);
+            });
+            if (neighbours.size() > count) neighbours.resize(count);
+        }
+
+        std::cout << "Nearest cities to " << (byCity ? cityLabel(cities, city) : origin) << ":\n";
+        for (size_t i = 0; i < neighbours.size(); ++i) {
+            const RowId row = neighbours[i].first;
+            std::cout << i + 1 << ". " << cities.name(row) << " (" << cities.country(row) << "): "
+                      << neighbours[i].second << " kilometers\n";
+        }
     }
 
-    // Calculate the distance
-    double distance = DistanceCalculator::calculateDistance(city1, city2);
-    std::cout << "The distance between " << city1.name << " and " << city2.name
-              << " is " << distance << " kilometers.\n";
-}
+    //  Every city within a radius of a named city or a coordinate, answered by the cell index
+    static void citiesWithin(const CityTable& cities) {
+        if (cities.empty()) {
+            std::cout << "No cities to search.\n";
+            return;
+        }
+
+        std::cout << "Enter a city name or coordinates as latitude,longitude: ";
+        std::string origin;
+        std::getline(std::cin, origin);
+
+        UnitVector position;
+        RowId city = 0;
+        bool byCity = false;
+        if (!resolveOrigin(cities, origin, position, city, byCity)) return;
+
+        double radius;
+        do {
+            std::cout << "Enter the radius in kilometers: ";
+            std::cin >> radius;
+            if (std::cin.fail() || radius < 0) {
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                std::cerr << "Radius must be a positive number. Please try again.\n";
+            } else {
+                break;
+            }
+        } while (true);
+        std::cin.ignore();
+
+        std::vector<std::pair<RowId, double>> found;
+        for (const RowId row : DistanceCalculator::within(cities, position, radius)) {
+            if (byCity && sameCity(cities, row, city)) continue;
+            found.emplace_back(row, DistanceCalculator::calculateDistance(position, cities.position(row)));
+        }
+        std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+
+        const std::string originName = byCity ? cityLabel(cities, city) : origin;
+        if (found.empty()) {
+            std::cout << "No cities within " << radius << " kilometers of " << originName << ".\n";
+            return;
+        }
+        std::cout << found.size() << " cities within " << radius << " kilometers of " << originName << ":\n";
+        for (const auto& [row, km] : found) {
+            std::cout << cities.name(row) << " (" << cities.country(row) << "): " << km << " kilometers\n";
+        }
+    }
+
+    //  Full text search over history, answered by the history index
+    static void searchHistory(const CityTable& cities) {
+        std::cout << "Enter words, \"quoted phrases\" or OR between them: ";
+        std::string query;
+        std::getline(std::cin, query);
 
+        const std::vector<RowId> rows = cities.searchHistory(query);
+        if (rows.empty()) {
+            std::cout << "No city history matches '" << query << "'.\n";
+            return;
+        }
+        std::cout << rows.size() << " cities match:\n";
+        for (const RowId row : rows) std::cout << cities.name(row) << " (" << cities.country(row) << ")\n";
+    }
+
+    //  Names close to a possibly misspelled one, candidates from the bigram index
+    static void fuzzySearch(const CityTable& cities) {
+        std::cout << "Enter a city name: ";
+        std::string cityName;
+        std::getline(std::cin, cityName);
+
+        const auto found = cities.fuzzyFind(cityName, 10);
+        if (found.empty()) {
+            std::cout << "No cities close to '" << cityName << "'.\n";
+            return;
+        }
+        for (const auto& [row, edits] : found) {
+            std::cout << cities.name(row) << " (" << cities.country(row) << "), " << edits
+                      << (edits == 1 ? " edit" : " edits") << ", population " << cities.population(row) << "\n";
+        }
+    }
+
+    //  Type-ahead over city names, answered by the prefix index
+    static void completeName(const CityTable& cities) {
+        std::cout << "Enter the start of a city name: ";
+        std::string prefix;
+        std::getline(std::cin, prefix);
+
+        std::cout << "Enter the number of cities [Leave Blank For 10]: ";
+        std::string countText;
+        std::getline(std::cin, countText);
+        std::size_t count = 10;
+        if (!countText.empty()) {
+            std::istringstream stream(countText);
+            long long parsed;
+            if (!(stream >> parsed) || parsed < 1) {
+                std::cout << "The number of cities must be a positive number.\n";
+                return;
+            }
+            count = static_cast<std::size_t>(parsed);
+        }
+
+        std::cout << "Order by population? (y/n) [Leave Blank For alphabetical]: ";
+        std::string order;
+        std::getline(std::cin, order);
+        const bool byPopulation = order == "y" || order == "Y";
 
-    static void saveToFile(const std::vector<City>& cities) {
+        const std::vector<RowId> rows = cities.complete(prefix, count, byPopulation);
+        if (rows.empty()) {
+            std::cout << "No cities start with \"" << prefix << "\".\n";
+            return;
+        }
+        for (const RowId row : rows) {
+            std::cout << cities.name(row) << " (" << cities.country(row) << "), population "
+                      << cities.population(row) << "\n";
+        }
+    }
+
+    static void saveToFile(const CityTable& cities, Journal& journal) {
         std::cout << "Enter the file name to save the data: ";
         std::string fileName;
         std::getline(std::cin, fileName);
+        if (journal.isOpen() && fileName == journal.snapshot()) {
+            //  The journaled snapshot is rewritten by a checkpoint, which also empties its journal
+            journal.checkpoint();
+            std::cout << "Checkpoint of " << fileName << " started.\n";
+            return;
+        }
         // Saves the current list of cities to a user-specified file.
-        FileManager::saveData(cities, fileName);
-        std::cout << "Data successfully saved to " << fileName << ".\n";
+        if (FileManager::saveData(cities, fileName)) {
+            std::cout << "Data successfully saved to " << fileName << ".\n";
+        }
     }
 };
 
-int main() {
-    std::vector<City> cities;
-    UserInterface::start(cities);
+//  The test target compiles this file with its own main
+#ifndef CITIES_WORLD_TESTS
+int main(int argc, char* argv[]) {
+    //  cities_world --stream ... runs one streaming query and exits without the interactive prompt
+    if (argc > 1 && std::string_view(argv[1]) == "--stream") {
+        return StreamQuery::run(std::vector<std::string_view>(argv + 2, argv + argc));
+    }
+
+    //  cities_world --script [FILE] runs batch commands from FILE or standard input
+    if (argc > 1 && std::string_view(argv[1]) == "--script") {
+        return BatchCommands::runScript(std::vector<std::string_view>(argv + 2, argv + argc));
+    }
+
+    //  cities_world --serve ADDRESS [FILE] answers batch commands from socket clients until interrupted
+    if (argc > 1 && std::string_view(argv[1]) == "--serve") {
+#ifdef CITIES_SERVER
+        return QueryServer::run(std::vector<std::string_view>(argv + 2, argv + argc));
+#else
+        std::cerr << "Error: --serve is only available on Linux\n";
+        return 2;
+#endif
+    }
+
+    //  cities_world --lazy leaves mayorName, mayorAddress and history in the loaded file until read
+    const bool lazy = argc > 1 && std::string_view(argv[1]) == "--lazy";
+
+    CityTable cities;
+    UserInterface::start(cities, lazy);
     return 0;
 }
-
+#endif
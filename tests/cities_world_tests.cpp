@@ -0,0 +1,1230 @@
+//  Tests for cities_world, built as the cities_world_tests target and run by ctest.
+//  main.cpp is compiled in without its own main(). Each test checks a feature against a plain scan
+//  over the table or against a reload of what it wrote, on random tables from a fixed seed.
+#define CITIES_WORLD_TESTS
+#include "../main.cpp"
+
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+
+namespace {
+
+int failures = 0;
+
+//  Reports a failed condition and carries on, so one run shows every failure
+#define CHECK(condition)                                                                       \
+    do {                                                                                       \
+        if (!(condition)) {                                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed\n";    \
+            ++failures;                                                                        \
+        }                                                                                      \
+    } while (false)
+
+std::string readFile(const std::string& fileName) {
+    std::ifstream file(fileName, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+void writeFile(const std::string& fileName, const std::string_view bytes) {
+    std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+    file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+//  Runs fn with standard output sent to fileName and returns what it printed
+template <typename Fn>
+std::string captureOutput(const std::string& fileName, Fn&& fn) {
+    std::cout.flush();
+    std::fflush(stdout);
+    const int saved = ::dup(STDOUT_FILENO);
+    const int file = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    ::dup2(file, STDOUT_FILENO);
+    ::close(file);
+    fn();
+    std::cout.flush();
+    std::fflush(stdout);
+    ::dup2(saved, STDOUT_FILENO);
+    ::close(saved);
+    return readFile(fileName);
+}
+
+//  Names built from a few syllables so that names repeat, share prefixes and lie a few edits apart
+std::string randomName(std::mt19937& random) {
+    static constexpr std::string_view SYLLABLES[] = {"pa", "ris", "lon", "don", "ber", "lin", "ro",
+                                                     "me", "ma", "drid", "to", "kyo", "os", "lo"};
+    std::string name;
+    const std::size_t count = 1 + random() % 3;
+    for (std::size_t i = 0; i < count; ++i) name += SYLLABLES[random() % std::size(SYLLABLES)];
+    if (random() % 2) name[0] = static_cast<char>(::toupper(name[0]));
+    return name;
+}
+
+std::string randomCountry(std::mt19937& random) {
+    static constexpr std::string_view COUNTRIES[] = {"France", "UK", "Germany", "Italy", "Spain", "Japan", "Norway"};
+    return std::string(COUNTRIES[random() % std::size(COUNTRIES)]);
+}
+
+double uniform(std::mt19937& random, const double low, const double high) {
+    return std::uniform_real_distribution<double>(low, high)(random);
+}
+
+RowId addRandom(CityTable& cities, std::mt19937& random) {
+    const int id = static_cast<int>(random() % 100000);
+    return cities.add(randomName(random), randomCountry(random), static_cast<int>(random() % 50) * 1000,
+                      1900 + static_cast<int>(random() % 120), uniform(random, -89.0, 89.0),
+                      uniform(random, -179.9, 179.9), "Mayor " + std::to_string(id),
+                      std::to_string(id) + " Main Street", "Founded in year " + std::to_string(id % 977));
+}
+
+CityTable randomTable(std::mt19937& random, const std::size_t rows) {
+    CityTable cities;
+    for (std::size_t i = 0; i < rows; ++i) addRandom(cities, random);
+    return cities;
+}
+
+//  A live row, the table must have one
+RowId randomLiveRow(const CityTable& cities, std::mt19937& random) {
+    while (true) {
+        const auto row = static_cast<RowId>(random() % cities.size());
+        if (cities.alive(row)) return row;
+    }
+}
+
+//  One random add, erase or update of a text, integer or coordinate field
+void changeRandom(CityTable& cities, std::mt19937& random) {
+    const auto kind = random() % 6;
+    if (kind == 0 || cities.liveCount() < 2) {
+        addRandom(cities, random);
+        return;
+    }
+    const RowId row = randomLiveRow(cities, random);
+    switch (kind) {
+        case 1: cities.erase(row); break;
+        case 2: cities.update(row, "name", randomName(random)); break;
+        case 3: cities.update(row, "population", static_cast<int>(random() % 50) * 1000); break;
+        case 4: cities.update(row, "latitude", uniform(random, -89.0, 89.0)); break;
+        default: cities.update(row, "history", "Rebuilt in " + std::to_string(random() % 2000)); break;
+    }
+}
+
+//  Every live row with its id and fields, for comparing whole tables
+std::string dump(const CityTable& cities) {
+    std::string out;
+    for (RowId row = 0; row < cities.size(); ++row) {
+        if (!cities.alive(row)) continue;
+        out += std::to_string(row);
+        for (const std::string_view text : {cities.name(row), cities.country(row), cities.mayorName(row),
+                                            cities.mayorAddress(row), cities.history(row)}) {
+            out.append(",").append(text);
+        }
+        out += "," + std::to_string(cities.population(row)) + "," + std::to_string(cities.recordYear(row));
+        AggregateTotals::appendNumber(out += ",", cities.latitude(row));
+        AggregateTotals::appendNumber(out += ",", cities.longitude(row));
+        out += '\n';
+    }
+    return out;
+}
+
+//  Crash recovery: a snapshot and the journal as it was on disk at some point, cut anywhere,
+//  reopen to the table as of the last complete record
+void testJournalReplay(const std::string& directory) {
+    std::mt19937 random(11);
+    const std::string snapshot = directory + "/journal.snapshot";
+    const std::string image = directory + "/crash.snapshot";
+    CHECK(FileManager::saveData(randomTable(random, 200), snapshot));
+    const std::string snapshotBytes = readFile(snapshot);
+
+    CityTable cities = FileManager::loadData(snapshot);
+    Journal journal;
+    CHECK(journal.open(snapshot, cities));
+    //  One change per commit, so a commit's bytes in the journal are exactly one record
+    std::vector<std::string> states{dump(cities)};
+    std::vector<std::size_t> sizes{readFile(snapshot + ".journal").size()};
+    for (int i = 0; i < 60; ++i) {
+        changeRandom(cities, random);
+        CHECK(journal.commit());
+        states.push_back(dump(cities));
+        sizes.push_back(readFile(snapshot + ".journal").size());
+    }
+    const std::string journalBytes = readFile(snapshot + ".journal");
+    CHECK(journalBytes.size() == sizes.back());
+
+    auto recover = [&](const std::string_view rotated, const std::string_view current) {
+        writeFile(image, snapshotBytes);
+        std::remove((image + ".journal.1").c_str());
+        if (!rotated.empty()) writeFile(image + ".journal.1", rotated);
+        writeFile(image + ".journal", current);
+        CityTable recovered = FileManager::loadData(image);
+        Journal reopened;
+        CHECK(reopened.open(image, recovered));
+        const std::string state = dump(recovered);
+        reopened.close();
+        return state;
+    };
+
+    CHECK(recover({}, journalBytes) == states.back());
+    CHECK(recover({}, {}) == states.front());
+    //  Torn tails: the last record cut short, garbage after it, and a damaged checksum
+    for (const std::size_t commit : {0, 1, 17, 59}) {
+        const std::size_t cut = sizes[commit] + (sizes[commit + 1] - sizes[commit]) / 2;
+        CHECK(recover({}, std::string_view(journalBytes).substr(0, cut)) == states[commit]);
+    }
+    CHECK(recover({}, journalBytes + std::string(7, '\x5a')) == states.back());
+    std::string damaged = journalBytes;
+    damaged[sizes[59] + 12] ^= 0x40;
+    CHECK(recover({}, damaged) == states[59]);
+
+    //  A checkpoint that crashed after moving the journal aside: the old snapshot, the rotated journal
+    //  and the records logged since are all replayed
+    journal.checkpoint();
+    for (int i = 0; i < 30; ++i) {
+        changeRandom(cities, random);
+        CHECK(journal.commit());
+    }
+    const std::string expected = dump(cities);
+    CHECK(recover(journalBytes, readFile(snapshot + ".journal")) == expected);
+
+    //  And the checkpoint itself, once finished, holds everything up to its rotation
+    journal.close();
+    CityTable reloaded = FileManager::loadData(snapshot);
+    Journal reopened;
+    CHECK(reopened.open(snapshot, reloaded));
+    CHECK(dump(reloaded) == expected);
+}
+
+//  A snapshot reloads to the same rows under the same ids, deleted rows included, and saving the
+//  reloaded table, whose strings are read from the mapping, writes the same bytes again
+void testSnapshotRoundTrip(const std::string& directory) {
+    std::mt19937 random(23);
+    CityTable cities = randomTable(random, 500);
+    for (int i = 0; i < 300; ++i) changeRandom(cities, random);
+    const std::string snapshot = directory + "/round.snapshot";
+    CHECK(FileManager::saveData(cities, snapshot));
+
+    const CityTable loaded = FileManager::loadData(snapshot);
+    CHECK(loaded.size() == cities.size());
+    CHECK(loaded.liveCount() == cities.liveCount());
+    CHECK(dump(loaded) == dump(cities));
+
+    const std::string again = directory + "/again.snapshot";
+    CHECK(FileManager::saveData(loaded, again));
+    CHECK(readFile(again) == readFile(snapshot));
+
+    //  Cold fields left in a text file by the lazy loader are written out like any others
+    const std::string text = directory + "/round.txt";
+    CHECK(FileManager::saveData(cities, text));
+    const CityTable lazy = FileManager::loadData(text, true);
+    const std::string fromLazy = directory + "/lazy.snapshot";
+    CHECK(FileManager::saveData(lazy, fromLazy));
+    CHECK(dump(FileManager::loadData(fromLazy)) == dump(FileManager::loadData(text)));
+
+    //  A cut snapshot is rejected rather than loaded in part
+    const std::string bytes = readFile(snapshot);
+    const std::string cut = directory + "/cut.snapshot";
+    writeFile(cut, std::string_view(bytes).substr(0, bytes.size() / 2));
+    CHECK(FileManager::loadData(cut).size() == 0);
+}
+
+//  A distance matrix file holds its header, the live rows in order and every pair distance, replaces
+//  an older file at the same path and leaves no temporary file behind
+template <typename T>
+void checkDistanceMatrix(const CityTable& cities, const std::string& fileName, const DistanceMatrix::Precision precision) {
+    writeFile(fileName, "an older matrix");
+    CHECK(DistanceMatrix::write(cities, fileName, precision));
+    CHECK(!std::filesystem::exists(fileName + ".tmp"));
+    const std::string bytes = readFile(fileName);
+
+    std::vector<RowId> rows;
+    for (RowId row = 0; row < cities.size(); ++row) {
+        if (cities.alive(row)) rows.push_back(row);
+    }
+    const std::size_t n = rows.size();
+    DistanceMatrix::Header header{};
+    CHECK(bytes.size() >= sizeof(header));
+    if (bytes.size() < sizeof(header)) return;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    CHECK(std::equal(std::begin(DistanceMatrix::MAGIC), std::end(DistanceMatrix::MAGIC), header.magic));
+    CHECK(header.version == DistanceMatrix::VERSION);
+    CHECK(header.elementSize == sizeof(T));
+    CHECK(header.count == n);
+    CHECK(header.rowIdOffset % 64 == 0 && header.matrixOffset % 64 == 0);
+    CHECK(header.rowIdOffset >= sizeof(header) && header.matrixOffset >= header.rowIdOffset + n * sizeof(RowId));
+    CHECK(bytes.size() == header.matrixOffset + n * n * sizeof(T));
+    if (bytes.size() != header.matrixOffset + n * n * sizeof(T)) return;
+
+    std::vector<RowId> written(n);
+    std::memcpy(written.data(), bytes.data() + header.rowIdOffset, n * sizeof(RowId));
+    CHECK(written == rows);
+    std::vector<T> matrix(n * n);
+    std::memcpy(matrix.data(), bytes.data() + header.matrixOffset, n * n * sizeof(T));
+    for (std::size_t i = 0; i < n; ++i) {
+        CHECK(matrix[i * n + i] == 0);
+        for (std::size_t j = 0; j < n; ++j) {
+            const double expected = DistanceCalculator::calculateDistance(cities, rows[i], rows[j]);
+            CHECK(std::abs(matrix[i * n + j] - expected) <= 1e-3 + 1e-6 * expected);
+            CHECK(matrix[i * n + j] == matrix[j * n + i]);
+        }
+    }
+}
+
+void testDistanceMatrix(const std::string& directory) {
+    std::mt19937 random(29);
+    CityTable cities = randomTable(random, 300);
+    for (int i = 0; i < 100; ++i) changeRandom(cities, random);
+    checkDistanceMatrix<double>(cities, directory + "/matrix64.bin", DistanceMatrix::Precision::Float64);
+    checkDistanceMatrix<float>(cities, directory + "/matrix32.bin", DistanceMatrix::Precision::Float32);
+    CHECK(!DistanceMatrix::write(cities, directory + "/missing/matrix.bin", DistanceMatrix::Precision::Float64));
+}
+
+//  Streaming queries print the lines of the file a row by row check selects, or their aggregates per
+//  group sorted by key, like the loaded file evaluated with plain loops
+void testStreamQuery(const std::string& directory) {
+    std::mt19937 random(31);
+    CityTable original = randomTable(random, 2000);
+    for (int i = 0; i < 500; ++i) changeRandom(original, random);
+    const std::string file = directory + "/stream.txt";
+    CHECK(FileManager::saveData(original, file));
+    const CityTable cities = FileManager::loadData(file);
+    std::vector<std::string> lines;
+    std::istringstream text(readFile(file));
+    for (std::string line; std::getline(text, line);) lines.push_back(line);
+    CHECK(lines.size() == cities.size());
+    if (lines.size() != cities.size()) return;
+
+    static constexpr std::string_view OPERATORS[] = {"=", "!=", "<", "<=", ">", ">="};
+    auto compare = [](const auto& left, const std::string_view op, const auto& right) {
+        return op == "=" ? left == right : op == "!=" ? left != right : op == "<" ? left < right
+             : op == "<=" ? left <= right : op == ">" ? left > right : left >= right;
+    };
+    for (int i = 0; i < 80; ++i) {
+        std::vector<std::string> args{file};
+        std::vector<std::function<bool(RowId)>> conditions;
+        for (std::size_t j = 0, count = random() % 3; j < count; ++j) {
+            const std::string op(OPERATORS[random() % std::size(OPERATORS)]);
+            switch (random() % 3) {
+                case 0: {
+                    const int population = static_cast<int>(random() % 50) * 1000;
+                    args.insert(args.end(), {"--where", "population" + op + std::to_string(population)});
+                    conditions.push_back([&, op, population](const RowId row) { return compare(cities.population(row), op, population); });
+                    break;
+                }
+                case 1: {
+                    const std::string country = randomCountry(random);
+                    args.insert(args.end(), {"--where", "country " + op + " " + country});
+                    conditions.push_back([&, op, country](const RowId row) {
+                        return compare(cities.country(row), op, std::string_view(country));
+                    });
+                    break;
+                }
+                default: {
+                    const double latitude = std::round(uniform(random, -90.0, 90.0));
+                    args.insert(args.end(), {"--where", "latitude" + op + std::to_string(int(latitude))});
+                    conditions.push_back([&, op, latitude](const RowId row) { return compare(cities.latitude(row), op, latitude); });
+                    break;
+                }
+            }
+        }
+        std::vector<RowId> matches;
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (std::all_of(conditions.begin(), conditions.end(), [&](const auto& condition) { return condition(row); })) {
+                matches.push_back(row);
+            }
+        }
+
+        //  Without aggregates the matching lines, otherwise count, sum, min, max and avg per group
+        const bool aggregated = random() % 3 != 0;
+        const std::size_t by = aggregated ? random() % 3 : 0;
+        std::string expected;
+        if (!aggregated) {
+            for (const RowId row : matches) expected += lines[row] + "\n";
+        } else {
+            args.insert(args.end(), {"--count", "--sum", "population", "--min", "latitude", "--max", "recordYear",
+                                     "--avg", "longitude"});
+            if (by == 1) args.insert(args.end(), {"--by", "country"});
+            if (by == 2) args.insert(args.end(), {"--by", "recordYear"});
+            std::map<std::string, std::vector<RowId>> groups;
+            for (const RowId row : matches) {
+                std::string key;
+                if (by == 1) key = cities.country(row);
+                if (by == 2) AggregateTotals::appendNumber(key, double(cities.recordYear(row)));
+                groups[key].push_back(row);
+            }
+            if (by == 0) groups[""];
+            expected = by == 1 ? "country," : by == 2 ? "recordYear," : "";
+            expected += "count,sum(population),min(latitude),max(recordYear),avg(longitude)\n";
+            for (const auto& [key, rows] : groups) {
+                if (by != 0) expected += key + ",";
+                AggregateTotals::appendNumber(expected, rows.size());
+                if (rows.empty()) {
+                    expected += ",,,,\n";
+                    continue;
+                }
+                double sum = 0.0, low = std::numeric_limits<double>::infinity(), high = -low, longitudes = 0.0;
+                for (const RowId row : rows) {
+                    sum += cities.population(row);
+                    low = std::min(low, cities.latitude(row));
+                    high = std::max(high, double(cities.recordYear(row)));
+                    longitudes += cities.longitude(row);
+                }
+                for (const double value : {sum, low, high, longitudes / double(rows.size())}) {
+                    AggregateTotals::appendNumber(expected += ",", value);
+                }
+                expected += "\n";
+            }
+        }
+
+        const std::vector<std::string_view> views(args.begin(), args.end());
+        int status = -1;
+        const std::string output = captureOutput(directory + "/stream.out", [&] { status = StreamQuery::run(views); });
+        CHECK(status == 0);
+        CHECK(output == expected);
+    }
+}
+
+//  Per country totals kept up to date across adds, erases and updates of the country, population
+//  and coordinates equal the totals summed afresh over the live rows
+void testCountryStats() {
+    std::mt19937 random(53);
+    CityTable cities = randomTable(random, 1500);
+    cities.countryTotals();
+
+    auto check = [&] {
+        std::map<std::string, CountryStats> expected;
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (cities.alive(row)) expected[std::string(cities.country(row))].add(cities.population(row), cities.position(row), 1);
+        }
+        const auto& totals = cities.countryTotals();
+        CHECK(totals.size() == expected.size());
+        for (const auto& [country, stats] : expected) {
+            const CountryStats* found = cities.countryStats(country);
+            CHECK(found != nullptr);
+            if (found == nullptr) continue;
+            CHECK(found->cities == stats.cities);
+            CHECK(found->population == stats.population);
+            double latitude, longitude, expectedLatitude, expectedLongitude;
+            found->centroid(latitude, longitude);
+            stats.centroid(expectedLatitude, expectedLongitude);
+            const UnitVector centre = UnitVector::fromDegrees(latitude, longitude);
+            const UnitVector expectedCentre = UnitVector::fromDegrees(expectedLatitude, expectedLongitude);
+            CHECK(2.0 - 2.0 * centre.dot(expectedCentre) <= 1e-12);
+        }
+        CHECK(cities.countryStats("Atlantis") == nullptr);
+    };
+    auto change = [&] {
+        const RowId row = randomLiveRow(cities, random);
+        switch (random() % 4) {
+            case 0: cities.update(row, "country", randomCountry(random)); break;
+            case 1: cities.update(row, "longitude", uniform(random, -179.9, 179.9)); break;
+            default: changeRandom(cities, random); break;
+        }
+    };
+    for (int i = 0; i < 300; ++i) change();
+    check();
+    for (int i = 0; i < 3000; ++i) change();
+    check();
+
+    //  A country whose last city goes is dropped, and comes back with the next one
+    for (RowId row = 0; row < cities.size(); ++row) {
+        if (cities.alive(row) && cities.country(row) == "Norway") cities.erase(row);
+    }
+    CHECK(cities.countryStats("Norway") == nullptr);
+    check();
+    cities.add("Tromso", "Norway", 77000, 1990, 69.6, 18.9, "Mayor", "Address", "History");
+    CHECK(cities.countryStats("Norway") != nullptr && cities.countryStats("Norway")->population == 77000);
+    check();
+}
+
+//  Range and top-k answers of the sorted indexes equal a sort of the live rows by value then row, with
+//  changed rows still pending and after they are merged in
+void testSortedIndexes() {
+    std::mt19937 random(67);
+    CityTable cities = randomTable(random, 3000);
+    cities.rowsInRange(CityField::Population, 0, true, 0, true);
+
+    auto check = [&](const CityField field, auto&& valueOf) {
+        std::vector<RowId> live;
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (cities.alive(row)) live.push_back(row);
+        }
+        for (int i = 0; i < 100; ++i) {
+            //  Bounds on values of rows half the time, so inclusive and exclusive ends differ
+            double low = valueOf(live[random() % live.size()]), high = valueOf(live[random() % live.size()]);
+            if (random() % 2) low += uniform(random, -1.0, 1.0);
+            if (low > high) std::swap(low, high);
+            const bool lowInclusive = random() % 2, highInclusive = random() % 2;
+            std::vector<RowId> expected;
+            for (const RowId row : live) {
+                const double value = valueOf(row);
+                if ((lowInclusive ? value >= low : value > low) && (highInclusive ? value <= high : value < high)) {
+                    expected.push_back(row);
+                }
+            }
+            std::stable_sort(expected.begin(), expected.end(),
+                             [&](const RowId a, const RowId b) { return valueOf(a) < valueOf(b); });
+            CHECK(cities.rowsInRange(field, low, lowInclusive, high, highInclusive) == expected);
+            CHECK(cities.countInRange(field, low, lowInclusive, high, highInclusive) >= expected.size());
+
+            const std::size_t k = random() % 50;
+            const bool descending = random() % 2;
+            std::vector<RowId> top = live;
+            std::stable_sort(top.begin(), top.end(), [&](const RowId a, const RowId b) {
+                return descending ? valueOf(a) > valueOf(b) : valueOf(a) < valueOf(b);
+            });
+            top.resize(std::min(k, top.size()));
+            CHECK(cities.topRows(field, k, descending) == top);
+        }
+    };
+    auto checkAll = [&] {
+        check(CityField::Population, [&](const RowId row) { return double(cities.population(row)); });
+        check(CityField::RecordYear, [&](const RowId row) { return double(cities.recordYear(row)); });
+        check(CityField::Latitude, [&](const RowId row) { return cities.latitude(row); });
+        check(CityField::Longitude, [&](const RowId row) { return cities.longitude(row); });
+    };
+    auto change = [&] {
+        const RowId row = randomLiveRow(cities, random);
+        switch (random() % 4) {
+            case 0: cities.update(row, "recordYear", 1900 + static_cast<int>(random() % 120)); break;
+            case 1: cities.update(row, "longitude", uniform(random, -179.9, 179.9)); break;
+            default: changeRandom(cities, random); break;
+        }
+    };
+    for (int i = 0; i < 200; ++i) change();
+    checkAll();
+    for (int i = 0; i < 4000; ++i) change();
+    checkAll();
+}
+
+//  A script run with --script answers every line as the same changes and lookups made directly on a
+//  table and found by scanning it, saves what it changed, and fails when any line failed
+void testScript(const std::string& directory) {
+    std::mt19937 random(71);
+    CityTable model;
+    int serial = 0;
+    auto uniqueName = [&] { return randomName(random) + std::to_string(serial++); };
+    auto coordinate = [&](const double low, const double high) { return std::round(uniform(random, low, high) * 1e4) / 1e4; };
+    auto number = [](const double value) {
+        std::string text;
+        AggregateTotals::appendNumber(text, value);
+        return text;
+    };
+    for (int i = 0; i < 300; ++i) {
+        const int id = static_cast<int>(random() % 1000);
+        model.add(uniqueName(), randomCountry(random), id * 100, 1900 + id % 120, coordinate(-89.0, 89.0),
+                  coordinate(-179.0, 179.0), "Mayor " + std::to_string(id), std::to_string(id) + " Main Street",
+                  "Founded in year " + std::to_string(id));
+    }
+    const std::string input = directory + "/script.txt";
+    CHECK(FileManager::saveData(model, input));
+    model = FileManager::loadData(input);
+
+    //  The row of a live city by a scan, the name is unique
+    auto rowOf = [&](const std::string_view name) {
+        for (RowId row = 0; row < model.size(); ++row) {
+            if (model.alive(row) && model.name(row) == name) return row;
+        }
+        return RowId(model.size());
+    };
+    std::vector<std::string> names, gone;
+    for (RowId row = 0; row < model.size(); ++row) names.emplace_back(model.name(row));
+
+    std::string script = "load " + input + "\n", expected = "OK 0\n";
+    for (int i = 0; i < 600; ++i) {
+        const std::size_t pick = random() % names.size();
+        const std::string name = names[pick];
+        switch (random() % 6) {
+            case 0: {
+                const std::string added = uniqueName(), country = randomCountry(random);
+                const int population = static_cast<int>(random() % 1000) * 10;
+                const double latitude = coordinate(-89.0, 89.0), longitude = coordinate(-179.0, 179.0);
+                script += "add " + added + " " + country + " " + std::to_string(population) + " 1999 " + number(latitude) +
+                          " " + number(longitude) + " \"Mayor New\" \"2 Side Street\" \"Built in 1999\"\n";
+                model.add(added, country, population, 1999, latitude, longitude, "Mayor New", "2 Side Street", "Built in 1999");
+                names.push_back(added);
+                expected += "OK 0\n";
+                break;
+            }
+            case 1:
+                if (names.size() < 10) break;
+                script += "delete " + name + "\n";
+                model.erase(rowOf(name));
+                names.erase(names.begin() + static_cast<std::ptrdiff_t>(pick));
+                gone.push_back(name);
+                expected += "OK 0\n";
+                break;
+            case 2: {
+                const int population = static_cast<int>(random() % 1000) * 10;
+                script += "update " + name + " population " + std::to_string(population) + "\n";
+                model.update(rowOf(name), "population", population);
+                expected += "OK 0\n";
+                break;
+            }
+            case 3: {
+                const double latitude = coordinate(-89.0, 89.0);
+                script += "update " + name + " latitude " + number(latitude) + "\n";
+                model.update(rowOf(name), "latitude", latitude);
+                expected += "OK 0\n";
+                break;
+            }
+            default: {
+                //  Removed cities are looked up too and found nowhere
+                const std::string wanted = gone.empty() || random() % 3 ? name : gone[random() % gone.size()];
+                script += "search " + wanted + "\n";
+                const RowId row = rowOf(wanted);
+                if (row == model.size()) {
+                    expected += "OK 0\n";
+                    break;
+                }
+                expected += "OK 1\n";
+                expected.append(model.name(row)).append("\t").append(model.country(row));
+                expected += "\t" + std::to_string(model.population(row)) + "\t" + std::to_string(model.recordYear(row));
+                expected += "\t" + number(model.latitude(row)) + "\t" + number(model.longitude(row));
+                expected.append("\t").append(model.mayorName(row)).append("\t").append(model.mayorAddress(row));
+                expected.append("\t").append(model.history(row)).append("\n");
+                break;
+            }
+        }
+    }
+    const std::string output = directory + "/script.out.txt";
+    script += "save " + output + "\n# a comment and a blank line answer nothing\n\nfrobnicate\n";
+    expected += "OK 0\nERR unknown command 'frobnicate'\n";
+    const std::string scriptFile = directory + "/script.cw";
+    writeFile(scriptFile, script);
+
+    int status = -1;
+    const std::string response = captureOutput(directory + "/script.response", [&] {
+        status = BatchCommands::runScript({scriptFile});
+    });
+    CHECK(status == 1);
+    CHECK(response == expected);
+    const std::string reference = directory + "/script.model.txt";
+    CHECK(FileManager::saveData(model, reference));
+    CHECK(readFile(output) == readFile(reference));
+}
+
+//  Plain dynamic programming Levenshtein distance ignoring case
+std::size_t levenshtein(const std::string_view a, const std::string_view b) {
+    std::vector<std::size_t> row(b.size() + 1);
+    for (std::size_t j = 0; j <= b.size(); ++j) row[j] = j;
+    for (std::size_t i = 1; i <= a.size(); ++i) {
+        std::size_t diagonal = row[0];
+        row[0] = i;
+        for (std::size_t j = 1; j <= b.size(); ++j) {
+            const std::size_t above = row[j];
+            const bool same = ::tolower(static_cast<unsigned char>(a[i - 1])) == ::tolower(static_cast<unsigned char>(b[j - 1]));
+            row[j] = std::min({row[j] + 1, row[j - 1] + 1, diagonal + (same ? 0 : 1)});
+            diagonal = above;
+        }
+    }
+    return row[b.size()];
+}
+
+//  fuzzyFind returns every row a scan finds within the allowed edits, in the same order, while its
+//  index is kept current through changes
+void testFuzzyFind() {
+    std::mt19937 random(31);
+    CityTable cities = randomTable(random, 2000);
+    cities.fuzzyFind("warm up", 1);
+    for (int i = 0; i < 500; ++i) changeRandom(cities, random);
+
+    for (int i = 0; i < 300; ++i) {
+        std::string query = i % 3 == 0 ? randomName(random) : std::string(cities.name(randomLiveRow(cities, random)));
+        if (i % 4 == 1 && query.size() > 1) query.erase(random() % query.size(), 1);
+        if (i % 5 == 2) query.insert(query.begin() + random() % (query.size() + 1), 'x');
+        if (i % 7 == 3) query = query.substr(0, 1 + random() % 3);
+        const std::size_t allowed = query.size() <= 4 ? 1 : query.size() <= 8 ? 2 : 3;
+
+        std::vector<std::pair<RowId, std::size_t>> expected;
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (!cities.alive(row)) continue;
+            const std::size_t edits = levenshtein(query, cities.name(row));
+            if (edits <= allowed) expected.emplace_back(row, edits);
+        }
+        std::sort(expected.begin(), expected.end(), [&](const auto& a, const auto& b) {
+            if (a.second != b.second) return a.second < b.second;
+            if (cities.population(a.first) != cities.population(b.first)) {
+                return cities.population(a.first) > cities.population(b.first);
+            }
+            return a.first < b.first;
+        });
+        CHECK(cities.fuzzyFind(query, cities.size()) == expected);
+        if (expected.size() > 5) expected.resize(5);
+        CHECK(cities.fuzzyFind(query, 5) == expected);
+    }
+}
+
+//  complete returns the first names a scan finds under a prefix, in name or population order, both
+//  History queries match the rows a word by word scan selects, with OR and AND in any case and a
+//  quoted "or" searched for as a word, before and after texts are rewritten
+void testHistory() {
+    static constexpr std::string_view WORDS[] = {"roman", "Greek", "port", "or", "and", "walls", "city", "colony"};
+    std::mt19937 random(47);
+    auto randomText = [&] {
+        std::string text;
+        for (std::size_t i = 0, count = 2 + random() % 5; i < count; ++i) {
+            text.append(i == 0 ? "" : " ").append(WORDS[random() % std::size(WORDS)]);
+        }
+        return text;
+    };
+    CityTable cities = randomTable(random, 1500);
+    for (RowId row = 0; row < cities.size(); ++row) cities.update(row, "history", randomText());
+    cities.searchHistory("roman");
+
+    auto words = [](const std::string_view text) {
+        std::set<std::string> found;
+        std::string word;
+        std::istringstream in{std::string(text)};
+        while (in >> word) found.insert(foldCase(word));
+        return found;
+    };
+    auto check = [&] {
+        static constexpr std::string_view OPERATORS[] = {" ", " or ", " OR ", " Or ", " and ", " AND "};
+        for (int i = 0; i < 200; ++i) {
+            //  Groups of words to be found together, split where the query says OR in any case
+            std::vector<std::vector<std::string>> groups(1);
+            std::string query;
+            for (std::size_t j = 0, count = 1 + random() % 4; j < count; ++j) {
+                std::string word(WORDS[random() % 3 + (random() % 2) * 5]);
+                if (random() % 4 == 0) word = "\"or\"";
+                if (j > 0) {
+                    const std::string_view op = OPERATORS[random() % std::size(OPERATORS)];
+                    if (foldCase(op) == " or ") groups.emplace_back();
+                    query += op;
+                }
+                query += word;
+                groups.back().push_back(foldCase(word == "\"or\"" ? "or" : word));
+            }
+            std::vector<RowId> expected;
+            for (RowId row = 0; row < cities.size(); ++row) {
+                if (!cities.alive(row)) continue;
+                const std::set<std::string> text = words(cities.history(row));
+                const bool matches = std::any_of(groups.begin(), groups.end(), [&](const auto& group) {
+                    return std::all_of(group.begin(), group.end(), [&](const std::string& word) { return text.count(word) > 0; });
+                });
+                if (matches) expected.push_back(row);
+            }
+            CHECK(cities.searchHistory(query) == expected);
+        }
+    };
+    check();
+    for (int i = 0; i < 600; ++i) cities.update(randomLiveRow(cities, random), "history", randomText());
+    for (int i = 0; i < 200; ++i) changeRandom(cities, random);
+    check();
+}
+
+//  while changed rows wait in the index's pending list and after they are merged
+void testComplete() {
+    std::mt19937 random(37);
+    CityTable cities = randomTable(random, 3000);
+    cities.complete("", 1, false);
+
+    auto check = [&]() {
+        for (int i = 0; i < 200; ++i) {
+            std::string prefix(cities.name(randomLiveRow(cities, random)));
+            prefix.resize(std::min<std::size_t>(prefix.size(), random() % 5));
+            if (random() % 2) std::transform(prefix.begin(), prefix.end(), prefix.begin(), ::toupper);
+            const std::size_t limit = 1 + random() % 40;
+            const bool byPopulation = random() % 2;
+
+            std::vector<RowId> matches;
+            for (RowId row = 0; row < cities.size(); ++row) {
+                if (cities.alive(row) && foldCase(cities.name(row)).starts_with(foldCase(prefix))) matches.push_back(row);
+            }
+            std::vector<std::string> expected;
+            if (byPopulation) {
+                std::sort(matches.begin(), matches.end(), [&](const RowId a, const RowId b) {
+                    return cities.population(a) > cities.population(b);
+                });
+                for (const RowId row : matches) expected.push_back(std::to_string(cities.population(row)));
+            } else {
+                for (const RowId row : matches) expected.push_back(foldCase(cities.name(row)));
+                std::sort(expected.begin(), expected.end());
+            }
+            if (expected.size() > limit) expected.resize(limit);
+
+            //  Rows that tie may come in any order, their keys may not
+            const std::vector<RowId> found = cities.complete(prefix, limit, byPopulation);
+            std::vector<std::string> keys;
+            for (const RowId row : found) {
+                CHECK(cities.alive(row));
+                CHECK(foldCase(cities.name(row)).starts_with(foldCase(prefix)));
+                keys.push_back(byPopulation ? std::to_string(cities.population(row)) : foldCase(cities.name(row)));
+            }
+            CHECK(std::set<RowId>(found.begin(), found.end()).size() == found.size());
+            CHECK(keys == expected);
+        }
+    };
+    for (int i = 0; i < 300; ++i) changeRandom(cities, random);
+    check();
+    for (int i = 0; i < 2000; ++i) changeRandom(cities, random);
+    check();
+
+    //  The loaders take negative populations, such rows are still live and rank below the others
+    for (int i = 0; i < 500; ++i) {
+        const int population = i % 50 == 0 ? std::numeric_limits<int>::min() : -1 - static_cast<int>(random() % 3);
+        cities.update(randomLiveRow(cities, random), "population", population);
+    }
+    check();
+}
+
+//  Every cos(D) kernel the CPU supports gives the scalar pair distance for lengths around its vector
+//  widths, from unaligned starts, and writes nothing past the end
+void testDistanceKernels() {
+    std::mt19937 random(43);
+    std::vector<double> latitudes(80), longitudes(80);
+    for (std::size_t i = 0; i < latitudes.size(); ++i) {
+        latitudes[i] = uniform(random, -90.0, 90.0);
+        longitudes[i] = uniform(random, -180.0, 180.0);
+    }
+    DistanceCalculator::TrigCache cache;
+    cache.assign(latitudes.data(), longitudes.data(), latitudes.size());
+
+    for (const DistanceCalculator::CosineKernel kernel : DistanceCalculator::cosineKernels()) {
+        for (const std::size_t n : {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 63, 65}) {
+            const std::size_t begin = 1 + random() % 8;
+            const double latitude = uniform(random, -90.0, 90.0), longitude = uniform(random, -180.0, 180.0);
+            const double lat = latitude * M_PI / 180.0, lon = longitude * M_PI / 180.0;
+            std::vector<double> out(n + 1, -7.0);
+            kernel(sin(lat), cos(lat), sin(lon), cos(lon), cache.sinLat.data() + begin, cache.cosLat.data() + begin,
+                   cache.sinLon.data() + begin, cache.cosLon.data() + begin, n, out.data());
+            for (std::size_t i = 0; i < n; ++i) {
+                const double km = acos(std::clamp(out[i], -1.0, 1.0)) * DistanceCalculator::EARTH_RADIUS_KM;
+                const double expected = DistanceCalculator::calculateDistance(latitude, longitude, latitudes[begin + i],
+                                                                              longitudes[begin + i]);
+                CHECK(std::abs(km - expected) <= 1e-6);
+            }
+            CHECK(out[n] == -7.0);
+        }
+    }
+}
+
+UnitVector randomPoint(std::mt19937& random) {
+    return UnitVector::fromDegrees(uniform(random, -90.0, 90.0), uniform(random, -180.0, 180.0));
+}
+
+//  nearest returns the k rows a scan ranks closest, both with moved and added rows pending and after
+//  the tree is rebuilt
+void testNearest() {
+    std::mt19937 random(41);
+    CityTable cities = randomTable(random, 3000);
+    cities.nearest(UnitVector{}, 1);
+
+    auto check = [&]() {
+        for (int i = 0; i < 200; ++i) {
+            const UnitVector query = randomPoint(random);
+            const std::size_t k = 1 + random() % 50;
+            std::vector<std::pair<double, RowId>> expected;
+            for (RowId row = 0; row < cities.size(); ++row) {
+                if (!cities.alive(row)) continue;
+                const UnitVector position = cities.position(row);
+                const double dx = query.x - position.x, dy = query.y - position.y, dz = query.z - position.z;
+                expected.emplace_back(dx * dx + dy * dy + dz * dz, row);
+            }
+            std::sort(expected.begin(), expected.end());
+            expected.resize(std::min(k, expected.size()));
+
+            const auto found = cities.nearest(query, k);
+            CHECK(found.size() == expected.size());
+            for (std::size_t j = 0; j < std::min(found.size(), expected.size()); ++j) {
+                CHECK(found[j].row == expected[j].second);
+                CHECK(found[j].chordSquared == expected[j].first);
+            }
+        }
+    };
+    for (int i = 0; i < 300; ++i) changeRandom(cities, random);
+    check();
+    for (int i = 0; i < 3000; ++i) changeRandom(cities, random);
+    check();
+}
+
+//  within returns, in row order, the rows whose great circle distance a scan finds inside the radius.
+//  Rows within a metre of the edge may fall either way and are left out of the comparison.
+void testWithin() {
+    std::mt19937 random(43);
+    CityTable cities = randomTable(random, 3000);
+    DistanceCalculator::within(cities, UnitVector{}, 1.0);
+
+    auto check = [&]() {
+        for (int i = 0; i < 200; ++i) {
+            const UnitVector from = randomPoint(random);
+            const double km = i % 20 == 0 ? 30000.0 : std::pow(10.0, uniform(random, 1.0, 4.0));
+            auto edge = [&](const RowId row) {
+                return std::abs(DistanceCalculator::calculateDistance(from, cities.position(row)) - km) < 1e-3;
+            };
+
+            std::vector<RowId> expected;
+            for (RowId row = 0; row < cities.size(); ++row) {
+                if (cities.alive(row) && !edge(row) &&
+                    DistanceCalculator::calculateDistance(from, cities.position(row)) <= km) {
+                    expected.push_back(row);
+                }
+            }
+            const std::vector<RowId> found = DistanceCalculator::within(cities, from, km);
+            CHECK(std::is_sorted(found.begin(), found.end()));
+            std::vector<RowId> compared;
+            for (const RowId row : found) {
+                CHECK(cities.alive(row));
+                if (!edge(row)) compared.push_back(row);
+            }
+            CHECK(compared == expected);
+        }
+    };
+    for (int i = 0; i < 300; ++i) changeRandom(cities, random);
+    check();
+    for (int i = 0; i < 3000; ++i) changeRandom(cities, random);
+    check();
+}
+
+//  Random display queries select and order the same rows as evaluating their conditions row by row
+void testDisplayQuery() {
+    std::mt19937 random(47);
+    CityTable cities = randomTable(random, 4000);
+    for (int i = 0; i < 1000; ++i) changeRandom(cities, random);
+
+    static constexpr std::string_view OPS[] = {"=", "!=", "<", "<=", ">", ">="};
+    static constexpr CityField FIELDS[] = {CityField::Name, CityField::Country, CityField::Population,
+                                           CityField::RecordYear, CityField::Latitude};
+    struct Condition {
+        CityField field;
+        std::size_t op;
+        double number;
+        std::string text;
+    };
+    auto passes = [&](const RowId row, const Condition& condition) {
+        auto compare = [&](const auto& value, const auto& wanted) {
+            switch (condition.op) {
+                case 0: return value == wanted;
+                case 1: return value != wanted;
+                case 2: return value < wanted;
+                case 3: return value <= wanted;
+                case 4: return value > wanted;
+                default: return value >= wanted;
+            }
+        };
+        switch (condition.field) {
+            case CityField::Name: return compare(cities.name(row), std::string_view(condition.text));
+            case CityField::Country: return compare(cities.country(row), std::string_view(condition.text));
+            case CityField::Population: return compare(double(cities.population(row)), condition.number);
+            case CityField::RecordYear: return compare(double(cities.recordYear(row)), condition.number);
+            default: return compare(cities.latitude(row), condition.number);
+        }
+    };
+
+    for (int i = 0; i < 300; ++i) {
+        std::string text = "name,population";
+        std::vector<std::vector<Condition>> groups(random() % 4);
+        for (std::size_t g = 0; g < groups.size(); ++g) {
+            text += g == 0 ? " where " : " or ";
+            groups[g].resize(1 + random() % 3);
+            for (std::size_t c = 0; c < groups[g].size(); ++c) {
+                Condition& condition = groups[g][c];
+                condition.field = FIELDS[random() % std::size(FIELDS)];
+                condition.op = random() % std::size(OPS);
+                const RowId sample = randomLiveRow(cities, random);
+                std::string value;
+                switch (condition.field) {
+                    case CityField::Name: value = "\"" + (condition.text = cities.name(sample)) + "\""; break;
+                    case CityField::Country: value = "\"" + (condition.text = cities.country(sample)) + "\""; break;
+                    case CityField::Population: value = std::to_string(cities.population(sample)); break;
+                    case CityField::RecordYear: value = std::to_string(cities.recordYear(sample)); break;
+                    default: AggregateTotals::appendNumber(value, cities.latitude(sample)); break;
+                }
+                if (isNumericField(condition.field)) std::from_chars(value.data(), value.data() + value.size(), condition.number);
+                text.append(c == 0 ? "" : " and ").append(fieldName(condition.field)).append(" ");
+                text.append(OPS[condition.op]).append(" ").append(value);
+            }
+        }
+        const bool ordered = random() % 3 != 0;
+        const CityField orderField = FIELDS[random() % std::size(FIELDS)];
+        const bool descending = random() % 2;
+        if (ordered) text.append(" order by ").append(fieldName(orderField)).append(descending ? " desc" : " asc");
+        const std::size_t limit = random() % 2 ? 1 + random() % 100 : std::numeric_limits<std::size_t>::max();
+        if (limit != std::numeric_limits<std::size_t>::max()) text += " limit " + std::to_string(limit);
+
+        std::vector<RowId> expected;
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (!cities.alive(row)) continue;
+            bool selected = groups.empty();
+            for (const auto& group : groups) {
+                selected = selected || std::all_of(group.begin(), group.end(), [&](const Condition& condition) {
+                    return passes(row, condition);
+                });
+            }
+            if (selected) expected.push_back(row);
+        }
+        if (ordered) {
+            auto key = [&](const RowId row) -> std::pair<double, std::string_view> {
+                switch (orderField) {
+                    case CityField::Name: return {0.0, cities.name(row)};
+                    case CityField::Country: return {0.0, cities.country(row)};
+                    case CityField::Population: return {double(cities.population(row)), {}};
+                    case CityField::RecordYear: return {double(cities.recordYear(row)), {}};
+                    default: return {cities.latitude(row), {}};
+                }
+            };
+            std::stable_sort(expected.begin(), expected.end(), [&](const RowId a, const RowId b) {
+                return descending ? key(b) < key(a) : key(a) < key(b);
+            });
+        }
+        if (expected.size() > limit) expected.resize(limit);
+
+        DisplayQuery query;
+        CHECK(query.parse(text));
+        const std::vector<RowId> found = query.run(cities);
+        if (found != expected) std::cerr << "Query: " << text << "\n";
+        CHECK(found == expected);
+    }
+}
+
+//  GroupBy gives every group a scan builds with the same count and aggregates, across more rows than
+//  one chunk so partial tables get merged
+void testGroupBy() {
+    std::mt19937 random(53);
+    CityTable cities = randomTable(random, 70000);
+    for (int i = 0; i < 5000; ++i) changeRandom(cities, random);
+
+    const std::vector<Aggregate> aggregates = {{AggregateKind::Count, CityField::Population},
+                                               {AggregateKind::Sum, CityField::Population},
+                                               {AggregateKind::Min, CityField::Latitude},
+                                               {AggregateKind::Max, CityField::RecordYear},
+                                               {AggregateKind::Avg, CityField::Longitude}};
+    auto same = [](const double a, const double b) { return std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(a)); };
+
+    auto check = [&](const CityField by, auto&& keyOf) {
+        using Key = std::decay_t<decltype(keyOf(RowId{}))>;
+        std::map<Key, std::vector<RowId>> groups;
+        for (RowId row = 0; row < cities.size(); ++row) {
+            if (cities.alive(row)) groups[keyOf(row)].push_back(row);
+        }
+        //  One thread, as on the server, and all of them
+        for (const std::size_t threads : {std::size_t(1), std::size_t(std::thread::hardware_concurrency())}) {
+            const std::vector<GroupBy::Group> found = GroupBy::run(cities, by, aggregates, threads);
+            CHECK(found.size() == groups.size());
+            auto group = found.begin();
+            for (const auto& [key, rows] : groups) {
+                if (group == found.end()) break;
+                std::string text;
+                if constexpr (std::is_same_v<Key, std::string_view>) text = key;
+                else AggregateTotals::appendNumber(text, key);
+                CHECK(group->key == text);
+                CHECK(group->totals.count == rows.size());
+
+                double sum = 0.0, low = std::numeric_limits<double>::infinity(), high = -low, longitudes = 0.0;
+                for (const RowId row : rows) {
+                    sum += cities.population(row);
+                    low = std::min(low, cities.latitude(row));
+                    high = std::max(high, double(cities.recordYear(row)));
+                    longitudes += cities.longitude(row);
+                }
+                CHECK(same(group->totals.values[1], sum));
+                CHECK(group->totals.values[2] == low);
+                CHECK(group->totals.values[3] == high);
+                CHECK(same(group->totals.values[4] / double(rows.size()), longitudes / double(rows.size())));
+                ++group;
+            }
+        }
+    };
+    check(CityField::Country, [&](const RowId row) { return cities.country(row); });
+    check(CityField::Name, [&](const RowId row) { return cities.name(row); });
+    check(CityField::RecordYear, [&](const RowId row) { return cities.recordYear(row); });
+    check(CityField::Population, [&](const RowId row) { return cities.population(row); });
+    check(CityField::Latitude, [&](const RowId row) { return cities.latitude(row); });
+}
+
+#ifdef CITIES_SERVER
+//  Connects to the server socket, waiting for the server to start listening. -1 if it never does.
+int connectServer(const std::string& socketPath) {
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        const int client = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        if (::connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) return client;
+        ::close(client);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+//  Sends the session one command per line, closes the sending side and returns every answer
+std::string exchange(const int client, const std::vector<std::string>& session) {
+    std::string request;
+    for (const std::string& line : session) request += line + "\n";
+    for (std::size_t sent = 0; sent < request.size();) {
+        const ssize_t put = ::send(client, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (put <= 0) break;
+        sent += static_cast<std::size_t>(put);
+    }
+    ::shutdown(client, SHUT_WR);
+    std::string response;
+    char chunk[4096];
+    for (ssize_t got; (got = ::recv(client, chunk, sizeof(chunk), 0)) > 0;) response.append(chunk, static_cast<std::size_t>(got));
+    ::close(client);
+    return response;
+}
+
+//  A server on a Unix socket answers a pipelined session like script mode does, refuses the commands
+//  that touch files or add and remove cities, keeps its socket private and stops on SIGTERM
+void testServer(const std::string& directory) {
+    std::mt19937 random(59);
+    CityTable cities = randomTable(random, 50);
+    cities.add("Testville", "Norway", 1000, 1990, 60.0, 10.0, "Mayor", "Address", "History");
+    const std::string file = directory + "/server.snapshot";
+    const std::string socketPath = directory + "/server.sock";
+    CHECK(FileManager::saveData(cities, file));
+
+    int status = -1;
+    std::thread server([&] {
+        status = QueryServer::run({socketPath, file, "--threads", "2"});
+    });
+    const int client = connectServer(socketPath);
+    CHECK(client >= 0);
+    if (client < 0) {
+        server.detach();
+        return;
+    }
+    struct stat info {};
+    CHECK(::stat(socketPath.c_str(), &info) == 0 && (info.st_mode & 0777) == 0600);
+
+    const std::vector<std::string> session = {
+        "search Testville", "load " + file, "save " + file, "add Newtown Norway 1 2000 1.0 1.0 M A H",
+        "delete Testville", "update Testville population 4242", "search Testville", "nearest Testville 3",
+        "groupby country count sum(population)", "complete Te 5"};
+    const std::string response = exchange(client, session);
+
+    CityTable local = FileManager::loadData(file);
+    Journal journal;
+    BatchCommands commands(local, journal);
+    std::string expected;
+    for (const std::string& line : session) {
+        const std::string_view command = BatchCommands::commandOf(line);
+        if (command == "load" || command == "save" || command == "add" || command == "delete") {
+            expected.append("ERR command '").append(command).append("' is not available on the server\n");
+        } else {
+            commands.execute(line, expected);
+        }
+    }
+    CHECK(response == expected);
+    CHECK(response.find("Testville\tNorway\t4242") != std::string::npos);
+
+    std::raise(SIGTERM);
+    server.join();
+    CHECK(status == 0);
+    CHECK(!std::filesystem::exists(socketPath));
+}
+
+//  Updates a server already serves are answered as made when the journal cannot be written, and every
+//  update after that is refused. The journal is pointed at /dev/full, where every write fails.
+void testServerJournalFailure(const std::string& directory) {
+    if (!std::filesystem::is_character_file("/dev/full")) return;
+    std::mt19937 random(61);
+    CityTable cities = randomTable(random, 20);
+    cities.add("Testville", "Norway", 1000, 1990, 60.0, 10.0, "Mayor", "Address", "History");
+    const std::string file = directory + "/full.snapshot";
+    const std::string socketPath = directory + "/full.sock";
+    CHECK(FileManager::saveData(cities, file));
+    std::filesystem::create_symlink("/dev/full", file + ".journal");
+
+    int status = -1;
+    std::thread server([&] {
+        status = QueryServer::run({socketPath, file, "--threads", "2"});
+    });
+    const int client = connectServer(socketPath);
+    CHECK(client >= 0);
+    if (client < 0) {
+        server.detach();
+        return;
+    }
+    const std::vector<std::string> session = {"update Testville population 4242", "search Testville",
+                                              "update Testville population 5353", "search Testville"};
+    const std::string response = exchange(client, session);
+
+    CityTable local = FileManager::loadData(file);
+    Journal journal;
+    BatchCommands commands(local, journal);
+    std::string expected;
+    commands.execute(session[0], expected);
+    commands.execute(session[1], expected);
+    expected += "ERR cannot write journal\n";
+    commands.execute(session[3], expected);
+    CHECK(response == expected);
+    CHECK(response.find("Testville\tNorway\t4242") != std::string::npos);
+
+    std::raise(SIGTERM);
+    server.join();
+    CHECK(status == 0);
+}
+
+//  A server started without a file settles its empty table before the workers start, so concurrent
+//  clients all get the answers of script mode over an empty table. Without a journal it takes no update.
+void testServerWithoutFile(const std::string& directory) {
+    const std::string socketPath = directory + "/empty.sock";
+    int status = -1;
+    std::thread server([&] {
+        status = QueryServer::run({socketPath, "--threads", "4"});
+    });
+    const std::vector<std::string> session = {
+        "search Paris", "complete Pa 5", "fuzzy Paris 1", "history roman", "nearest Paris 3",
+        "within Paris 100", "groupby country count", "display name where population > 0 limit 5", "stats country",
+        "update Paris population 1"};
+    CityTable local;
+    Journal journal;
+    BatchCommands commands(local, journal);
+    std::string expected;
+    for (std::size_t i = 0; i + 1 < session.size(); ++i) commands.execute(session[i], expected);
+    expected += "ERR updates need the server to run on a snapshot file\n";
+
+    std::vector<std::string> responses(8);
+    std::vector<std::thread> clients;
+    for (std::string& response : responses) {
+        clients.emplace_back([&] {
+            const int client = connectServer(socketPath);
+            if (client >= 0) response = exchange(client, session);
+        });
+    }
+    for (std::thread& client : clients) client.join();
+    for (const std::string& response : responses) CHECK(response == expected);
+
+    std::raise(SIGTERM);
+    server.join();
+    CHECK(status == 0);
+}
+#endif
+
+}  // namespace
+
+int main() {
+    const std::string directory =
+        (std::filesystem::temp_directory_path() / ("cities_world_tests_" + std::to_string(std::random_device()()))).string();
+    std::filesystem::create_directories(directory);
+
+    testJournalReplay(directory);
+    testSnapshotRoundTrip(directory);
+    testDistanceMatrix(directory);
+    testStreamQuery(directory);
+    testFuzzyFind();
+    testHistory();
+    testComplete();
+    testDistanceKernels();
+    testNearest();
+    testWithin();
+    testDisplayQuery();
+    testGroupBy();
+    testCountryStats();
+    testSortedIndexes();
+    testScript(directory);
+#ifdef CITIES_SERVER
+    testServer(directory);
+    testServerWithoutFile(directory);
+    testServerJournalFailure(directory);
+#endif
+
+    std::filesystem::remove_all(directory);
+    if (failures > 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "All tests passed\n";
+    return 0;
+}